@@ -24,6 +24,11 @@
 #else
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
+
+#ifndef AESD_NR_DEVS
+#define AESD_NR_DEVS 1    /* aesdchar minors, aesdsocket -n channels use one each */
+#endif
+
 struct aesd_dev
 {
     /**
@@ -24,11 +24,13 @@
 # include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
+int aesd_nr_devs = AESD_NR_DEVS; // one independent log per minor
+module_param(aesd_nr_devs, int, S_IRUGO);
 
 MODULE_AUTHOR("Iosif Futerman"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices; // aesd_nr_devs devices, minor aesd_minor + index
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
@@ -48,12 +50,12 @@ int aesd_release(struct inode *inode, struct file *filp)
   return 0;
 }
 
-void printBuffer(void);
-void printBuffer(){
+void printBuffer(struct aesd_dev *dev);
+void printBuffer(struct aesd_dev *dev){
 	uint8_t index;
 	struct aesd_buffer_entry *entry;
 	PDEBUG("PRINT BUFFER START");	
-	AESD_CIRCULAR_BUFFER_FOREACH(entry,&aesd_device.circular_buffer,index) {
+	AESD_CIRCULAR_BUFFER_FOREACH(entry,&dev->circular_buffer,index) {
 		if(entry->buffptr){
 			PDEBUG("Entry i:%d buffptr:%s", index, entry->buffptr);
 		}
@@ -261,63 +263,87 @@ struct file_operations aesd_fops = {
     .unlocked_ioctl = aesd_ioctl,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
+static void aesd_free_device(struct aesd_dev *dev)
+{
+	uint8_t index;
+	struct aesd_buffer_entry *entry;
+
+	AESD_CIRCULAR_BUFFER_FOREACH(entry,&dev->circular_buffer,index) {
+		if(entry->buffptr){
+			kfree(entry->buffptr);
+		}
+	}  
+	mutex_destroy(&dev->mutex_lock);
+}
+
 
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
-    int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    int result, i;
+    if (aesd_nr_devs <= 0) {
+        printk(KERN_WARNING "Invalid aesd_nr_devs %d\n", aesd_nr_devs);
+        return -EINVAL;
+    }
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
-
-
-		mutex_init(&aesd_device.mutex_lock);
-		aesd_circular_buffer_init(&aesd_device.circular_buffer);
-    result = aesd_setup_cdev(&aesd_device);
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        unregister_chrdev_region(dev, aesd_nr_devs);
+        return -ENOMEM;
+    }
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    for (i = 0; i < aesd_nr_devs; i++) {
+		mutex_init(&aesd_devices[i].mutex_lock);
+		aesd_circular_buffer_init(&aesd_devices[i].circular_buffer);
+        result = aesd_setup_cdev(&aesd_devices[i], i);
+        if (result) {
+            /* Devices added so far are removed, the failed one was never live */
+            aesd_free_device(&aesd_devices[i]);
+            while (i--) {
+                cdev_del(&aesd_devices[i].cdev);
+                aesd_free_device(&aesd_devices[i]);
+            }
+            kfree(aesd_devices);
+            unregister_chrdev_region(dev, aesd_nr_devs);
+            return result;
+        }
     }
-    return result;
+    return 0;
 
 }
 
 void aesd_cleanup_module(void)
 {
-	uint8_t index;
-	struct aesd_buffer_entry *entry;
+	int i;
 	dev_t devno = MKDEV(aesd_major, aesd_minor);
 
-	cdev_del(&aesd_device.cdev);
-
-
-	AESD_CIRCULAR_BUFFER_FOREACH(entry,&aesd_device.circular_buffer,index) {
-		if(entry->buffptr){
-			kfree(entry->buffptr);
-		}
-	}  
-	mutex_destroy(&aesd_device.mutex_lock);
-  unregister_chrdev_region(devno, 1);
+	for (i = 0; i < aesd_nr_devs; i++) {
+		cdev_del(&aesd_devices[i].cdev);
+		aesd_free_device(&aesd_devices[i]);
+	}
+	kfree(aesd_devices);
+  unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
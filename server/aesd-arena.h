@@ -0,0 +1,73 @@
+/**
+ * @file aesd-arena.h
+ * @brief Per-connection arenas of aesdsocket recycled through a free list
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_ARENA_H
+#define AESD_ARENA_H
+
+#include <stddef.h>
+#include <stdalign.h>
+
+#define ARENA_BYTES 8192 // connection object, peer address and the first framing buffer
+#define ARENA_CACHE_MAX 64 // released arenas kept on the free list, the rest go back to the heap
+
+/*
+ * Memory of one connection. Handed out by bumping used, released as a whole
+ */
+struct arena {
+	struct arena* next; /* Link in the free list */
+	char* scratch; /* -c readback_chunk response buffer, allocated on first use and kept while recycled */
+	size_t used; /* Bytes of mem handed out */
+	alignas(16) char mem[ARENA_BYTES];
+};
+
+/**
+ * @brief This function takes an empty arena from the free list or allocates a new one
+ *
+ * @return arena or NULL when out of memory
+ */
+struct arena* arena_get();
+/**
+ * @brief This function resets an arena and returns it to the free list. Everything
+ * allocated from it, including the scratch buffer, must not be used any more
+ *
+ * @param a arena of a closed connection, may be NULL
+ * @return void
+ */
+void arena_put(struct arena* a);
+/**
+ * @brief This function allocates from the arena. The memory is 16-byte aligned and not cleared
+ *
+ * @param a arena
+ * @param size bytes wanted
+ * @return memory or NULL when the arena is full
+ */
+void* arena_alloc(struct arena* a, size_t size);
+/**
+ * @brief This function allocates what is left of the arena, at most max bytes
+ *
+ * @param a arena
+ * @param max most bytes wanted
+ * @param size receives the allocated size, 0 when the arena is full
+ * @return memory or NULL when the arena is full
+ */
+void* arena_rest(struct arena* a, size_t max, size_t* size);
+/**
+ * @brief This function returns the -c readback_chunk scratch buffer of the arena
+ *
+ * @param a arena
+ * @return buffer or NULL when out of memory
+ */
+char* arena_scratch(struct arena* a);
+/**
+ * @brief This function frees the arenas on the free list. Called once the engines stopped
+ *
+ * @return void
+ */
+void arena_drain();
+
+#endif /* AESD_ARENA_H */
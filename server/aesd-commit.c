@@ -0,0 +1,290 @@
+/**
+ * @file aesd-commit.c
+ * @brief Group commit of packets to the aesdsocket conversation log.
+ * Committing threads queue their packets under the log mutex. The first of
+ * them becomes the writer: it optionally waits for the batching window,
+ * takes up to max_batch packets, writes them with one writev outside the
+ * lock and wakes the threads whose packets were written. With -n every
+ * channel is a separate log with its own mutex, file and writer, so
+ * producers of different channels never wait for each other.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "aesdsocket.h"
+#include "aesd-commit.h"
+#include "aesd-ring.h"
+#include "aesd-segment.h"
+#include "aesd-subscribe.h"
+#include "aesd-log.h"
+#include "aesd-metrics.h"
+
+/*
+ * Packet waiting in the batch, lives on the stack of the committing thread
+ */
+struct commit_req {
+	const char* buf; /* Packet */
+	size_t len; /* Packet length */
+	off_t end; /* Log length including the packet, set by the writer */
+	int res; /* Write result, set by the writer */
+	int done; /* Packet is written */
+	struct commit_req* next;
+};
+
+/*
+ * Log of one channel with its own group commit
+ */
+struct commit_log {
+	pthread_mutex_t lock; /* Guards everything below */
+	pthread_cond_t written; /* A batch has been written */
+	pthread_cond_t full; /* The batch reached max_batch */
+	struct commit_req* first; /* Queued packets in arrival order */
+	struct commit_req** last;
+	int queued;
+	int writing; /* A writer owns the log descriptor */
+	off_t size; /* Committed length of the regular-file or segmented log */
+	int fd;
+};
+
+static struct commit_log g_logs[CHANNEL_MAX];
+static int g_channels = 0;
+static int g_max_batch = COMMIT_BATCH_DEFAULT;
+static long g_latency_us = 0;
+
+int commit_start(int max_batch, long latency_us, int truncate){
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	g_max_batch = max_batch > IOV_MAX ? IOV_MAX : max_batch;
+	g_latency_us = latency_us;
+	for(; g_channels < g_config.channels; g_channels++){
+		struct commit_log* log = &g_logs[g_channels];
+		pthread_mutex_init(&log->lock, NULL);
+		pthread_cond_init(&log->full, &attr);
+		pthread_cond_init(&log->written, NULL);
+		log->first = NULL;
+		log->last = &log->first;
+		log->queued = 0;
+		log->writing = 0;
+		log->fd = -1;
+		if(g_config.backend == BACKEND_SEGMENT){
+			/* Batches are appended by segment_append, there is no descriptor to open */
+			log->size = segment_end();
+			continue;
+		}
+		char path[PATH_MAX];
+		channel_path(g_channels, path);
+		log->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | (truncate ? O_TRUNC : 0), 0666);
+		if(log->fd == -1){
+			aesd_log(LOG_ERR, "open of %s FAILED error:%s", path, strerror(errno));
+			pthread_condattr_destroy(&attr);
+			return -1;
+		}
+		/* A log taken over from the previous server is continued */
+		struct stat st;
+		log->size = !truncate && !USE_AESD_CHAR_DEVICE && !fstat(log->fd, &st) ? st.st_size : 0;
+	}
+	pthread_condattr_destroy(&attr);
+	aesd_log(LOG_INFO, "Commit batches of %d packets, window %ld us, %d channels", g_max_batch, g_latency_us, g_channels);
+	return 0;
+}
+
+void commit_stop(){
+	for(; g_channels > 0; g_channels--){
+		struct commit_log* log = &g_logs[g_channels - 1];
+		if(log->fd != -1){
+			/* The log may be continued by a successor or read after a crash of the host */
+			if(!USE_AESD_CHAR_DEVICE && fdatasync(log->fd)){
+				aesd_log(LOG_WARNING, "fdatasync FAILED error:%s", strerror(errno));
+			}
+			close(log->fd);
+			log->fd = -1;
+		}
+		pthread_cond_destroy(&log->full);
+		pthread_cond_destroy(&log->written);
+		pthread_mutex_destroy(&log->lock);
+	}
+}
+
+/*
+ * Writes the whole iovec array, resuming after partial writes. The caller's
+ * array is left intact, it is published to the subscribers afterwards.
+ * written is set to the bytes that stay in the log, also on a failure
+ */
+static int write_batch(struct commit_log* log, const struct iovec* packets, int count, size_t* written){
+	if(g_config.backend == BACKEND_SEGMENT){
+		return segment_append(packets, count, written);
+	}
+	*written = 0;
+	struct iovec left[count];
+	struct iovec* iov = left;
+	memcpy(left, packets, count * sizeof(struct iovec));
+	while(count){
+		ssize_t res = writev(log->fd, iov, count);
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			aesd_log(LOG_ERR, "writev FAILED error:%s", strerror(errno));
+			/* A regular file is cut back to whole packets, the device keeps what it took */
+			if(*written && !USE_AESD_CHAR_DEVICE && !ftruncate(log->fd, log->size)){
+				*written = 0;
+			}
+			return -1;
+		}
+		*written += res;
+		while(count && (size_t)res >= iov->iov_len){
+			res -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count){
+			iov->iov_base = (char*)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Called with the lock held by the thread which became the writer
+ */
+static void write_queued(struct commit_log* log){
+	if(g_latency_us && log->queued < g_max_batch){
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += (g_latency_us % 1000000) * 1000;
+		deadline.tv_sec += g_latency_us / 1000000 + deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		while(log->queued < g_max_batch){
+			if(pthread_cond_timedwait(&log->full, &log->lock, &deadline) == ETIMEDOUT){
+				break;
+			}
+		}
+	}
+	struct iovec iov[g_max_batch];
+	struct commit_req* batch = log->first;
+	struct commit_req* req = batch;
+	int count = 0;
+	for(; req && count < g_max_batch; req = req->next, count++){
+		iov[count].iov_base = (void*)req->buf;
+		iov[count].iov_len = req->len;
+	}
+	log->first = req;
+	if(!log->first){
+		log->last = &log->first;
+	}
+	log->queued -= count;
+	off_t base = log->size;
+	pthread_mutex_unlock(&log->lock);
+
+	size_t written;
+	int res = write_batch(log, iov, count, &written);
+	if(written && log == g_logs){
+		/* Still the writer, so batches reach the subscribers in log order */
+		int n = 0;
+		for(size_t left = written; left; n++){
+			if(iov[n].iov_len > left){
+				iov[n].iov_len = left;
+			}
+			left -= iov[n].iov_len;
+		}
+		subscribe_publish(base, iov, n);
+	}
+
+	pthread_mutex_lock(&log->lock);
+	/* Offsets of later packets follow whatever stayed in the log */
+	for(req = batch; count; req = req->next, count--){
+		size_t len = req->len < written ? req->len : written;
+		log->size += len;
+		written -= len;
+		req->res = res;
+		req->end = log->size;
+		req->done = 1;
+	}
+	log->writing = 0;
+	pthread_cond_broadcast(&log->written);
+}
+
+int commit_packet(int channel, const char* buf, size_t n_byte, off_t* snapshot){
+	uint64_t start = metrics_now();
+	if(g_config.backend == BACKEND_RING){
+		/* Appending to memory costs no syscall, there is nothing to batch */
+		int res = ring_append(buf, n_byte, snapshot);
+		if(n_byte){
+			metrics_since(METRIC_COMMIT, start);
+		}
+		return res;
+	}
+	struct commit_log* log = &g_logs[channel];
+	struct commit_req req = {buf, n_byte, 0, 0, 0, NULL};
+	pthread_mutex_lock(&log->lock);
+	metrics_since(METRIC_LOCK_WAIT, start);
+	if(n_byte){
+		*log->last = &req;
+		log->last = &req.next;
+		if(++log->queued >= g_max_batch){
+			pthread_cond_signal(&log->full);
+		}
+		while(!req.done){
+			if(!log->writing){
+				log->writing = 1;
+				write_queued(log);
+			}
+			else{
+				pthread_cond_wait(&log->written, &log->lock);
+			}
+		}
+	}
+	else{
+		req.end = log->size;
+	}
+	pthread_mutex_unlock(&log->lock);
+	if(n_byte){
+		metrics_since(METRIC_COMMIT, start);
+	}
+	if(snapshot){
+		*snapshot = USE_AESD_CHAR_DEVICE && g_config.backend == BACKEND_STORAGE ? -1 : req.end;
+	}
+	return req.res;
+}
+
+off_t commit_acquire(int* fd){
+	struct commit_log* log = g_logs;
+	pthread_mutex_lock(&log->lock);
+	while(log->writing){
+		pthread_cond_wait(&log->written, &log->lock);
+	}
+	log->writing = 1;
+	off_t size = log->size;
+	pthread_mutex_unlock(&log->lock);
+	*fd = log->fd;
+	return size;
+}
+
+void commit_release(size_t n_byte){
+	struct commit_log* log = g_logs;
+	pthread_mutex_lock(&log->lock);
+	log->size += n_byte;
+	log->writing = 0;
+	pthread_cond_broadcast(&log->written);
+	pthread_mutex_unlock(&log->lock);
+}
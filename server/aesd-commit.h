@@ -0,0 +1,64 @@
+/**
+ * @file aesd-commit.h
+ * @brief Group commit of packets to the aesdsocket conversation log
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_COMMIT_H
+#define AESD_COMMIT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define COMMIT_BATCH_DEFAULT 64 // packets written by one writev when -b is not given
+
+/**
+ * @brief This function opens the shared log descriptor of every channel all commits are written through
+ *
+ * @param max_batch maximum count of packets written by one writev
+ * @param latency_us time the first packet of a batch waits for others, 0 - no waiting
+ * @param truncate clear the log before the first commit, otherwise the regular file is continued
+ * @return success status 0 - success
+ */
+int commit_start(int max_batch, long latency_us, int truncate);
+/**
+ * @brief This function flushes the regular-file logs to disk and closes the shared log descriptors
+ *
+ * @return void
+ */
+void commit_stop();
+/**
+ * @brief This function appends a complete packet to the conversation log.
+ * Packets committed concurrently are gathered into a batch and the first
+ * waiting thread writes the whole batch with one writev, so every packet
+ * is in the log when its commit returns and batches keep the arrival order
+ *
+ * @param channel log of the packet, 0 - the default one. The ring and the segments have only 0
+ * @param buf packet
+ * @param n_byte packet length, 0 - only take the snapshot
+ * @param snapshot receives the log length including this packet, -1 for the char device.
+ * Bytes before it are never modified, so they may be read back without locking. May be NULL
+ * @return success status 0 - success
+ */
+int commit_packet(int channel, const char* buf, size_t n_byte, off_t* snapshot);
+/**
+ * @brief This function makes the caller the writer of the channel 0 log, as a group
+ * commit writer is, so the log may be appended by an asynchronous write. Other
+ * commits of the channel wait until commit_release
+ *
+ * @param fd receives the shared log descriptor
+ * @return log length before the caller appends
+ */
+off_t commit_acquire(int* fd);
+/**
+ * @brief This function accounts the bytes appended since commit_acquire
+ * and lets the other commits proceed
+ *
+ * @param n_byte count of appended bytes
+ * @return void
+ */
+void commit_release(size_t n_byte);
+
+#endif /* AESD_COMMIT_H */
@@ -0,0 +1,190 @@
+/**
+ * @file aesd-compress.c
+ * @brief Compressed read-back frames and the cache of compressed history.
+ * A compressed read-back is cut at multiples of COMPRESS_BLOCK and every
+ * piece is sent as a separate zlib stream made with a preset dictionary of
+ * the log lines. Bytes below the committed length are never modified, so
+ * the frame of a whole block is the same for every client. Those frames are
+ * cached per channel, a history is compressed once and copied afterwards.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "aesdsocket.h"
+#include "aesd-compress.h"
+#include "aesd-log.h"
+
+/*
+ * Cached frames of one channel. The window starts at the oldest retained
+ * block, so its size follows the retained history and not the log offset
+ */
+struct compress_log {
+	char** frames; /* Frame of block low + i, NULL - not cached */
+	size_t count; /* Entries of frames */
+	off_t low; /* Block of frames[0], blocks before it were trimmed */
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // guards everything below
+static struct compress_log g_logs[CHANNEL_MAX];
+static size_t g_cached = 0; // bytes of cached frames and of the windows
+static size_t g_limit = 0;
+
+int compress_start(size_t cache_bytes){
+	g_limit = cache_bytes;
+	aesd_log(LOG_INFO, "Compressed read-backs with zlib %s, cache of %zu bytes", zlibVersion(), cache_bytes);
+	return 0;
+}
+
+void compress_stop(){
+	pthread_mutex_lock(&g_lock);
+	for(int channel = 0; channel < CHANNEL_MAX; channel++){
+		struct compress_log* log = &g_logs[channel];
+		for(size_t i = 0; i < log->count; i++){
+			free(log->frames[i]);
+		}
+		free(log->frames);
+		memset(log, 0, sizeof(struct compress_log));
+	}
+	g_cached = 0;
+	pthread_mutex_unlock(&g_lock);
+}
+
+struct z_stream_s* compress_open(){
+	z_stream* zs = calloc(1, sizeof(z_stream));
+	if(!zs){
+		aesd_log(LOG_ERR, "calloc FAILED");
+		return NULL;
+	}
+	if(deflateInit(zs, COMPRESS_LEVEL) != Z_OK){
+		aesd_log(LOG_ERR, "deflateInit FAILED");
+		free(zs);
+		return NULL;
+	}
+	return zs;
+}
+
+void compress_close(struct z_stream_s* zs){
+	if(zs){
+		deflateEnd(zs);
+		free(zs);
+	}
+}
+
+ssize_t compress_frame(struct z_stream_s* zs, const char* data, size_t len, char* frame){
+	uint32_t size = 0;
+	if(len){
+		/* Every frame is a stream of its own, so cached frames can follow fresh ones */
+		if(deflateReset(zs) != Z_OK ||
+				deflateSetDictionary(zs, (const Bytef*)COMPRESS_DICTIONARY, sizeof(COMPRESS_DICTIONARY) - 1) != Z_OK){
+			aesd_log(LOG_ERR, "deflateReset FAILED");
+			return -1;
+		}
+		zs->next_in = (Bytef*)data;
+		zs->avail_in = len;
+		zs->next_out = (Bytef*)frame + 4;
+		zs->avail_out = COMPRESS_FRAME_MAX - 4;
+		if(deflate(zs, Z_FINISH) != Z_STREAM_END){
+			aesd_log(LOG_ERR, "deflate FAILED");
+			return -1;
+		}
+		size = zs->total_out;
+	}
+	uint32_t prefix = htonl(size);
+	memcpy(frame, &prefix, 4);
+	return 4 + size;
+}
+
+size_t compress_cached(int channel, off_t block, char* frame){
+	struct compress_log* log = &g_logs[channel];
+	size_t len = 0;
+	pthread_mutex_lock(&g_lock);
+	if(block >= log->low && (size_t)(block - log->low) < log->count && log->frames[block - log->low]){
+		char* cached = log->frames[block - log->low];
+		uint32_t prefix;
+		memcpy(&prefix, cached, 4);
+		len = 4 + ntohl(prefix);
+		memcpy(frame, cached, len);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return len;
+}
+
+void compress_cache(int channel, off_t block, const char* frame, size_t len){
+	struct compress_log* log = &g_logs[channel];
+	pthread_mutex_lock(&g_lock);
+	/* The oldest history is read back by every full reply, it stays */
+	if(g_cached + len > g_limit || block < log->low){
+		pthread_mutex_unlock(&g_lock);
+		return;
+	}
+	size_t index = block - log->low;
+	if(index >= log->count){
+		size_t count = log->count ? log->count : 64;
+		while(count <= index){
+			count *= 2;
+		}
+		/* The window is cache memory as well */
+		size_t grow = (count - log->count) * sizeof(char*);
+		if(g_cached + grow + len > g_limit){
+			pthread_mutex_unlock(&g_lock);
+			return;
+		}
+		char** frames = realloc(log->frames, count * sizeof(char*));
+		if(!frames){
+			pthread_mutex_unlock(&g_lock);
+			return;
+		}
+		memset(frames + log->count, 0, grow);
+		log->frames = frames;
+		log->count = count;
+		g_cached += grow;
+	}
+	if(!log->frames[index]){
+		log->frames[index] = malloc(len);
+		if(log->frames[index]){
+			memcpy(log->frames[index], frame, len);
+			g_cached += len;
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+}
+
+void compress_trim(int channel, off_t block){
+	struct compress_log* log = &g_logs[channel];
+	pthread_mutex_lock(&g_lock);
+	if(block <= log->low){
+		pthread_mutex_unlock(&g_lock);
+		return;
+	}
+	size_t drop = block - log->low;
+	if(drop > log->count){
+		drop = log->count;
+	}
+	for(size_t i = 0; i < drop; i++){
+		if(log->frames[i]){
+			uint32_t prefix;
+			memcpy(&prefix, log->frames[i], 4);
+			g_cached -= 4 + ntohl(prefix);
+			free(log->frames[i]);
+		}
+	}
+	/* Slide the window, the entries keep the room of the blocks to come */
+	if(drop){
+		memmove(log->frames, log->frames + drop, (log->count - drop) * sizeof(char*));
+		memset(log->frames + log->count - drop, 0, drop * sizeof(char*));
+	}
+	log->low = block;
+	pthread_mutex_unlock(&g_lock);
+}
@@ -0,0 +1,106 @@
+/**
+ * @file aesd-compress.h
+ * @brief Compressed read-back frames and the cache of compressed history
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_COMPRESS_H
+#define AESD_COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct z_stream_s;
+
+#define COMPRESS_BLOCK 65536 // log bytes per frame, frames start at multiples of it
+#define COMPRESS_FRAME_MAX (4 + COMPRESS_BLOCK + COMPRESS_BLOCK / 64 + 64) // length prefix and a zlib stream of one block
+#define COMPRESS_CACHE_DEFAULT (16 * 1024 * 1024) // bytes of cached frames when -z is not given
+#define COMPRESS_LEVEL 1 // Z_BEST_SPEED, the frames are made while the client waits
+/*
+ * Preset dictionary of the zlib streams. The lines the log is made of, the ones
+ * repeated most are last, they are reached with the shortest distances. A client
+ * inflates every frame with this dictionary
+ */
+#define COMPRESS_DICTIONARY \
+	"gas_resistance=100000 Ohm iaq=50.0 co2=400.0 ppm voc=0.50 ppm accuracy=3\n" \
+	"sensor=bme680 temperature=21.50 C humidity=45.20 % pressure=1013.25 hPa\n" \
+	"temperature=22.00 humidity=40.00 pressure=1000.00 gas=50000\n" \
+	"Jan Feb Mar Apr May Jun Jul Aug Sep Oct Nov Dec\n" \
+	"timestamp:Sat, 01 Jan 2026 00:00:00 +0000\n" \
+	"timestamp:Sun, 10 Oct 2026 12:30:40 +0100\n" \
+	"timestamp:Mon, 20 Nov 2026 23:50:50 +0200\n" \
+	"timestamp:Tue, 30 Dec 2026 09:15:20 +0300\n" \
+	"timestamp:Wed, 15 Feb 2026 18:45:10 -0500\n" \
+	"timestamp:Thu, 25 Mar 2026 06:05:30 -0800\n" \
+	"timestamp:Fri, 05 Apr 2026 14:25:00 +0000\n"
+
+/**
+ * @brief This function prepares the cache of compressed frames
+ *
+ * @param cache_bytes most bytes of frames kept, 0 - nothing is cached
+ * @return success status 0 - success
+ */
+int compress_start(size_t cache_bytes);
+/**
+ * @brief This function frees the cached frames
+ *
+ * @return void
+ */
+void compress_stop();
+/**
+ * @brief This function allocates the deflate state of one read-back
+ *
+ * @return state or NULL when out of memory
+ */
+struct z_stream_s* compress_open();
+/**
+ * @brief This function frees the state of compress_open
+ *
+ * @param zs state, may be NULL
+ * @return void
+ */
+void compress_close(struct z_stream_s* zs);
+/**
+ * @brief This function compresses log bytes into one frame: the length of the
+ * stream as 4 bytes in network order followed by a zlib stream made with
+ * COMPRESS_DICTIONARY. An empty input makes the empty frame ending a reply
+ *
+ * @param zs state of compress_open
+ * @param data log bytes
+ * @param len count of bytes, at most COMPRESS_BLOCK
+ * @param frame destination of COMPRESS_FRAME_MAX bytes
+ * @return frame length or -1 on error
+ */
+ssize_t compress_frame(struct z_stream_s* zs, const char* data, size_t len, char* frame);
+/**
+ * @brief This function copies the cached frame of a whole sealed block
+ *
+ * @param channel log of the block
+ * @param block block number, its log offset divided by COMPRESS_BLOCK
+ * @param frame destination of COMPRESS_FRAME_MAX bytes
+ * @return frame length, 0 - not cached
+ */
+size_t compress_cached(int channel, off_t block, char* frame);
+/**
+ * @brief This function caches the frame of a whole sealed block while the cache has room
+ *
+ * @param channel log of the block
+ * @param block block number
+ * @param frame frame made by compress_frame
+ * @param len frame length
+ * @return void
+ */
+void compress_cache(int channel, off_t block, const char* frame, size_t len);
+/**
+ * @brief This function drops the cached frames of blocks before the given one,
+ * their bytes were deleted by the retention
+ *
+ * @param channel log of the blocks
+ * @param block first block still retained
+ * @return void
+ */
+void compress_trim(int channel, off_t block);
+
+#endif /* AESD_COMPRESS_H */
@@ -0,0 +1,167 @@
+/**
+ * @file aesd-framer.c
+ * @brief Incremental newline framing of the aesdsocket byte stream.
+ * Packets are found with memchr over the bytes not searched before and
+ * are classified as data or commands once, when they are complete.
+ * Taking a packet only advances the head, the buffer is compacted
+ * when free space is requested and never grows beyond g_config.conn_memory.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+#include "aesd-framer.h"
+#include "aesd-metrics.h"
+
+void framer_init(struct framer* f){
+	memset(f, 0, sizeof(struct framer));
+	f->mark = metrics_now();
+}
+
+void framer_init_lent(struct framer* f, char* buf, size_t cap){
+	framer_init(f);
+	if(buf && cap){
+		/* The -m limit holds for the lent buffer too */
+		if(g_config.conn_memory && cap > g_config.conn_memory){
+			cap = g_config.conn_memory;
+		}
+		f->buf = buf;
+		f->cap = cap;
+		f->lent = 1;
+	}
+}
+
+void framer_deinit(struct framer* f){
+	if(!f->lent){
+		free(f->buf);
+	}
+	memset(f, 0, sizeof(struct framer));
+}
+
+char* framer_reserve(struct framer* f, size_t min, size_t* avail){
+	if(f->cap - f->tail < min && f->head){
+		/* Move the pending packet to the front instead of growing */
+		memmove(f->buf, f->buf + f->head, f->tail - f->head);
+		f->tail -= f->head;
+		f->scanned -= f->head;
+		f->head = 0;
+	}
+	if(f->cap - f->tail < min){
+		size_t cap = f->cap ? f->cap : BUFSIZE;
+		size_t limit = g_config.conn_memory;
+		if(limit && limit - f->tail < min){
+			/* A packet or a pipelined backlog outgrew the -m limit */
+			errno = EMSGSIZE;
+			return NULL;
+		}
+		while(cap - f->tail < min){
+			cap *= 2;
+		}
+		if(limit && cap > limit){
+			cap = limit;
+		}
+		char* buf = f->lent ? malloc(cap + 1) : realloc(f->buf, cap + 1);
+		if(!buf){
+			return NULL;
+		}
+		if(f->lent){
+			memcpy(buf, f->buf, f->tail);
+			f->lent = 0;
+		}
+		f->buf = buf;
+		f->cap = cap;
+	}
+	*avail = f->cap - f->tail;
+	return f->buf + f->tail;
+}
+
+void framer_commit(struct framer* f, size_t n_byte){
+	if(!n_byte){
+		f->eof = 1;
+	}
+	else if(g_metrics){
+		metrics_add(METRIC_BYTES_IN, n_byte);
+		if(!f->started){
+			metrics_since(METRIC_FIRST_BYTE, f->mark);
+			f->mark = metrics_now();
+		}
+		else if(f->head == f->tail){
+			f->mark = metrics_now();
+		}
+	}
+	if(n_byte){
+		f->started = 1;
+	}
+	f->tail += n_byte;
+}
+
+static int frame_kind(const char* data, size_t len){
+	if(len >= sizeof(SEEK_COMMAND) - 1 && !memcmp(data, SEEK_COMMAND, sizeof(SEEK_COMMAND) - 1)){
+		return FRAME_SEEK;
+	}
+	if(len >= sizeof(SINCE_COMMAND) - 1 && !memcmp(data, SINCE_COMMAND, sizeof(SINCE_COMMAND) - 1)){
+		return FRAME_SINCE;
+	}
+	if(len >= sizeof(SUBSCRIBE_COMMAND) - 1 && !memcmp(data, SUBSCRIBE_COMMAND, sizeof(SUBSCRIBE_COMMAND) - 1)){
+		return FRAME_SUBSCRIBE;
+	}
+	if(len >= sizeof(CHANNEL_COMMAND) - 1 && !memcmp(data, CHANNEL_COMMAND, sizeof(CHANNEL_COMMAND) - 1)){
+		return FRAME_CHANNEL;
+	}
+	if(len >= sizeof(COMPRESS_COMMAND) - 1 && !memcmp(data, COMPRESS_COMMAND, sizeof(COMPRESS_COMMAND) - 1)){
+		return FRAME_COMPRESS;
+	}
+	return FRAME_DATA;
+}
+
+int framer_next(struct framer* f, struct frame* out){
+	char* nl = NULL;
+	if(f->scanned < f->tail){
+		nl = memchr(f->buf + f->scanned, '\n', f->tail - f->scanned);
+	}
+	size_t end;
+	if(nl){
+		end = nl - f->buf + 1;
+	}
+	else if(f->eof && f->tail > f->head){
+		end = f->tail;
+	}
+	else{
+		f->scanned = f->tail;
+		return 0;
+	}
+	out->data = f->buf + f->head;
+	out->len = end - f->head;
+	out->kind = frame_kind(out->data, out->len);
+	f->head = end;
+	f->scanned = end;
+	if(g_metrics){
+		metrics_add(METRIC_PACKETS, 1);
+		metrics_since(METRIC_RECV, f->mark);
+		/* The next packet has already begun to arrive */
+		f->mark = metrics_now();
+	}
+	if(f->head == f->tail){
+		f->head = f->scanned = f->tail = 0;
+	}
+	return 1;
+}
+
+int framer_done(const struct framer* f){
+	return f->eof && f->head == f->tail;
+}
+
+size_t framer_pending(const struct framer* f){
+	return f->tail - f->head;
+}
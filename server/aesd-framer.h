@@ -0,0 +1,117 @@
+/**
+ * @file aesd-framer.h
+ * @brief Incremental newline framing of the aesdsocket byte stream
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_FRAMER_H
+#define AESD_FRAMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum frame_kind {
+	FRAME_DATA = 0, /* Packet to append to the log */
+	FRAME_SEEK, /* SEEK_COMMAND */
+	FRAME_SINCE, /* SINCE_COMMAND */
+	FRAME_SUBSCRIBE, /* SUBSCRIBE_COMMAND */
+	FRAME_CHANNEL, /* CHANNEL_COMMAND */
+	FRAME_COMPRESS /* COMPRESS_COMMAND */
+};
+/*
+ * Complete packet found by framer_next
+ */
+struct frame {
+	char* data; /* Packet bytes. data[len] is addressable and may be used for a NUL terminator */
+	size_t len; /* Packet length including the newline */
+	int kind; /* One of frame_kind */
+};
+/*
+ * Growable per-connection receive buffer. Bytes in [head, tail) are not framed yet,
+ * bytes in [head, scanned) are known to contain no newline, so every byte is
+ * searched once however the stream is split into recv chunks.
+ */
+struct framer {
+	char* buf; /* Allocated with one spare byte after cap */
+	size_t cap; /* Allocated size of buf without the spare byte */
+	size_t head; /* Start of the pending packet */
+	size_t scanned; /* End of the searched part of the pending packet */
+	size_t tail; /* End of the received bytes */
+	int eof; /* Peer has shut down its sending side */
+	int started; /* Some bytes have been received */
+	uint64_t mark; /* metrics_now() of the accept, then of the first byte of the pending packet */
+	int lent; /* buf belongs to the connection arena and is not freed */
+};
+
+/**
+ * @brief This function initialises an empty framer. The time of the call is taken
+ * as the accept time of the connection, the caller may set mark to an earlier one
+ *
+ * @param f framer to initialise
+ * @return void
+ */
+void framer_init(struct framer* f);
+/**
+ * @brief This function initialises an empty framer over a buffer lent by the caller,
+ * normally the rest of the connection arena. The framer moves to a heap buffer
+ * only when a packet outgrows it
+ *
+ * @param f framer to initialise
+ * @param buf buffer of cap + 1 bytes, NULL - none, like framer_init
+ * @param cap usable size of buf
+ * @return void
+ */
+void framer_init_lent(struct framer* f, char* buf, size_t cap);
+/**
+ * @brief This function releases the framer buffer
+ *
+ * @param f framer to deinitialise
+ * @return void
+ */
+void framer_deinit(struct framer* f);
+/**
+ * @brief This function provides free space for the next recv. It compacts or grows
+ * the buffer, so frames returned before are invalidated
+ *
+ * @param f framer
+ * @param min minimal free space wanted
+ * @param avail receives the free space size
+ * @return pointer to the free space or NULL when out of memory,
+ * errno is EMSGSIZE when the buffer would outgrow g_config.conn_memory
+ */
+char* framer_reserve(struct framer* f, size_t min, size_t* avail);
+/**
+ * @brief This function accounts bytes received into the space given by framer_reserve
+ *
+ * @param f framer
+ * @param n_byte count of received bytes, 0 - the peer has shut down its side
+ * @return void
+ */
+void framer_commit(struct framer* f, size_t n_byte);
+/**
+ * @brief This function takes the next complete packet. After EOF an unterminated tail
+ * is returned as the last packet
+ *
+ * @param f framer
+ * @param out receives the packet
+ * @return 1 - packet taken, 0 - more bytes are needed
+ */
+int framer_next(struct framer* f, struct frame* out);
+/**
+ * @brief This function tells whether the stream has ended and every packet was taken
+ *
+ * @param f framer
+ * @return 1 - nothing more will be framed, 0 - otherwise
+ */
+int framer_done(const struct framer* f);
+/**
+ * @brief This function tells the count of received bytes not taken as packets yet
+ *
+ * @param f framer
+ * @return count of pending bytes
+ */
+size_t framer_pending(const struct framer* f);
+
+#endif /* AESD_FRAMER_H */
@@ -0,0 +1,239 @@
+/**
+ * @file aesd-handoff.c
+ * @brief Hand-over of the aesdsocket listeners to a restarted server.
+ * A server started with -H listens on a Unix socket. A new server started
+ * with the same path connects to it first and gets the listening sockets
+ * with SCM_RIGHTS instead of binding the port again. The old server drains,
+ * the new one holds the listeners and waits for the connection to be closed
+ * by the exit of the old one before it opens the log. Clients connecting in
+ * between wait in the shared backlog, none of them is refused.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "aesdsocket.h"
+#include "aesd-handoff.h"
+#include "aesd-log.h"
+
+static const char* g_path = NULL;
+static int g_listenfd = -1; // hand-over socket
+static int g_peerfd = -1; // connection of the successor, closed by handoff_stop
+static int g_fds[2] = {-1, -1}; // listeners to hand over
+static pthread_t g_thread;
+static int g_started = 0;
+static atomic_int g_handed = 0;
+
+static int handoff_address(const char* path, struct sockaddr_un* addr){
+	if(strlen(path) >= sizeof(addr->sun_path)){
+		aesd_log(LOG_ERR, "Hand-over socket path %s is too long", path);
+		return -1;
+	}
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int handoff_receive(const char* path, int* sockfd, int* unixfd){
+	struct sockaddr_un addr;
+	if(handoff_address(path, &addr)){
+		return -1;
+	}
+	int sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sd == -1){
+		aesd_log(LOG_ERR, "socket FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	if(connect(sd, (struct sockaddr*)&addr, sizeof(addr))){
+		/* No socket or a stale one, this is the first server */
+		close(sd);
+		return 1;
+	}
+	char tag;
+	int fds[2];
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	struct iovec iov = {&tag, 1};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t res;
+	while((res = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR){
+	}
+	struct cmsghdr* cmsg = res > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC)){
+		aesd_log(LOG_ERR, "Hand-over from %s FAILED", path);
+		close(sd);
+		return -1;
+	}
+	size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+	*sockfd = fds[0];
+	*unixfd = count > 1 ? fds[1] : -1;
+	aesd_log(LOG_INFO, "Took over the listeners, waiting for the previous server to exit");
+	/* Closed by the exit of the previous server, after its log is flushed */
+	while((res = recv(sd, &tag, 1, 0)) != 0){
+		if(res == -1 && errno != EINTR){
+			break;
+		}
+	}
+	close(sd);
+	return 0;
+}
+
+/*
+ * Only the user of the server, or root, may take its listeners
+ */
+static int handoff_allowed(int sd){
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if(getsockopt(sd, SOL_SOCKET, SO_PEERCRED, &cred, &len)){
+		aesd_log(LOG_WARNING, "getsockopt SO_PEERCRED FAILED error:%s", strerror(errno));
+		return 0;
+	}
+	if(cred.uid != geteuid() && cred.uid != 0){
+		aesd_log(LOG_WARNING, "Hand-over to uid %d refused", (int)cred.uid);
+		return 0;
+	}
+	return 1;
+}
+
+static int handoff_send(int sd){
+	int count = g_fds[1] == -1 ? 1 : 2;
+	char tag = 'H';
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(g_fds))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = {&tag, 1};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), g_fds, count * sizeof(int));
+	ssize_t res;
+	while((res = sendmsg(sd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR){
+	}
+	if(res != 1){
+		aesd_log(LOG_ERR, "sendmsg FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void* handoff_thread(void* arg){
+	while(1){
+		int sd = accept4(g_listenfd, NULL, NULL, SOCK_CLOEXEC);
+		if(sd == -1){
+			if(errno == EINTR || errno == ECONNABORTED){
+				continue;
+			}
+			/* Shut down by handoff_stop */
+			break;
+		}
+		if(!handoff_allowed(sd) || handoff_send(sd)){
+			close(sd);
+			continue;
+		}
+		g_peerfd = sd;
+		atomic_store(&g_handed, 1);
+		aesd_log(LOG_INFO, "Listeners handed over, draining");
+		start_drain();
+		break;
+	}
+	return NULL;
+}
+
+int handoff_start(const char* path, int sockfd, int unixfd){
+	struct sockaddr_un addr;
+	if(handoff_address(path, &addr)){
+		return -1;
+	}
+	g_listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(g_listenfd == -1){
+		aesd_log(LOG_ERR, "socket FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	/* Left by the previous server, other files are left alone */
+	struct stat st;
+	if(!lstat(path, &st) && S_ISSOCK(st.st_mode)){
+		unlink(path);
+	}
+	if(bind(g_listenfd, (struct sockaddr*)&addr, sizeof(addr))){
+		aesd_log(LOG_ERR, "bind of %s FAILED error:%s", path, strerror(errno));
+		close(g_listenfd);
+		g_listenfd = -1;
+		return -1;
+	}
+	g_path = path;
+	if(chmod(path, 0600)){
+		aesd_log(LOG_WARNING, "chmod FAILED error:%s", strerror(errno));
+	}
+	if(listen(g_listenfd, 1)){
+		aesd_log(LOG_ERR, "listen FAILED error:%s", strerror(errno));
+		handoff_stop();
+		return -1;
+	}
+	g_fds[0] = sockfd;
+	g_fds[1] = unixfd;
+	if(pthread_create(&g_thread, NULL, handoff_thread, NULL)){
+		aesd_log(LOG_ERR, "pthread_create FAILED");
+		handoff_stop();
+		return -1;
+	}
+	g_started = 1;
+	aesd_log(LOG_INFO, "Listeners are handed over through %s", path);
+	return 0;
+}
+
+int handoff_done(){
+	return atomic_load(&g_handed);
+}
+
+void handoff_stop(){
+	if(g_started){
+		/* Wakes up the blocked accept */
+		shutdown(g_listenfd, SHUT_RDWR);
+		pthread_join(g_thread, NULL);
+		g_started = 0;
+	}
+	if(g_listenfd != -1){
+		close(g_listenfd);
+		g_listenfd = -1;
+		unlink(g_path);
+	}
+	if(g_peerfd != -1){
+		close(g_peerfd);
+		g_peerfd = -1;
+	}
+}
@@ -0,0 +1,50 @@
+/**
+ * @file aesd-handoff.h
+ * @brief Hand-over of the aesdsocket listeners to a restarted server
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_HANDOFF_H
+#define AESD_HANDOFF_H
+
+/**
+ * @brief This function asks a server running with the same -H socket for its
+ * listeners. When they are received it waits for that server to finish its
+ * drain and exit, so the log is never appended by both. New connections wait
+ * in the backlog of the received listeners meanwhile
+ *
+ * @param path hand-over socket
+ * @param sockfd receives the TCP listener
+ * @param unixfd receives the Unix listener, -1 if the running server has none
+ * @return 0 - listeners taken over, 1 - no server is running, -1 - error
+ */
+int handoff_receive(const char* path, int* sockfd, int* unixfd);
+/**
+ * @brief This function listens on the hand-over socket, replacing a stale one.
+ * A thread waits for a successor, sends it the listeners with SCM_RIGHTS and
+ * starts the drain with start_drain
+ *
+ * @param path hand-over socket
+ * @param sockfd TCP listener to hand over
+ * @param unixfd Unix listener to hand over, -1 - none
+ * @return success status 0 - success
+ */
+int handoff_start(const char* path, int sockfd, int unixfd);
+/**
+ * @brief This function tells whether the listeners were handed over. The files
+ * the successor goes on using, the Unix socket and the log, must not be removed
+ *
+ * @return 1 - handed over, 0 - not
+ */
+int handoff_done();
+/**
+ * @brief This function stops waiting for a successor and removes the hand-over
+ * socket. A successor waiting for the exit is released, so it is called last
+ *
+ * @return void
+ */
+void handoff_stop();
+
+#endif /* AESD_HANDOFF_H */
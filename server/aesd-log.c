@@ -0,0 +1,181 @@
+/**
+ * @file aesd-log.c
+ * @brief Asynchronous logging of the aesdsocket server.
+ * Every thread formats its messages into its own single-producer ring, a
+ * background writer drains the rings to syslog. Logging never takes a lock
+ * and never blocks on /dev/log; when a ring is full the message is dropped
+ * and counted. Rings of finished threads are reused by new threads.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "aesd-log.h"
+
+#define LOG_IDLE_MS 10 // writer sleep when every ring is empty
+
+/*
+ * One queued message, a slot is 256 bytes
+ */
+struct log_rec {
+	int prio;
+	char msg[LOG_MSG_SIZE];
+};
+/*
+ * Single-producer single-consumer ring of one thread
+ */
+struct log_ring {
+	_Atomic unsigned head __attribute__((aligned(64))); /* Written by the owner thread */
+	_Atomic unsigned long dropped; /* Messages the owner could not queue */
+	_Atomic unsigned tail __attribute__((aligned(64))); /* Written by the writer */
+	unsigned long reported; /* Part of dropped already reported by the writer */
+	atomic_int in_use; /* The ring is owned by a live thread */
+	struct log_ring* next; /* Rings are never unlinked or freed */
+	struct log_rec recs[LOG_RING_SLOTS];
+};
+
+int g_log_level = LOG_DEBUG;
+
+static _Atomic(struct log_ring*) g_rings = NULL;
+static atomic_int g_running = 0;
+static atomic_ulong g_dropped = 0;
+static pthread_t g_writer;
+static pthread_key_t g_key;
+static __thread struct log_ring* t_ring = NULL;
+
+/*
+ * Thread exit destructor: the ring goes back for reuse, the writer still drains it
+ */
+static void ring_release(void* arg){
+	struct log_ring* r = (struct log_ring*)arg;
+	atomic_store_explicit(&r->in_use, 0, memory_order_release);
+}
+
+static struct log_ring* ring_get(){
+	struct log_ring* r;
+	for(r = atomic_load(&g_rings); r; r = r->next){
+		int used = 0;
+		if(!atomic_load_explicit(&r->in_use, memory_order_relaxed) &&
+			atomic_compare_exchange_strong(&r->in_use, &used, 1)){
+			break;
+		}
+	}
+	if(!r){
+		r = aligned_alloc(64, sizeof(struct log_ring));
+		if(!r){
+			return NULL;
+		}
+		memset(r, 0, sizeof(struct log_ring));
+		atomic_store(&r->in_use, 1);
+		struct log_ring* head = atomic_load(&g_rings);
+		do{
+			r->next = head;
+		} while(!atomic_compare_exchange_weak(&g_rings, &head, r));
+	}
+	pthread_setspecific(g_key, r);
+	t_ring = r;
+	return r;
+}
+
+void log_write(int prio, const char* fmt, ...){
+	va_list ap;
+	va_start(ap, fmt);
+	struct log_ring* r = t_ring;
+	if(!atomic_load_explicit(&g_running, memory_order_relaxed) || (!r && !(r = ring_get()))){
+		vsyslog(prio, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if(head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOG_RING_SLOTS){
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+		va_end(ap);
+		return;
+	}
+	struct log_rec* rec = &r->recs[head & (LOG_RING_SLOTS - 1)];
+	rec->prio = prio;
+	vsnprintf(rec->msg, LOG_MSG_SIZE, fmt, ap);
+	va_end(ap);
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+/*
+ * Writes out every queued message.
+ * Returns the count of messages written
+ */
+static unsigned log_drain(){
+	unsigned count = 0;
+	unsigned long dropped = 0;
+	for(struct log_ring* r = atomic_load(&g_rings); r; r = r->next){
+		unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+		for(; tail != head; tail++, count++){
+			struct log_rec* rec = &r->recs[tail & (LOG_RING_SLOTS - 1)];
+			syslog(rec->prio, "%s", rec->msg);
+		}
+		atomic_store_explicit(&r->tail, tail, memory_order_release);
+		unsigned long total = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+		dropped += total - r->reported;
+		r->reported = total;
+	}
+	if(dropped){
+		atomic_fetch_add(&g_dropped, dropped);
+		syslog(LOG_WARNING, "Log ring full, %lu messages dropped", dropped);
+	}
+	return count;
+}
+
+static void* log_writer(void* arg){
+	struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+	while(atomic_load(&g_running)){
+		if(!log_drain()){
+			nanosleep(&idle, NULL);
+		}
+	}
+	log_drain();
+	return arg;
+}
+
+int log_start(int level){
+	g_log_level = level;
+	if(pthread_key_create(&g_key, ring_release)){
+		syslog(LOG_ERR, "pthread_key_create FAILED");
+		return -1;
+	}
+	atomic_store(&g_running, 1);
+	if(pthread_create(&g_writer, NULL, log_writer, NULL)){
+		syslog(LOG_ERR, "pthread_create FAILED");
+		atomic_store(&g_running, 0);
+		pthread_key_delete(g_key);
+		return -1;
+	}
+	return 0;
+}
+
+void log_stop(){
+	if(!atomic_exchange(&g_running, 0)){
+		return;
+	}
+	pthread_join(g_writer, NULL);
+	unsigned long dropped = atomic_load(&g_dropped);
+	if(dropped){
+		syslog(LOG_WARNING, "%lu log messages were dropped", dropped);
+	}
+	/* Threads still running log to syslog directly from now on. A detached
+	 * thread may still hold its ring, so the rings are left to the exit */
+	pthread_key_delete(g_key);
+}
+
+unsigned long log_dropped(){
+	return atomic_load(&g_dropped);
+}
@@ -0,0 +1,69 @@
+/**
+ * @file aesd-log.h
+ * @brief Asynchronous logging of the aesdsocket server
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <syslog.h>
+
+/*
+ * Messages less severe than this are compiled out, e.g. -DAESD_LOG_LEVEL=LOG_WARNING
+ */
+#ifndef AESD_LOG_LEVEL
+#define AESD_LOG_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_RING_SLOTS 128 // messages one thread may have queued, a power of two
+#define LOG_MSG_SIZE 252 // longest message kept, longer ones are truncated
+
+/*
+ * Least severe priority logged, set at startup (-L)
+ */
+extern int g_log_level;
+
+/**
+ * @brief Logs a message like syslog. The message is formatted into a ring of
+ * the calling thread and written to syslog by the background writer.
+ * If the ring is full the message is counted as dropped
+ */
+#define aesd_log(prio, ...) do{ \
+	if((prio) <= AESD_LOG_LEVEL && (prio) <= g_log_level){ \
+		log_write((prio), __VA_ARGS__); \
+	} \
+}while(0)
+
+/**
+ * @brief This function starts the background writer. Until it is started
+ * and after it is stopped messages are written to syslog directly
+ *
+ * @param level least severe priority logged
+ * @return success status 0 - success
+ */
+int log_start(int level);
+/**
+ * @brief This function writes out the queued messages and stops the background writer
+ *
+ * @return void
+ */
+void log_stop();
+/**
+ * @brief This function queues a message for the background writer. Use aesd_log
+ *
+ * @param prio syslog priority
+ * @param fmt printf format
+ * @return void
+ */
+void log_write(int prio, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+/**
+ * @brief This function returns the count of messages dropped because a ring was full
+ *
+ * @return dropped messages since log_start
+ */
+unsigned long log_dropped();
+
+#endif /* AESD_LOG_H */
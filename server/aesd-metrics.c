@@ -0,0 +1,356 @@
+/**
+ * @file aesd-metrics.c
+ * @brief Counters and latency histograms of the aesdsocket server.
+ * Every thread updates its own shard with plain relaxed stores, so recording
+ * costs a clock read and a few additions. The serving thread merges the
+ * shards on every scrape. Histograms are log-linear like HdrHistogram:
+ * every power of two is split into 8 buckets, values are kept within 12.5%.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "aesdsocket.h"
+#include "aesd-metrics.h"
+#include "aesd-log.h"
+#include "aesd-subscribe.h"
+
+#define METRICS_SUB_BITS 3 // 8 buckets per power of two
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+#define METRICS_REPORT_SIZE 8192 // one scrape fits into it
+
+struct metrics_hist_data {
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+	_Atomic uint64_t buckets[METRICS_BUCKETS];
+};
+/*
+ * Metrics of one thread. Only the owner writes, the serving thread reads
+ */
+struct metrics_shard {
+	_Atomic uint64_t counters[METRIC_COUNTERS];
+	struct metrics_hist_data hists[METRIC_HISTS];
+	atomic_int in_use; /* The shard is owned by a live thread */
+	struct metrics_shard* next; /* Shards are never unlinked or freed */
+};
+
+static const char* counter_names[METRIC_COUNTERS] = {
+	"aesd_connections_accepted_total",
+	"aesd_connections_closed_total",
+	"aesd_packets_total",
+	"aesd_bytes_in_total",
+	"aesd_bytes_out_total",
+	"aesd_connections_shed_total",
+	"aesd_connections_timed_out_total",
+	"aesd_subscribe_dropped_bytes_total"
+};
+static const char* hist_names[METRIC_HISTS] = {
+	"aesd_accept_to_first_byte_ns",
+	"aesd_recv_ns",
+	"aesd_commit_ns",
+	"aesd_readback_ns",
+	"aesd_lock_wait_ns"
+};
+
+int g_metrics = 0;
+
+static _Atomic(struct metrics_shard*) g_shards = NULL;
+static pthread_t g_thread;
+static pthread_key_t g_key;
+static int g_sockfd = -1;
+static char g_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static __thread struct metrics_shard* t_shard = NULL;
+
+/*
+ * Thread exit destructor: the shard keeps its values and goes to a new thread
+ */
+static void shard_release(void* arg){
+	struct metrics_shard* s = (struct metrics_shard*)arg;
+	atomic_store_explicit(&s->in_use, 0, memory_order_release);
+}
+
+static struct metrics_shard* shard_get(){
+	struct metrics_shard* s = t_shard;
+	if(s){
+		return s;
+	}
+	for(s = atomic_load(&g_shards); s; s = s->next){
+		int used = 0;
+		if(!atomic_load_explicit(&s->in_use, memory_order_relaxed) &&
+			atomic_compare_exchange_strong(&s->in_use, &used, 1)){
+			break;
+		}
+	}
+	if(!s){
+		s = calloc(1, sizeof(struct metrics_shard));
+		if(!s){
+			return NULL;
+		}
+		atomic_store(&s->in_use, 1);
+		struct metrics_shard* head = atomic_load(&g_shards);
+		do{
+			s->next = head;
+		} while(!atomic_compare_exchange_weak(&g_shards, &head, s));
+	}
+	pthread_setspecific(g_key, s);
+	t_shard = s;
+	return s;
+}
+
+/*
+ * Single writer, so no locked instruction is needed
+ */
+static inline void bump(_Atomic uint64_t* v, uint64_t n){
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static unsigned bucket_of(uint64_t v){
+	if(v < (1 << METRICS_SUB_BITS)){
+		return v;
+	}
+	unsigned k = 63 - __builtin_clzll(v);
+	return ((k - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) | ((v >> (k - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1));
+}
+
+/*
+ * Highest value counted by the bucket
+ */
+static uint64_t bucket_top(unsigned idx){
+	if(idx < (1 << METRICS_SUB_BITS)){
+		return idx;
+	}
+	unsigned shift = (idx >> METRICS_SUB_BITS) - 1;
+	uint64_t low = (uint64_t)((1 << METRICS_SUB_BITS) | (idx & ((1 << METRICS_SUB_BITS) - 1))) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t metrics_now(){
+	if(!g_metrics){
+		return 0;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_add(int counter, uint64_t n){
+	struct metrics_shard* s;
+	if(!g_metrics || !(s = shard_get())){
+		return;
+	}
+	bump(&s->counters[counter], n);
+}
+
+void metrics_since(int hist, uint64_t start){
+	struct metrics_shard* s;
+	if(!start || !g_metrics || !(s = shard_get())){
+		return;
+	}
+	uint64_t v = metrics_now() - start;
+	struct metrics_hist_data* h = &s->hists[hist];
+	bump(&h->buckets[bucket_of(v)], 1);
+	bump(&h->count, 1);
+	bump(&h->sum, v);
+	if(v > atomic_load_explicit(&h->max, memory_order_relaxed)){
+		atomic_store_explicit(&h->max, v, memory_order_relaxed);
+	}
+}
+
+/*
+ * Merges the shards and renders them in the Prometheus text format
+ */
+static size_t metrics_render(char* out, size_t size){
+	static uint64_t buckets[METRICS_BUCKETS];
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	uint64_t counters[METRIC_COUNTERS] = {0};
+	size_t len = 0;
+#define EMIT(...) do{ \
+	int n = snprintf(out + len, size - len, __VA_ARGS__); \
+	if(n > 0){ \
+		len = len + n < size ? len + n : size - 1; \
+	} \
+}while(0)
+	for(struct metrics_shard* s = atomic_load(&g_shards); s; s = s->next){
+		for(int i = 0; i < METRIC_COUNTERS; i++){
+			counters[i] += atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+		}
+	}
+	for(int i = 0; i < METRIC_COUNTERS; i++){
+		EMIT("%s %lu\n", counter_names[i], (unsigned long)counters[i]);
+	}
+	EMIT("aesd_connections_active %ld\n", (long)(counters[METRIC_ACCEPTED] - counters[METRIC_CLOSED]));
+	EMIT("aesd_log_dropped_total %lu\n", log_dropped());
+	EMIT("aesd_subscribers %d\n", subscribe_count());
+	for(int i = 0; i < METRIC_HISTS; i++){
+		uint64_t count = 0, sum = 0, max = 0;
+		memset(buckets, 0, sizeof(buckets));
+		for(struct metrics_shard* s = atomic_load(&g_shards); s; s = s->next){
+			struct metrics_hist_data* h = &s->hists[i];
+			for(int b = 0; b < METRICS_BUCKETS; b++){
+				buckets[b] += atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+			}
+			count += atomic_load_explicit(&h->count, memory_order_relaxed);
+			sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+			uint64_t m = atomic_load_explicit(&h->max, memory_order_relaxed);
+			max = m > max ? m : max;
+		}
+		EMIT("# TYPE %s summary\n", hist_names[i]);
+		unsigned b = 0;
+		uint64_t seen = 0;
+		for(size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++){
+			uint64_t rank = (uint64_t)(quantiles[q] * count + 0.999999);
+			while(b < METRICS_BUCKETS && seen + buckets[b] < rank){
+				seen += buckets[b++];
+			}
+			uint64_t v = count && b < METRICS_BUCKETS ? bucket_top(b) : 0;
+			EMIT("%s{quantile=\"%g\"} %lu\n", hist_names[i], quantiles[q], (unsigned long)(v < max ? v : max));
+		}
+		EMIT("%s_max %lu\n", hist_names[i], (unsigned long)max);
+		EMIT("%s_sum %lu\n", hist_names[i], (unsigned long)sum);
+		EMIT("%s_count %lu\n", hist_names[i], (unsigned long)count);
+	}
+#undef EMIT
+	return len;
+}
+
+static void* metrics_serve(void* arg){
+	static char report[METRICS_REPORT_SIZE];
+	while(work_state){
+		int sd = accept4(g_sockfd, NULL, NULL, SOCK_CLOEXEC);
+		if(sd == -1){
+			if(errno == EINTR || errno == ECONNABORTED){
+				continue;
+			}
+			/* The listener is shut down by metrics_stop */
+			break;
+		}
+		size_t len = metrics_render(report, sizeof(report)), off = 0;
+		while(off < len){
+			/* A scraper going away must not raise SIGPIPE */
+			ssize_t res = send(sd, report + off, len - off, MSG_NOSIGNAL);
+			if(res == -1){
+				if(errno == EINTR){
+					continue;
+				}
+				aesd_log(LOG_WARNING, "send of metrics FAILED error:%s", strerror(errno));
+				break;
+			}
+			off += res;
+		}
+		close(sd);
+	}
+	return arg;
+}
+
+/*
+ * A number is a port on the loopback interface, anything else a Unix socket path
+ */
+static int metrics_listen(const char* endpoint){
+	int fd;
+	if(endpoint[strspn(endpoint, "0123456789")] == '\0'){
+		struct sockaddr_in addr;
+		int yes = 1;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(atoi(endpoint));
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd == -1){
+			aesd_log(LOG_ERR, "socket FAILED error:%s", strerror(errno));
+			return -1;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+		if(bind(fd, (struct sockaddr*)&addr, sizeof(addr))){
+			aesd_log(LOG_ERR, "bind of metrics port %s FAILED error:%s", endpoint, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+	else{
+		struct sockaddr_un addr;
+		if(strlen(endpoint) >= sizeof(addr.sun_path)){
+			aesd_log(LOG_ERR, "Metrics socket path %s is too long", endpoint);
+			return -1;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, endpoint);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd == -1){
+			aesd_log(LOG_ERR, "socket FAILED error:%s", strerror(errno));
+			return -1;
+		}
+		/* A stale socket of a previous run would fail the bind */
+		unlink(endpoint);
+		if(bind(fd, (struct sockaddr*)&addr, sizeof(addr))){
+			aesd_log(LOG_ERR, "bind of metrics socket %s FAILED error:%s", endpoint, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		strcpy(g_path, endpoint);
+	}
+	if(listen(fd, 16)){
+		aesd_log(LOG_ERR, "listen FAILED error:%s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int metrics_start(const char* endpoint){
+	if(pthread_key_create(&g_key, shard_release)){
+		aesd_log(LOG_ERR, "pthread_key_create FAILED");
+		return -1;
+	}
+	g_sockfd = metrics_listen(endpoint);
+	if(g_sockfd == -1){
+		pthread_key_delete(g_key);
+		return -1;
+	}
+	g_metrics = 1;
+	if(pthread_create(&g_thread, NULL, metrics_serve, NULL)){
+		aesd_log(LOG_ERR, "pthread_create FAILED");
+		g_metrics = 0;
+		close(g_sockfd);
+		g_sockfd = -1;
+		pthread_key_delete(g_key);
+		return -1;
+	}
+	aesd_log(LOG_INFO, "Serving metrics on %s", endpoint);
+	return 0;
+}
+
+void metrics_stop(){
+	if(!g_metrics){
+		return;
+	}
+	g_metrics = 0;
+	/* Wakes up the accept of the serving thread */
+	shutdown(g_sockfd, SHUT_RDWR);
+	pthread_join(g_thread, NULL);
+	close(g_sockfd);
+	g_sockfd = -1;
+	if(g_path[0]){
+		unlink(g_path);
+		g_path[0] = '\0';
+	}
+	/* A thread still running may be inside metrics_add with its shard, the
+	 * shards are left to the exit */
+	pthread_key_delete(g_key);
+}
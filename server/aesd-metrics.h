@@ -0,0 +1,77 @@
+/**
+ * @file aesd-metrics.h
+ * @brief Counters and latency histograms of the aesdsocket server
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_METRICS_H
+#define AESD_METRICS_H
+
+#include <stdint.h>
+
+enum metrics_counter {
+	METRIC_ACCEPTED = 0, /* Connections taken into service */
+	METRIC_CLOSED, /* Connections released */
+	METRIC_PACKETS, /* Packets framed */
+	METRIC_BYTES_IN, /* Bytes received from clients */
+	METRIC_BYTES_OUT, /* Bytes sent back to clients */
+	METRIC_SHED, /* Connections dropped by the -C or -m limit */
+	METRIC_TIMEOUTS, /* Connections closed by the -I or -O timeout */
+	METRIC_SUB_DROPPED, /* Stream bytes lagging subscribers did not receive */
+	METRIC_COUNTERS
+};
+enum metrics_hist {
+	METRIC_FIRST_BYTE = 0, /* Accept to the first received byte */
+	METRIC_RECV, /* First byte of a packet to the packet being framed */
+	METRIC_COMMIT, /* Append of a packet to the log */
+	METRIC_READBACK, /* Read-back of the log to the client */
+	METRIC_LOCK_WAIT, /* Wait for the commit lock */
+	METRIC_HISTS
+};
+
+/*
+ * Set by metrics_start. When clear every metrics call returns at once
+ */
+extern int g_metrics;
+
+/**
+ * @brief This function enables the metrics and starts the thread serving them
+ * in plain text to every client of the endpoint
+ *
+ * @param endpoint TCP port on 127.0.0.1 or a Unix socket path
+ * @return success status 0 - success
+ */
+int metrics_start(const char* endpoint);
+/**
+ * @brief This function stops serving and collecting the metrics. The per-thread
+ * shards are kept, threads still running may hold them
+ *
+ * @return void
+ */
+void metrics_stop();
+/**
+ * @brief This function returns a timestamp to measure from
+ *
+ * @return CLOCK_MONOTONIC nanoseconds, 0 when the metrics are disabled
+ */
+uint64_t metrics_now();
+/**
+ * @brief This function adds to a counter of the calling thread
+ *
+ * @param counter one of metrics_counter
+ * @param n value to add
+ * @return void
+ */
+void metrics_add(int counter, uint64_t n);
+/**
+ * @brief This function records the time elapsed since start in a histogram of the calling thread
+ *
+ * @param hist one of metrics_hist
+ * @param start timestamp returned by metrics_now, 0 - nothing is recorded
+ * @return void
+ */
+void metrics_since(int hist, uint64_t start);
+
+#endif /* AESD_METRICS_H */
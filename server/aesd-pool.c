@@ -0,0 +1,130 @@
+/**
+ * @file aesd-pool.c
+ * @brief Fixed-size worker pool serving accepted connections for aesdsocket.
+ * The accept loop pushes proc_data items into a lock-free MPMC ring,
+ * a semaphore counts queued items so that idle workers sleep.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "aesdsocket.h"
+#include "aesd-queue.h"
+#include "aesd-pool.h"
+#include "aesd-arena.h"
+#include "aesd-log.h"
+
+#define POOL_QUEUE_PER_WORKER 16 // queued connections allowed per worker before rejecting
+
+static struct aesd_queue g_queue;
+static sem_t g_items;
+static pthread_t* g_workers = NULL;
+static int g_count = 0;
+static atomic_int g_busy = 0; // connections queued or being served
+
+static void release_connection(struct proc_data* data){
+	close(data->sd);
+	leave_connection();
+	arena_put(data->arena);
+}
+
+static void* pool_worker(void* arg){
+	while(1){
+		if(sem_wait(&g_items)){
+			continue;
+		}
+		struct proc_data* data = aesd_queue_pop(&g_queue);
+		if(!data){
+			/* Wake up posted by pool_stop */
+			break;
+		}
+		process_connection(data);
+		release_connection(data);
+		atomic_fetch_sub(&g_busy, 1);
+	}
+	return NULL;
+}
+
+int pool_start(int workers){
+	if(aesd_queue_init(&g_queue, (size_t)workers * POOL_QUEUE_PER_WORKER)){
+		aesd_log(LOG_ERR, "aesd_queue_init FAILED");
+		return -1;
+	}
+	if(sem_init(&g_items, 0, 0)){
+		aesd_log(LOG_ERR, "sem_init FAILED");
+		aesd_queue_deinit(&g_queue);
+		return -1;
+	}
+	g_workers = calloc(workers, sizeof(pthread_t));
+	if(!g_workers){
+		aesd_log(LOG_ERR, "calloc FAILED");
+		pool_stop();
+		return -1;
+	}
+	for(; g_count < workers; g_count++){
+		if(pthread_create(&g_workers[g_count], NULL, pool_worker, NULL)){
+			aesd_log(LOG_ERR, "pthread_create FAILED");
+			pool_stop();
+			return -1;
+		}
+	}
+	aesd_log(LOG_INFO, "Started %d workers", g_count);
+	return 0;
+}
+
+int pool_submit(struct proc_data* data){
+	atomic_fetch_add(&g_busy, 1);
+	if(aesd_queue_push(&g_queue, data)){
+		atomic_fetch_sub(&g_busy, 1);
+		return -1;
+	}
+	sem_post(&g_items);
+	return 0;
+}
+
+int pool_busy(){
+	return atomic_load(&g_busy);
+}
+
+void pool_kick(){
+	for(int i = 0; i < g_count; i++){
+		pthread_kill(g_workers[i], DRAIN_SIGNAL);
+	}
+}
+
+void pool_stop(){
+	struct proc_data* data;
+	if(!g_queue.cells){
+		return;
+	}
+	/* Queued connections are not served during shutdown */
+	while((data = aesd_queue_pop(&g_queue)) != NULL){
+		release_connection(data);
+	}
+	for(int i = 0; i < g_count; i++){
+		sem_post(&g_items);
+	}
+	for(int i = 0; i < g_count; i++){
+		kick_join(g_workers[i]);
+	}
+	while((data = aesd_queue_pop(&g_queue)) != NULL){
+		release_connection(data);
+	}
+	atomic_store(&g_busy, 0);
+	free(g_workers);
+	g_workers = NULL;
+	g_count = 0;
+	sem_destroy(&g_items);
+	aesd_queue_deinit(&g_queue);
+}
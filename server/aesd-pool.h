@@ -0,0 +1,49 @@
+/**
+ * @file aesd-pool.h
+ * @brief Fixed-size worker pool serving accepted connections for aesdsocket
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_POOL_H
+#define AESD_POOL_H
+
+struct proc_data;
+
+/**
+ * @brief This function starts the worker threads and allocates the hand-off queue
+ *
+ * @param workers count of worker threads
+ * @return success status 0 - success
+ */
+int pool_start(int workers);
+/**
+ * @brief This function hands an accepted connection over to the workers.
+ * On success the pool owns the data, closes the socket and frees it.
+ *
+ * @param data accepted connection
+ * @return success status 0 - success, -1 - queue is full and the connection must be rejected
+ */
+int pool_submit(struct proc_data* data);
+/**
+ * @brief This function tells whether the pool still has connections to finish
+ *
+ * @return count of connections queued or being served
+ */
+int pool_busy();
+/**
+ * @brief This function interrupts the workers blocked in recv or send with DRAIN_SIGNAL,
+ * so that a draining server closes their connections between packets
+ *
+ * @return void
+ */
+void pool_kick();
+/**
+ * @brief This function stops the workers and releases connections left in the queue
+ *
+ * @return void
+ */
+void pool_stop();
+
+#endif /* AESD_POOL_H */
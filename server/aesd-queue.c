@@ -0,0 +1,86 @@
+/**
+ * @file aesd-queue.c
+ * @brief Bounded lock-free multi-producer multi-consumer ring queue
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "aesd-queue.h"
+
+int aesd_queue_init(struct aesd_queue* q, size_t capacity){
+	size_t size = 2;
+	while(size < capacity){
+		size <<= 1;
+	}
+	q->cells = calloc(size, sizeof(struct aesd_queue_cell));
+	if(!q->cells){
+		return -1;
+	}
+	for(size_t i = 0; i < size; i++){
+		atomic_init(&q->cells[i].seq, i);
+	}
+	q->mask = size - 1;
+	atomic_init(&q->enqueue_pos, 0);
+	atomic_init(&q->dequeue_pos, 0);
+	return 0;
+}
+
+void aesd_queue_deinit(struct aesd_queue* q){
+	free(q->cells);
+	q->cells = NULL;
+}
+
+int aesd_queue_push(struct aesd_queue* q, void* data){
+	struct aesd_queue_cell* cell;
+	size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+	while(1){
+		cell = &q->cells[pos & q->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if(!diff){
+			if(atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		}
+		else if(diff < 0){
+			return -1;
+		}
+		else{
+			pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+		}
+	}
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+void* aesd_queue_pop(struct aesd_queue* q){
+	struct aesd_queue_cell* cell;
+	size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+	while(1){
+		cell = &q->cells[pos & q->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if(!diff){
+			if(atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)){
+				break;
+			}
+		}
+		else if(diff < 0){
+			return NULL;
+		}
+		else{
+			pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+		}
+	}
+	void* data = cell->data;
+	atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+	return data;
+}
@@ -0,0 +1,63 @@
+/**
+ * @file aesd-queue.h
+ * @brief Bounded lock-free multi-producer multi-consumer ring queue
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_QUEUE_H
+#define AESD_QUEUE_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define AESD_CACHELINE 64
+
+struct aesd_queue_cell {
+	atomic_size_t seq; /* Position the cell is ready for */
+	void* data;
+};
+/*
+ * Every cell carries a sequence number, so producers and consumers only
+ * contend on their own position counter. See D. Vyukov's bounded MPMC queue.
+ */
+struct aesd_queue {
+	struct aesd_queue_cell* cells;
+	size_t mask; /* Capacity - 1, capacity is a power of two */
+	_Alignas(AESD_CACHELINE) atomic_size_t enqueue_pos;
+	_Alignas(AESD_CACHELINE) atomic_size_t dequeue_pos;
+};
+
+/**
+ * @brief This function allocates queue cells
+ *
+ * @param q queue to initialise
+ * @param capacity minimal count of elements, rounded up to a power of two
+ * @return success status 0 - success
+ */
+int aesd_queue_init(struct aesd_queue* q, size_t capacity);
+/**
+ * @brief This function releases queue cells. Elements left in the queue are not touched
+ *
+ * @param q queue to deinitialise
+ * @return void
+ */
+void aesd_queue_deinit(struct aesd_queue* q);
+/**
+ * @brief This function appends an element to the queue. Safe to call from any thread
+ *
+ * @param q destination queue
+ * @param data element to append
+ * @return success status 0 - success, -1 - queue is full
+ */
+int aesd_queue_push(struct aesd_queue* q, void* data);
+/**
+ * @brief This function takes the oldest element from the queue. Safe to call from any thread
+ *
+ * @param q source queue
+ * @return element or NULL if the queue is empty
+ */
+void* aesd_queue_pop(struct aesd_queue* q);
+
+#endif /* AESD_QUEUE_H */
@@ -0,0 +1,574 @@
+/**
+ * @file aesd-reactor.c
+ * @brief Edge-triggered epoll event loop for the aesdsocket server.
+ * Every reactor thread owns an epoll instance, accepts connections from the
+ * shared listening socket and drives per-connection state machines:
+ * receive until newline, commit the packet, send the log back.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "aesdsocket.h"
+#include "aesd-reactor.h"
+#include "aesd-readback.h"
+#include "aesd-framer.h"
+#include "aesd-arena.h"
+#include "aesd-log.h"
+#include "aesd-metrics.h"
+#include "aesd-subscribe.h"
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_ACCEPT_BATCH 32 // accepts per wakeup, leaves the rest to other reactors
+#define REACTOR_SWEEP_MS 1000 // longest epoll wait when the -I or -O timeout is set
+
+enum conn_state {
+	CONN_RECV = 0, /* Collecting bytes until a newline */
+	CONN_SEND, /* Streaming the log back to the client */
+	CONN_CLOSE /* Connection must be released */
+};
+/*
+ * Per-connection state machine owned by a single reactor
+ */
+struct reactor_conn {
+	int sd; /* Socket descriptor */
+	int fd; /* Backend descriptor while the read-back is in flight, -1 otherwise */
+	int state; /* One of conn_state */
+	struct framer fr; /* Received bytes which are not committed yet */
+	struct readback rb; /* Read-back in progress in CONN_SEND */
+	struct session session; /* Protocol state of the connection */
+	time_t active; /* idle_clock() of the last progress, for the -I and -O timeouts */
+	struct reactor_conn* prev;
+	struct reactor_conn* next;
+	struct arena* arena; /* Holds this structure and the framing buffer */
+	char address[INET6_ADDRSTRLEN];
+};
+/*
+ * Reactor thread context
+ */
+struct reactor {
+	pthread_t thr; /* Thread descriptor*/
+	int epfd; /* epoll instance */
+	int sockfd; /* Listening socket, shared by all reactors unless g_config.reuseport */
+	int own_listener; /* sockfd was opened by this reactor and is closed with it */
+	int cpu; /* CPU the thread is pinned to, -1 - not pinned */
+	struct reactor_conn* conns; /* Live connections of this reactor */
+	time_t swept; /* idle_clock() of the last timeout sweep */
+	int draining; /* The listeners are no longer served */
+};
+
+static int g_wakefd = -1;
+/* epoll_event.data.ptr markers for the non-connection descriptors */
+static int listen_tag, unix_tag, wake_tag, timer_tag;
+
+static void conn_close(struct reactor* r, struct reactor_conn* c){
+	aesd_log(LOG_INFO, "Closed connection from %s", c->address);
+	if(c->prev){
+		c->prev->next = c->next;
+	}
+	else{
+		r->conns = c->next;
+	}
+	if(c->next){
+		c->next->prev = c->prev;
+	}
+	if(c->state == CONN_SEND){
+		readback_deinit(&c->rb);
+	}
+	if(c->fd != -1){
+		close(c->fd);
+	}
+	close(c->sd);
+	framer_deinit(&c->fr);
+	arena_put(c->arena);
+	leave_connection();
+	metrics_add(METRIC_CLOSED, 1);
+}
+
+/*
+ * Reads one chunk from the socket.
+ * Returns 0 when bytes or EOF were received, 1 when the socket is drained, -1 on error
+ */
+static int conn_recv(struct reactor_conn* c){
+	size_t avail;
+	char* space = framer_reserve(&c->fr, g_config.recv_chunk, &avail);
+	if(!space){
+		if(errno == EMSGSIZE){
+			shed_connection(c->sd, OVERSIZE_REPLY);
+			return -1;
+		}
+		aesd_log(LOG_ERR, "framer_reserve FAILED");
+		return -1;
+	}
+	while(1){
+		ssize_t res = recv(c->sd, space, avail, 0);
+		if(res >= 0){
+			framer_commit(&c->fr, res);
+			c->active = idle_clock();
+			return 0;
+		}
+		if(errno == EINTR){
+			continue;
+		}
+		if(errno == EAGAIN || errno == EWOULDBLOCK){
+			return 1;
+		}
+		aesd_log(LOG_ERR, "recv FAILED error:%s", strerror(errno));
+		return -1;
+	}
+}
+
+/*
+ * Commits a framed packet and prepares the read-back.
+ * Returns -1 when the connection must be closed, also after it subscribed
+ */
+static int conn_commit(struct reactor* r, struct reactor_conn* c, struct frame* f){
+	off_t start, end;
+	int res = process_packet(&c->session, c->fd, f, &start, &end);
+	if(res == PACKET_CHANNEL){
+		/* Nothing of the connection uses the descriptor between packets */
+		close(c->fd);
+		c->fd = c->session.channel_fd;
+		res = 0;
+	}
+	if(res == PACKET_SUBSCRIBED){
+		/* The duplicate kept by the subscription would still report to this epoll */
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->sd, NULL);
+		subscribe_add(c->sd, start);
+		return -1;
+	}
+	if(res){
+		return -1;
+	}
+	readback_init(&c->rb, c->fd, start, end, c->arena);
+	if(c->session.compress && readback_compress(&c->rb, c->session.channel)){
+		readback_deinit(&c->rb);
+		return -1;
+	}
+	c->state = CONN_SEND;
+	c->active = idle_clock();
+	return 0;
+}
+
+/*
+ * Advances the connection state machine until it has to wait for the socket
+ */
+static void conn_process(struct reactor* r, struct reactor_conn* c){
+	int res;
+	while(c->state != CONN_CLOSE){
+		if(c->state == CONN_SEND){
+			off_t off = c->rb.off;
+			res = readback_send(&c->rb, c->sd);
+			if(res == 1){
+				if(c->rb.off != off){
+					c->active = idle_clock();
+				}
+				return;
+			}
+			if(!res){
+				c->session.cursor = c->rb.off;
+			}
+			/* An aborted read-back closes the connection, the cursor stays */
+			readback_deinit(&c->rb);
+			c->state = res ? CONN_CLOSE : CONN_RECV;
+			continue;
+		}
+		struct frame f;
+		if(framer_next(&c->fr, &f)){
+			if(conn_commit(r, c, &f)){
+				c->state = CONN_CLOSE;
+			}
+			continue;
+		}
+		if(framer_done(&c->fr)){
+			c->state = CONN_CLOSE;
+			continue;
+		}
+		res = conn_recv(c);
+		if(res > 0){
+			/* A draining server lets the client go once every packet is answered */
+			if(drain_ready(&c->fr)){
+				c->state = CONN_CLOSE;
+				continue;
+			}
+			return;
+		}
+		if(res < 0){
+			c->state = CONN_CLOSE;
+		}
+	}
+	conn_close(r, c);
+}
+
+static void reactor_accept(struct reactor* r, int sockfd){
+	for(int i = 0; i < REACTOR_ACCEPT_BATCH; i++){
+		struct sockaddr_storage their_addr;
+		socklen_t addr_size = sizeof their_addr;
+		int sd = accept4(sockfd, (struct sockaddr *)&their_addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(sd == -1){
+			if(errno == EINTR || errno == ECONNABORTED){
+				continue;
+			}
+			if(errno != EAGAIN && errno != EWOULDBLOCK && work_state){
+				aesd_log(LOG_ERR, "accept FAILED error:%s", strerror(errno));
+			}
+			return;
+		}
+		if(admit_connection(sd)){
+			close(sd);
+			continue;
+		}
+		struct arena* arena = arena_get();
+		if(!arena){
+			shed_connection(sd, BUSY_REPLY);
+			close(sd);
+			leave_connection();
+			continue;
+		}
+		struct reactor_conn* c = arena_alloc(arena, sizeof(struct reactor_conn));
+		memset(c, 0, sizeof(struct reactor_conn));
+		c->arena = arena;
+		c->sd = sd;
+		/* Kept for the life of the connection, CHANNEL_COMMAND replaces it */
+		c->fd = open_backend(0);
+		if(c->fd == -1){
+			close(sd);
+			arena_put(arena);
+			leave_connection();
+			continue;
+		}
+		c->state = CONN_RECV;
+		c->active = idle_clock();
+		c->session.arena = arena;
+		/* The rest of the arena is the framing buffer, one byte is kept for the terminator */
+		size_t cap;
+		char* buf = arena_rest(arena, ARENA_BYTES, &cap);
+		framer_init_lent(&c->fr, buf, cap ? cap - 1 : 0);
+		peer_address(&their_addr, c->address);
+		aesd_log(LOG_INFO, "Accepted connection from %s; new_fd: %d", c->address, sd);
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, sd, &ev)){
+			aesd_log(LOG_ERR, "epoll_ctl FAILED error:%s", strerror(errno));
+			close(c->fd);
+			close(sd);
+			arena_put(arena);
+			leave_connection();
+			continue;
+		}
+		c->next = r->conns;
+		if(r->conns){
+			r->conns->prev = c;
+		}
+		r->conns = c;
+		metrics_add(METRIC_ACCEPTED, 1);
+	}
+}
+
+/*
+ * Closes the connections which made no progress for the -I or -O timeout.
+ * Runs at most once a second
+ */
+static void reactor_sweep(struct reactor* r){
+	time_t now = idle_clock();
+	if(now == r->swept){
+		return;
+	}
+	r->swept = now;
+	struct reactor_conn* c = r->conns;
+	while(c){
+		struct reactor_conn* next = c->next;
+		if(idle_expired(c->state == CONN_SEND, c->active, now)){
+			aesd_log(LOG_WARNING, "Connection from %s timed out", c->address);
+			conn_close(r, c);
+		}
+		c = next;
+	}
+}
+
+/*
+ * Stops serving the listeners and closes the connections waiting between packets.
+ * A listener of its own is closed once the connections queued on it are taken,
+ * the rest of its SO_REUSEPORT group, a successor's listeners too, goes on accepting
+ */
+static void reactor_drain(struct reactor* r){
+	r->draining = 1;
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->sockfd, NULL);
+	if(g_unixfd != -1){
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, g_unixfd, NULL);
+	}
+	/* Level-triggered and never read, the drain is checked by timeout instead */
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, g_wakefd, NULL);
+	if(r->own_listener){
+		reactor_accept(r, r->sockfd);
+		close(r->sockfd);
+		r->own_listener = 0;
+	}
+	struct reactor_conn* c = r->conns;
+	while(c){
+		struct reactor_conn* next = c->next;
+		if(c->state == CONN_RECV && drain_ready(&c->fr)){
+			conn_close(r, c);
+		}
+		c = next;
+	}
+}
+
+static void* reactor_loop(void* arg){
+	struct reactor* r = (struct reactor*)arg;
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+	int timeouts = g_config.recv_timeout || g_config.send_timeout;
+	while(work_state){
+		int wait = timeouts ? REACTOR_SWEEP_MS : -1;
+		if(drain_state){
+			if(!r->draining){
+				reactor_drain(r);
+			}
+			if(drain_expired() || !r->conns){
+				break;
+			}
+			wait = DRAIN_KICK_MS;
+		}
+		int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, wait);
+		if(n == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			aesd_log(LOG_ERR, "epoll_wait FAILED error:%s", strerror(errno));
+			break;
+		}
+		for(int i = 0; i < n && work_state; i++){
+			void* ptr = events[i].data.ptr;
+			if(ptr == &listen_tag){
+				reactor_accept(r, r->sockfd);
+			}
+			else if(ptr == &unix_tag){
+				reactor_accept(r, g_unixfd);
+			}
+			else if(ptr == &timer_tag){
+				timer_handler();
+			}
+			else if(ptr != &wake_tag){
+				conn_process(r, (struct reactor_conn*)ptr);
+			}
+		}
+		if(timeouts){
+			reactor_sweep(r);
+		}
+	}
+	while(r->conns){
+		conn_close(r, r->conns);
+	}
+	return r;
+}
+
+static void reactor_deinit(struct reactor* r){
+	close(r->epfd);
+	if(r->own_listener){
+		close(r->sockfd);
+	}
+}
+
+/*
+ * Returns the index-th CPU the process may run on, wrapping around, -1 if unknown
+ */
+static int reactor_cpu(int index){
+	cpu_set_t set;
+	if(sched_getaffinity(0, sizeof(set), &set)){
+		return -1;
+	}
+	int count = CPU_COUNT(&set);
+	if(!count){
+		return -1;
+	}
+	index %= count;
+	for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+		if(CPU_ISSET(cpu, &set) && !index--){
+			return cpu;
+		}
+	}
+	return -1;
+}
+
+/*
+ * With g_config.reuseport the first reactor serves the main listener and
+ * every other one opens its own listener in the same SO_REUSEPORT group.
+ * The kernel then spreads new connections over the reactors by flow hash.
+ */
+static int reactor_init(struct reactor* r, int index, int sockfd){
+	struct epoll_event ev;
+	memset(r, 0, sizeof(struct reactor));
+	r->sockfd = sockfd;
+	r->cpu = -1;
+	if(g_config.reuseport){
+		if(index){
+			r->sockfd = init_listener();
+			if(r->sockfd == -1){
+				return -1;
+			}
+			r->own_listener = 1;
+		}
+		r->cpu = reactor_cpu(index);
+		/* Prefer the listener whose reactor runs on the CPU that took the SYN */
+		if(r->cpu != -1 && setsockopt(r->sockfd, SOL_SOCKET, SO_INCOMING_CPU, &r->cpu, sizeof(r->cpu))){
+			aesd_log(LOG_WARNING, "setsockopt SO_INCOMING_CPU FAILED error:%s", strerror(errno));
+		}
+	}
+	int flags = fcntl(r->sockfd, F_GETFL);
+	if(flags == -1 || fcntl(r->sockfd, F_SETFL, flags | O_NONBLOCK)){
+		aesd_log(LOG_ERR, "fcntl FAILED error:%s", strerror(errno));
+		if(r->own_listener){
+			close(r->sockfd);
+		}
+		return -1;
+	}
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(r->epfd == -1){
+		aesd_log(LOG_ERR, "epoll_create1 FAILED error:%s", strerror(errno));
+		if(r->own_listener){
+			close(r->sockfd);
+		}
+		return -1;
+	}
+	/* Level-triggered and exclusive: one reactor is woken per incoming connection */
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = &listen_tag;
+	if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->sockfd, &ev)){
+		aesd_log(LOG_ERR, "epoll_ctl FAILED error:%s", strerror(errno));
+		reactor_deinit(r);
+		return -1;
+	}
+	/* The Unix listener is shared by every reactor, even with per-reactor TCP listeners */
+	ev.data.ptr = &unix_tag;
+	if(g_unixfd != -1 && epoll_ctl(r->epfd, EPOLL_CTL_ADD, g_unixfd, &ev)){
+		aesd_log(LOG_ERR, "epoll_ctl FAILED error:%s", strerror(errno));
+		reactor_deinit(r);
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wake_tag;
+	if(epoll_ctl(r->epfd, EPOLL_CTL_ADD, g_wakefd, &ev)){
+		aesd_log(LOG_ERR, "epoll_ctl FAILED error:%s", strerror(errno));
+		reactor_deinit(r);
+		return -1;
+	}
+	/* Timestamps are appended by the first reactor */
+	ev.data.ptr = &timer_tag;
+	if(!index && g_timerfd != -1 && epoll_ctl(r->epfd, EPOLL_CTL_ADD, g_timerfd, &ev)){
+		aesd_log(LOG_ERR, "epoll_ctl FAILED error:%s", strerror(errno));
+		reactor_deinit(r);
+		return -1;
+	}
+	return 0;
+}
+
+static int reactor_start(struct reactor* r){
+	pthread_attr_t attr;
+	if(pthread_attr_init(&attr)){
+		aesd_log(LOG_ERR, "pthread_attr_init FAILED");
+		return -1;
+	}
+	if(r->cpu != -1){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(r->cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+	int res = pthread_create(&r->thr, &attr, reactor_loop, r);
+	pthread_attr_destroy(&attr);
+	if(res){
+		aesd_log(LOG_ERR, "pthread_create FAILED");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Thousands of idle connections do not fit the default soft descriptor limit
+ */
+static void raise_fd_limit(){
+	struct rlimit lim;
+	if(getrlimit(RLIMIT_NOFILE, &lim)){
+		return;
+	}
+	if(lim.rlim_cur < lim.rlim_max){
+		lim.rlim_cur = lim.rlim_max;
+		if(setrlimit(RLIMIT_NOFILE, &lim)){
+			aesd_log(LOG_WARNING, "setrlimit FAILED error:%s", strerror(errno));
+		}
+	}
+}
+
+int reactor_run(int sockfd, int workers){
+	raise_fd_limit();
+	g_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(g_wakefd == -1){
+		aesd_log(LOG_ERR, "eventfd FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	int flags;
+	if(g_unixfd != -1 && ((flags = fcntl(g_unixfd, F_GETFL)) == -1 || fcntl(g_unixfd, F_SETFL, flags | O_NONBLOCK))){
+		aesd_log(LOG_ERR, "fcntl FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	struct reactor* reactors = calloc(workers, sizeof(struct reactor));
+	if(!reactors){
+		aesd_log(LOG_ERR, "calloc FAILED");
+		return -1;
+	}
+	int started = 0, res = 0;
+	for(; started < workers; started++){
+		if(reactor_init(&reactors[started], started, sockfd)){
+			res = -1;
+			break;
+		}
+		if(reactor_start(&reactors[started])){
+			reactor_deinit(&reactors[started]);
+			res = -1;
+			break;
+		}
+	}
+	aesd_log(LOG_INFO, "Started %d reactors%s", started, g_config.reuseport ? " with per-reactor listeners" : "");
+	if(res){
+		work_state = 0;
+		reactor_wakeup();
+	}
+	for(int i = 0; i < started; i++){
+		pthread_join(reactors[i].thr, NULL);
+		reactor_deinit(&reactors[i]);
+	}
+	free(reactors);
+	return res;
+}
+
+void reactor_wakeup(){
+	uint64_t one = 1;
+	if(g_wakefd != -1){
+		if(write(g_wakefd, &one, sizeof(one)) == -1){
+			/* Counter is already non-zero, reactors are being woken */
+		}
+	}
+}
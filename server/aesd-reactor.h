@@ -0,0 +1,32 @@
+/**
+ * @file aesd-reactor.h
+ * @brief Edge-triggered epoll event loop for the aesdsocket server
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_REACTOR_H
+#define AESD_REACTOR_H
+
+/**
+ * @brief This function serves the listening socket with a fixed number of epoll reactors.
+ * Each reactor accepts connections itself and keeps a receive/send state machine
+ * per connection. With g_config.reuseport every reactor but the first opens
+ * its own SO_REUSEPORT listener and each reactor is pinned to a CPU.
+ * Returns when work_state is cleared or every connection is finished by the drain.
+ *
+ * @param sockfd listening socket descriptor, served by the first reactor with g_config.reuseport
+ * @param workers count of reactor threads
+ * @return success status 0 - success
+ */
+int reactor_run(int sockfd, int workers);
+/**
+ * @brief This function wakes up every reactor so that it notices work_state or drain_state change.
+ * It is async-signal-safe and does nothing if reactors are not running
+ *
+ * @return void
+ */
+void reactor_wakeup();
+
+#endif /* AESD_REACTOR_H */
@@ -0,0 +1,455 @@
+/**
+ * @file aesd-readback.c
+ * @brief Zero-copy streaming of the conversation log to a socket.
+ * The regular file goes out with sendfile(2), the char device with splice(2)
+ * through a pipe. A driver without splice support falls back to a copy loop
+ * with a large buffer. Segments are sent straight from their mappings.
+ * A compressed read-back has to copy, it is read block by block and every
+ * block goes out as a frame of aesd-compress.h.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "aesdsocket.h"
+#include "aesd-readback.h"
+#include "aesd-ring.h"
+#include "aesd-segment.h"
+#include "aesd-arena.h"
+#include "aesd-log.h"
+#include "aesd-metrics.h"
+#include "aesd-compress.h"
+
+/*
+ * Count of bytes to move by the next syscall
+ */
+static size_t readback_count(struct readback* rb, size_t max){
+	if(rb->end >= 0 && rb->off >= rb->end){
+		return 0;
+	}
+	if(rb->end >= 0 && rb->end - rb->off < (off_t)max){
+		return rb->end - rb->off;
+	}
+	return max;
+}
+
+static int would_block(){
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static int send_method(struct readback* rb, int sockfd);
+
+/*
+ * Nothing was transferred yet and the backend does not support the method
+ */
+static int fall_back(struct readback* rb){
+	if(rb->off != rb->start || rb->in_pipe || (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)){
+		return 0;
+	}
+	aesd_log(LOG_INFO, "Read-back method %d is not supported, copying", rb->method);
+	if(rb->method == READBACK_SPLICE){
+		close(rb->pipefd[0]);
+		close(rb->pipefd[1]);
+		rb->pipefd[0] = rb->pipefd[1] = -1;
+	}
+	rb->method = READBACK_COPY;
+	return 1;
+}
+
+static int send_sendfile(struct readback* rb, int sockfd){
+	while(work_state){
+		size_t count = readback_count(rb, 0x7ffff000);
+		if(!count){
+			return 0;
+		}
+		ssize_t res = sendfile(sockfd, rb->fd, &rb->off, count);
+		if(res == 0){
+			return 0;
+		}
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(would_block()){
+				return 1;
+			}
+			if(fall_back(rb)){
+				return send_method(rb, sockfd);
+			}
+			aesd_log(LOG_ERR, "sendfile FAILED error:%s", strerror(errno));
+			return -1;
+		}
+		rb->sent += res;
+	}
+	return READBACK_ABORTED;
+}
+
+static int send_splice(struct readback* rb, int sockfd){
+	while(work_state){
+		if(!rb->in_pipe){
+			size_t count = readback_count(rb, g_config.readback_chunk);
+			if(!count){
+				return 0;
+			}
+			/* The device keeps its own file position, so no offset is passed */
+			ssize_t res = splice(rb->fd, NULL, rb->pipefd[1], NULL, count, SPLICE_F_MOVE);
+			if(res == 0){
+				return 0;
+			}
+			if(res == -1){
+				if(errno == EINTR){
+					continue;
+				}
+				if(fall_back(rb)){
+					return send_method(rb, sockfd);
+				}
+				aesd_log(LOG_ERR, "splice FAILED error:%s", strerror(errno));
+				return -1;
+			}
+			rb->off += res;
+			rb->in_pipe = res;
+		}
+		ssize_t res = splice(rb->pipefd[0], NULL, sockfd, NULL, rb->in_pipe, SPLICE_F_MOVE);
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(would_block()){
+				return 1;
+			}
+			aesd_log(LOG_ERR, "splice FAILED error:%s", strerror(errno));
+			return -1;
+		}
+		rb->in_pipe -= res;
+		rb->sent += res;
+	}
+	return READBACK_ABORTED;
+}
+
+static int send_segment(struct readback* rb, int sockfd){
+	while(work_state){
+		ssize_t res = segment_send(sockfd, &rb->off, rb->end);
+		if(res == 0){
+			return 0;
+		}
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(would_block()){
+				return 1;
+			}
+			aesd_log(LOG_ERR, "send FAILED error:%s", strerror(errno));
+			return -1;
+		}
+		rb->sent += res;
+	}
+	return READBACK_ABORTED;
+}
+
+static int send_copy(struct readback* rb, int sockfd){
+	if(!rb->buf){
+		/* The arena keeps its buffer, so copies of a connection allocate once */
+		rb->buf = rb->arena ? arena_scratch(rb->arena) : malloc(g_config.readback_chunk);
+		if(!rb->buf){
+			aesd_log(LOG_ERR, "malloc FAILED");
+			return -1;
+		}
+	}
+	while(work_state){
+		if(rb->buf_off == rb->buf_len){
+			size_t count = readback_count(rb, g_config.readback_chunk);
+			if(!count){
+				return 0;
+			}
+			ssize_t res;
+			if(rb->method == READBACK_RING){
+				/* Copied under the ring lock, eviction can not tear the chunk */
+				res = ring_read(&rb->off, rb->end, rb->buf, count);
+				if(!res){
+					return 0;
+				}
+				rb->buf_len = res;
+				rb->buf_off = 0;
+				continue;
+			}
+			res = pread(rb->fd, rb->buf, count, rb->off);
+			if(res == -1){
+				if(errno == EINTR){
+					continue;
+				}
+				aesd_log(LOG_ERR, "read FAILED error:%s", strerror(errno));
+				return -1;
+			}
+			if(!res){
+				return 0;
+			}
+			rb->off += res;
+			rb->buf_len = res;
+			rb->buf_off = 0;
+		}
+		ssize_t res = send(sockfd, rb->buf + rb->buf_off, rb->buf_len - rb->buf_off, MSG_NOSIGNAL);
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(would_block()){
+				return 1;
+			}
+			aesd_log(LOG_ERR, "send FAILED error:%s", strerror(errno));
+			return -1;
+		}
+		rb->buf_off += res;
+		rb->sent += res;
+	}
+	return READBACK_ABORTED;
+}
+
+/*
+ * Reads the log bytes of the next frame into raw, up to the next block boundary.
+ * Returns the count of bytes, 0 at the end, -1 on error
+ */
+static ssize_t compress_read(struct readback* rb, off_t* first){
+	size_t want = readback_count(rb, COMPRESS_BLOCK - rb->off % COMPRESS_BLOCK);
+	size_t len = 0;
+	*first = rb->off;
+	while(len < want){
+		off_t from = rb->off;
+		ssize_t res;
+		if(rb->method == READBACK_RING){
+			res = ring_read(&rb->off, rb->end, rb->raw + len, want - len);
+		}
+		else if(rb->method == READBACK_SEGMENT){
+			res = segment_read(&rb->off, rb->end, rb->raw + len, want - len);
+		}
+		else{
+			/* The device keeps its own file position */
+			res = USE_AESD_CHAR_DEVICE ? read(rb->fd, rb->raw + len, want - len) : pread(rb->fd, rb->raw + len, want - len, rb->off);
+			if(res == -1){
+				if(errno == EINTR){
+					continue;
+				}
+				aesd_log(LOG_ERR, "read FAILED error:%s", strerror(errno));
+				return -1;
+			}
+			rb->off += res;
+		}
+		if(!res){
+			break;
+		}
+		if(rb->off - res != from){
+			/* Evicted meanwhile, the frame holds only the bytes after the gap */
+			memmove(rb->raw, rb->raw + len, res);
+			*first = rb->off - res;
+			return res;
+		}
+		len += res;
+	}
+	return len;
+}
+
+/*
+ * Logs whose history outlives a few read-backs: the regular file and the
+ * segments. The char device renumbers its bytes when it wraps and the ring
+ * evicts them soon, their frames are not cached
+ */
+static int compress_cacheable(){
+	return g_config.compress_cache && (g_config.backend == BACKEND_SEGMENT ||
+			(g_config.backend == BACKEND_STORAGE && !USE_AESD_CHAR_DEVICE));
+}
+
+ssize_t readback_fill(struct readback* rb){
+	rb->buf_len = rb->buf_off = 0;
+	if(rb->finished){
+		return 0;
+	}
+	int cacheable = compress_cacheable();
+	if(cacheable && rb->method == READBACK_SEGMENT){
+		/* Blocks before the oldest retained byte are deleted, so are their frames */
+		off_t oldest = segment_find_record(0, 0);
+		if(oldest >= 0){
+			compress_trim(rb->channel, (oldest + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK);
+			if(rb->off < oldest){
+				rb->off = oldest;
+			}
+		}
+	}
+	ssize_t res;
+	if(cacheable && !(rb->off % COMPRESS_BLOCK) && (rb->end < 0 || rb->end - rb->off >= COMPRESS_BLOCK)){
+		res = compress_cached(rb->channel, rb->off / COMPRESS_BLOCK, rb->buf);
+		if(res){
+			rb->off += COMPRESS_BLOCK;
+			rb->buf_len = res;
+			return res;
+		}
+	}
+	off_t first;
+	ssize_t len = compress_read(rb, &first);
+	if(len < 0){
+		return -1;
+	}
+	if(!len){
+		rb->finished = 1;
+	}
+	res = compress_frame(rb->zs, rb->raw, len, rb->buf);
+	if(res < 0){
+		return -1;
+	}
+	if(cacheable && len == COMPRESS_BLOCK && !(first % COMPRESS_BLOCK)){
+		/* A whole block is below the log length, its bytes never change */
+		compress_cache(rb->channel, first / COMPRESS_BLOCK, rb->buf, res);
+	}
+	rb->buf_len = res;
+	return res;
+}
+
+static int send_compressed(struct readback* rb, int sockfd){
+	while(work_state){
+		if(rb->buf_off == rb->buf_len){
+			ssize_t res = readback_fill(rb);
+			if(res <= 0){
+				return res;
+			}
+		}
+		ssize_t res = send(sockfd, rb->buf + rb->buf_off, rb->buf_len - rb->buf_off, MSG_NOSIGNAL);
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(would_block()){
+				return 1;
+			}
+			aesd_log(LOG_ERR, "send FAILED error:%s", strerror(errno));
+			return -1;
+		}
+		rb->buf_off += res;
+		rb->sent += res;
+	}
+	return READBACK_ABORTED;
+}
+
+void readback_init(struct readback* rb, int fd, off_t start, off_t end, struct arena* arena){
+	memset(rb, 0, sizeof(struct readback));
+	rb->fd = fd;
+	rb->arena = arena;
+	rb->started = metrics_now();
+	rb->start = start;
+	rb->off = start;
+	rb->end = end;
+	if(g_config.backend != BACKEND_STORAGE){
+		rb->pipefd[0] = rb->pipefd[1] = -1;
+		rb->method = g_config.backend == BACKEND_RING ? READBACK_RING : READBACK_SEGMENT;
+		return;
+	}
+	if(USE_AESD_CHAR_DEVICE && lseek(fd, start, SEEK_SET) == -1){
+		aesd_log(LOG_WARNING, "lseek FAILED error:%s", strerror(errno));
+	}
+	rb->pipefd[0] = rb->pipefd[1] = -1;
+	rb->method = USE_AESD_CHAR_DEVICE ? READBACK_SPLICE : READBACK_SENDFILE;
+	if(rb->method == READBACK_SPLICE && pipe2(rb->pipefd, O_CLOEXEC)){
+		aesd_log(LOG_WARNING, "pipe2 FAILED error:%s", strerror(errno));
+		rb->method = READBACK_COPY;
+	}
+}
+
+int readback_compress(struct readback* rb, int channel){
+	rb->raw = malloc(COMPRESS_BLOCK + COMPRESS_FRAME_MAX);
+	if(!rb->raw){
+		aesd_log(LOG_ERR, "malloc FAILED");
+		return -1;
+	}
+	rb->zs = compress_open();
+	if(!rb->zs){
+		free(rb->raw);
+		rb->raw = NULL;
+		return -1;
+	}
+	rb->buf = rb->raw + COMPRESS_BLOCK;
+	rb->channel = channel;
+	if(rb->pipefd[0] != -1){
+		close(rb->pipefd[0]);
+		close(rb->pipefd[1]);
+		rb->pipefd[0] = rb->pipefd[1] = -1;
+	}
+	if(g_config.backend == BACKEND_STORAGE){
+		rb->method = READBACK_COPY;
+	}
+	return 0;
+}
+
+static int send_method(struct readback* rb, int sockfd){
+	if(rb->zs){
+		return send_compressed(rb, sockfd);
+	}
+	switch(rb->method){
+		case READBACK_SENDFILE:
+			return send_sendfile(rb, sockfd);
+		case READBACK_SPLICE:
+			return send_splice(rb, sockfd);
+		case READBACK_SEGMENT:
+			return send_segment(rb, sockfd);
+		default:
+			return send_copy(rb, sockfd);
+	}
+}
+
+int readback_cork(int sockfd, int on){
+	if(!g_config.cork){
+		return 0;
+	}
+	/* Fails on the Unix connections, they have no segments to fill */
+	return !setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(int)) && on;
+}
+
+int readback_send(struct readback* rb, int sockfd){
+	if(!rb->corked && !rb->sent){
+		rb->corked = readback_cork(sockfd, 1);
+	}
+	int res = send_method(rb, sockfd);
+	if(res != 1 && rb->corked){
+		/* Pushes the partial last segment out at once */
+		rb->corked = readback_cork(sockfd, 0);
+	}
+	return res;
+}
+
+void readback_deinit(struct readback* rb){
+	if(rb->started){
+		metrics_add(METRIC_BYTES_OUT, rb->sent);
+		metrics_since(METRIC_READBACK, rb->started);
+		rb->started = 0;
+	}
+	if(rb->pipefd[0] != -1){
+		close(rb->pipefd[0]);
+		close(rb->pipefd[1]);
+		rb->pipefd[0] = rb->pipefd[1] = -1;
+	}
+	if(rb->zs){
+		compress_close(rb->zs);
+		rb->zs = NULL;
+		/* buf is part of raw */
+		free(rb->raw);
+		rb->raw = NULL;
+	}
+	else if(!rb->arena){
+		free(rb->buf);
+	}
+	rb->buf = NULL;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file aesd-readback.h
+ * @brief Zero-copy streaming of the conversation log to a socket
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_READBACK_H
+#define AESD_READBACK_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+struct arena;
+struct z_stream_s;
+
+#define READBACK_CHUNK 65536 // bytes moved per syscall by splice and the copy fallback when -c is not given
+#define READBACK_ABORTED 2 // readback_send result: work_state was cleared before the end was sent
+
+enum readback_method {
+	READBACK_SENDFILE = 0, /* sendfile(2) from the page cache, regular files */
+	READBACK_SPLICE, /* splice(2) through a pipe, char device */
+	READBACK_COPY, /* pread/send through a heap buffer when the others are not supported */
+	READBACK_RING, /* Copy from the in-process ring through a heap buffer */
+	READBACK_SEGMENT /* send(2) straight from the segment mappings */
+};
+/*
+ * Read-back in progress. Works for blocking and non-blocking sockets.
+ */
+struct readback {
+	int fd; /* Backend descriptor */
+	int method; /* One of readback_method */
+	off_t start; /* Backend offset the read-back started at */
+	off_t off; /* Next backend offset to send */
+	off_t end; /* Offset to stop at, -1 - to the end of file */
+	int pipefd[2]; /* READBACK_SPLICE pipe */
+	size_t in_pipe; /* Bytes spliced into the pipe but not to the socket yet */
+	char* buf; /* READBACK_COPY buffer */
+	size_t buf_len; /* Bytes in buf */
+	size_t buf_off; /* Bytes of buf already sent */
+	size_t sent; /* Bytes sent to the socket */
+	struct arena* arena; /* Arena lending its scratch buffer as buf, NULL - buf is allocated */
+	int corked; /* TCP_CORK is set on the socket until the read-back ends */
+	uint64_t started; /* metrics_now() of readback_init */
+	struct z_stream_s* zs; /* Deflate state of a compressed read-back, NULL - the log is sent as it is */
+	char* raw; /* Log bytes of the next frame, buf follows them in the same allocation */
+	int channel; /* Log the cached frames belong to */
+	int finished; /* The empty frame ending the reply is in buf */
+};
+
+/**
+ * @brief This function prepares a read-back of the backend. The char device
+ * is positioned to start, it reads from its own file position
+ *
+ * @param rb read-back to initialise
+ * @param fd backend file descriptor
+ * @param start log offset to send from
+ * @param end log offset to send up to, -1 - send to the end of file
+ * @param arena arena of the connection lending its scratch buffer to copies, may be NULL
+ * @return void
+ */
+void readback_init(struct readback* rb, int fd, off_t start, off_t end, struct arena* arena);
+/**
+ * @brief This function switches a prepared read-back to compressed frames of
+ * aesd-compress.h. Frames of whole blocks are taken from the cache or cached
+ *
+ * @param rb read-back of readback_init, nothing is sent yet
+ * @param channel log read back
+ * @return success status 0 - success
+ */
+int readback_compress(struct readback* rb, int channel);
+/**
+ * @brief This function puts the next frame of a compressed read-back into
+ * buf. The engines sending buf themselves call it when buf is sent
+ *
+ * @param rb compressed read-back
+ * @return length of the frame, 0 - the reply is complete, -1 - error
+ */
+ssize_t readback_fill(struct readback* rb);
+/**
+ * @brief This function sets or clears TCP_CORK on a connection when -K is given.
+ * A corked read-back leaves in full segments and its tail is pushed at the end
+ *
+ * @param sockfd connection socket descriptor
+ * @param on 1 - cork, 0 - uncork
+ * @return 1 - the socket is corked, 0 - it is not
+ */
+int readback_cork(int sockfd, int on);
+/**
+ * @brief This function sends as much of the read-back as the socket accepts.
+ * With -K the socket stays corked from the first call until the read-back ends
+ *
+ * @param rb read-back in progress
+ * @param sockfd destination socket descriptor
+ * @return 0 - everything is sent, 1 - the socket would block, -1 - error,
+ * READBACK_ABORTED - the server stopped first, off is not the end
+ */
+int readback_send(struct readback* rb, int sockfd);
+/**
+ * @brief This function releases the pipe and the buffer of the read-back and
+ * records it in the metrics. The backend descriptor is not closed
+ *
+ * @param rb read-back to release
+ * @return void
+ */
+void readback_deinit(struct readback* rb);
+
+#endif /* AESD_READBACK_H */
@@ -0,0 +1,297 @@
+/**
+ * @file aesd-ring.c
+ * @brief In-process ring backend of the aesdsocket conversation log.
+ * Packets are kept in a page-aligned anonymous mapping and evicted oldest first
+ * when the packet or byte limit is reached, like the aesdchar circular
+ * buffer. A packet index keeps where every retained packet starts.
+ * Reads copy from memory under the ring lock, an optional thread writes
+ * the retained packets to a checkpoint file. Appends are handed to the
+ * subscribers after the ring lock is released, in log order.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+#include "aesd-ring.h"
+#include "aesd-subscribe.h"
+#include "aesd-log.h"
+
+/*
+ * Ring state, guarded by lock
+ */
+struct ring {
+	pthread_mutex_t lock;
+	char* mem; /* Ring memory */
+	size_t cap; /* Size of mem */
+	off_t base; /* Log offset of the oldest retained byte */
+	off_t end; /* Log offset after the newest byte */
+	off_t* starts; /* Log offsets of the retained packets, a ring itself */
+	size_t idx_cap; /* Size of starts */
+	size_t idx_head; /* Slot of the oldest packet */
+	size_t idx_count; /* Count of retained packets */
+	long max_packets; /* Packet limit, 0 - none */
+	const char* checkpoint; /* Checkpoint file, NULL - none */
+	pthread_t thr; /* Checkpoint thread */
+	pthread_cond_t stop_cond; /* Signalled by ring_stop */
+	int stopping;
+	pthread_mutex_t publish_lock; /* Guards published, not the ring */
+	pthread_cond_t publish_cond; /* Signalled when published advances */
+	off_t published; /* Log offset up to which the subscribers have the packets */
+};
+
+static struct ring g_ring = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.publish_lock = PTHREAD_MUTEX_INITIALIZER,
+	.publish_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static size_t slot(size_t index){
+	return (g_ring.idx_head + index) % g_ring.idx_cap;
+}
+
+static void evict_oldest(){
+	g_ring.idx_head = slot(1);
+	g_ring.idx_count--;
+	g_ring.base = g_ring.idx_count ? g_ring.starts[g_ring.idx_head] : g_ring.end;
+}
+
+/*
+ * Doubles the packet index when there is no packet limit
+ */
+static int grow_index(){
+	size_t cap = g_ring.idx_cap * 2;
+	off_t* starts = malloc(cap * sizeof(off_t));
+	if(!starts){
+		return -1;
+	}
+	for(size_t i = 0; i < g_ring.idx_count; i++){
+		starts[i] = g_ring.starts[slot(i)];
+	}
+	free(g_ring.starts);
+	g_ring.starts = starts;
+	g_ring.idx_cap = cap;
+	g_ring.idx_head = 0;
+	return 0;
+}
+
+static void copy_in(off_t off, const char* buf, size_t n_byte){
+	size_t pos = off % g_ring.cap;
+	size_t first = g_ring.cap - pos < n_byte ? g_ring.cap - pos : n_byte;
+	memcpy(g_ring.mem + pos, buf, first);
+	memcpy(g_ring.mem, buf + first, n_byte - first);
+}
+
+static void copy_out(off_t off, char* buf, size_t n_byte){
+	size_t pos = off % g_ring.cap;
+	size_t first = g_ring.cap - pos < n_byte ? g_ring.cap - pos : n_byte;
+	memcpy(buf, g_ring.mem + pos, first);
+	memcpy(buf + first, g_ring.mem, n_byte - first);
+}
+
+/*
+ * Writes the retained packets to a temporary file and renames it over the checkpoint
+ */
+static void write_checkpoint(){
+	char path[PATH_MAX], buf[BUFSIZE];
+	snprintf(path, sizeof(path), "%s.tmp", g_ring.checkpoint);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(fd == -1){
+		aesd_log(LOG_ERR, "open FAILED error:%s", strerror(errno));
+		return;
+	}
+	off_t off = 0, limit;
+	ring_append(NULL, 0, &limit);
+	size_t res;
+	while((res = ring_read(&off, limit, buf, BUFSIZE)) > 0){
+		/* Not write_to_file, the last checkpoint is written after work_state is cleared */
+		for(size_t done = 0; done < res;){
+			ssize_t n = write(fd, buf + done, res - done);
+			if(n == -1 && errno != EINTR){
+				aesd_log(LOG_ERR, "write FAILED error:%s", strerror(errno));
+				close(fd);
+				unlink(path);
+				return;
+			}
+			done += n > 0 ? n : 0;
+		}
+	}
+	close(fd);
+	if(rename(path, g_ring.checkpoint)){
+		aesd_log(LOG_ERR, "rename FAILED error:%s", strerror(errno));
+		unlink(path);
+	}
+}
+
+static void* checkpoint_thread(void* arg){
+	off_t written = 0;
+	pthread_mutex_lock(&g_ring.lock);
+	while(!g_ring.stopping){
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += RING_CHECKPOINT_SEC;
+		pthread_cond_timedwait(&g_ring.stop_cond, &g_ring.lock, &deadline);
+		if(g_ring.end == written){
+			continue;
+		}
+		written = g_ring.end;
+		pthread_mutex_unlock(&g_ring.lock);
+		write_checkpoint();
+		pthread_mutex_lock(&g_ring.lock);
+	}
+	pthread_mutex_unlock(&g_ring.lock);
+	return arg;
+}
+
+int ring_start(long max_packets, size_t max_bytes, const char* checkpoint){
+	long page = sysconf(_SC_PAGESIZE);
+	g_ring.cap = (max_bytes + page - 1) / page * page;
+	g_ring.max_packets = max_packets;
+	g_ring.idx_cap = max_packets ? max_packets : 64;
+	g_ring.starts = malloc(g_ring.idx_cap * sizeof(off_t));
+	if(!g_ring.starts){
+		aesd_log(LOG_ERR, "malloc FAILED");
+		return -1;
+	}
+	g_ring.mem = mmap(NULL, g_ring.cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(g_ring.mem == MAP_FAILED){
+		aesd_log(LOG_ERR, "mmap FAILED error:%s", strerror(errno));
+		g_ring.mem = NULL;
+		return -1;
+	}
+	g_ring.checkpoint = checkpoint;
+	if(checkpoint){
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&g_ring.stop_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		if(pthread_create(&g_ring.thr, NULL, checkpoint_thread, NULL)){
+			aesd_log(LOG_ERR, "pthread_create FAILED");
+			g_ring.checkpoint = NULL;
+			return -1;
+		}
+	}
+	aesd_log(LOG_INFO, "Ring of %zu bytes, %ld packets", g_ring.cap, max_packets);
+	return 0;
+}
+
+void ring_stop(){
+	if(g_ring.checkpoint){
+		pthread_mutex_lock(&g_ring.lock);
+		g_ring.stopping = 1;
+		pthread_cond_signal(&g_ring.stop_cond);
+		pthread_mutex_unlock(&g_ring.lock);
+		pthread_join(g_ring.thr, NULL);
+		write_checkpoint();
+		g_ring.checkpoint = NULL;
+	}
+	if(g_ring.mem){
+		munmap(g_ring.mem, g_ring.cap);
+		g_ring.mem = NULL;
+	}
+	free(g_ring.starts);
+	g_ring.starts = NULL;
+}
+
+int ring_open(){
+	/* Only a placeholder for the engines, the ring is read by ring_read */
+	int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if(fd == -1){
+		aesd_log(LOG_ERR, "open of /dev/null FAILED error:%s", strerror(errno));
+	}
+	return fd;
+}
+
+int ring_append(const char* buf, size_t n_byte, off_t* snapshot){
+	if(n_byte > g_ring.cap){
+		aesd_log(LOG_ERR, "Packet of %zu bytes does not fit the ring", n_byte);
+		return -1;
+	}
+	off_t off = 0;
+	pthread_mutex_lock(&g_ring.lock);
+	if(n_byte){
+		while(g_ring.idx_count && (g_ring.end + (off_t)n_byte - g_ring.base > (off_t)g_ring.cap ||
+				(g_ring.max_packets && (long)g_ring.idx_count >= g_ring.max_packets))){
+			evict_oldest();
+		}
+		if(g_ring.idx_count == g_ring.idx_cap && grow_index()){
+			pthread_mutex_unlock(&g_ring.lock);
+			aesd_log(LOG_ERR, "malloc FAILED");
+			return -1;
+		}
+		g_ring.starts[slot(g_ring.idx_count++)] = g_ring.end;
+		copy_in(g_ring.end, buf, n_byte);
+		off = g_ring.end;
+		g_ring.end += n_byte;
+	}
+	if(snapshot){
+		*snapshot = g_ring.end;
+	}
+	pthread_mutex_unlock(&g_ring.lock);
+	if(n_byte){
+		/* Readers and appenders go on, the appends before this one are published first */
+		struct iovec iov = {(void*)buf, n_byte};
+		pthread_mutex_lock(&g_ring.publish_lock);
+		while(g_ring.published != off){
+			pthread_cond_wait(&g_ring.publish_cond, &g_ring.publish_lock);
+		}
+		subscribe_publish(off, &iov, 1);
+		g_ring.published = off + n_byte;
+		pthread_cond_broadcast(&g_ring.publish_cond);
+		pthread_mutex_unlock(&g_ring.publish_lock);
+	}
+	return 0;
+}
+
+size_t ring_read(off_t* off, off_t limit, char* buf, size_t count){
+	pthread_mutex_lock(&g_ring.lock);
+	if(*off < g_ring.base){
+		*off = g_ring.base;
+	}
+	if(limit < 0 || limit > g_ring.end){
+		limit = g_ring.end;
+	}
+	if(*off >= limit){
+		pthread_mutex_unlock(&g_ring.lock);
+		return 0;
+	}
+	if((off_t)count > limit - *off){
+		count = limit - *off;
+	}
+	copy_out(*off, buf, count);
+	*off += count;
+	pthread_mutex_unlock(&g_ring.lock);
+	return count;
+}
+
+off_t ring_find_record(uint32_t record, uint32_t offset){
+	off_t res = -1;
+	pthread_mutex_lock(&g_ring.lock);
+	if(record < g_ring.idx_count){
+		off_t start = g_ring.starts[slot(record)];
+		off_t end = record + 1 < g_ring.idx_count ? g_ring.starts[slot(record + 1)] : g_ring.end;
+		if(start + offset < end){
+			res = start + offset;
+		}
+	}
+	pthread_mutex_unlock(&g_ring.lock);
+	return res;
+}
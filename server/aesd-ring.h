@@ -0,0 +1,73 @@
+/**
+ * @file aesd-ring.h
+ * @brief In-process ring backend of the aesdsocket conversation log
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_RING_H
+#define AESD_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RING_DEFAULT_BYTES (1 << 20) // ring size when only the packet limit is given
+#define RING_CHECKPOINT_SEC 5 // period of the background checkpoint (-k)
+
+/**
+ * @brief This function allocates the ring and starts the checkpoint thread.
+ * Log offsets are absolute: they grow for the life of the server and
+ * offsets of evicted packets are read from the oldest retained packet
+ *
+ * @param max_packets packets retained, 0 - limited by max_bytes only
+ * @param max_bytes bytes retained, rounded up to the page size
+ * @param checkpoint file the retained packets are periodically written to, NULL - none
+ * @return success status 0 - success
+ */
+int ring_start(long max_packets, size_t max_bytes, const char* checkpoint);
+/**
+ * @brief This function writes the last checkpoint and releases the ring
+ *
+ * @return void
+ */
+void ring_stop();
+/**
+ * @brief This function returns a placeholder descriptor, so the ring is
+ * handled like the other backends by open_backend
+ *
+ * @return file descriptor or -1 on error
+ */
+int ring_open();
+/**
+ * @brief This function appends a packet, evicting the oldest packets over the limits
+ *
+ * @param buf packet
+ * @param n_byte packet length, 0 - only take the snapshot
+ * @param snapshot receives the log offset after the packet. May be NULL
+ * @return success status 0 - success, -1 - the packet is larger than the ring
+ */
+int ring_append(const char* buf, size_t n_byte, off_t* snapshot);
+/**
+ * @brief This function copies retained bytes out of the ring. An offset
+ * which was evicted is moved to the oldest retained packet
+ *
+ * @param off log offset to read from, advanced past the copied bytes
+ * @param limit log offset to stop at, -1 - the end of the ring
+ * @param buf destination
+ * @param count size of buf
+ * @return count of copied bytes, 0 - nothing more to read
+ */
+size_t ring_read(off_t* off, off_t limit, char* buf, size_t count);
+/**
+ * @brief This function translates a record and an offset within it to a log offset,
+ * records are counted from the oldest retained packet like AESDCHAR_IOCSEEKTO does
+ *
+ * @param record packet index
+ * @param offset byte within the packet
+ * @return log offset or -1 when there is no such byte
+ */
+off_t ring_find_record(uint32_t record, uint32_t offset);
+
+#endif /* AESD_RING_H */
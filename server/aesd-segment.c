@@ -0,0 +1,682 @@
+/**
+ * @file aesd-segment.c
+ * @brief Segmented on-disk backend of the aesdsocket conversation log.
+ * The log is split into segment files named after the log offset of their
+ * first byte. The active segment is sealed when the next packet would take
+ * it over the segment size, and the oldest sealed segments are deleted once
+ * the retained bytes or their age exceed the limits, so the log stays within
+ * a fixed share of the disk. With an age limit a thread also checks an idle
+ * log, which has no appends to trigger the check. Next to every segment a sparse index keeps the
+ * log offset of one packet per SEGMENT_INDEX_INTERVAL bytes, a record seek is
+ * a binary search over the segments and then over the index. A packet is
+ * one commit. Between two entries every packet but the last ends with a
+ * newline, so the packets after an entry are counted by their newlines: the
+ * packet after one without a newline always gets an entry. Every segment
+ * is mapped once and read-back is sent straight from the mapping. A reader
+ * holds a reference, so a deleted segment stays mapped until it is done.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "aesdsocket.h"
+#include "aesd-segment.h"
+#include "aesd-log.h"
+
+#define SEGMENT_NAME_LEN 24 // "%020lld.log"
+#define SEGMENT_SEND_MAX 0x7ffff000 // the most send(2) transfers at once
+
+/*
+ * Entry of the sparse packet index, also the record format of the index file
+ */
+struct segment_entry {
+	uint64_t packet; /* Packet number, counted from the first packet of the log */
+	uint64_t offset; /* Log offset the packet starts at */
+};
+/*
+ * Segment file. The list and the sizes are guarded by g_lock, the files
+ * are written by the group commit writer only
+ */
+struct segment {
+	off_t base; /* Log offset of the first byte, also the file name */
+	uint64_t first; /* Number of the first packet */
+	uint64_t packets; /* Count of packets */
+	size_t size; /* Bytes written */
+	size_t cap; /* Length of the mapping, the size the segment may grow to */
+	char* map; /* Read-only shared mapping of the file */
+	int fd; /* Segment file */
+	int idx_fd; /* Index file */
+	struct segment_entry* index; /* Sparse packet index, the first entry is the first packet */
+	size_t idx_count; /* Count of index entries */
+	size_t idx_cap; /* Size of index */
+	time_t mtime; /* Time of the last append */
+	atomic_int refs; /* The segment list and the readers using the mapping */
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // guards the list below
+static struct segment** g_segs = NULL; // oldest first, the last one is active
+static size_t g_count = 0;
+static size_t g_cap = 0;
+static int g_dirfd = -1;
+static size_t g_segment_bytes = SEGMENT_BYTES_DEFAULT;
+static size_t g_retain_bytes = SEGMENT_RETAIN_DEFAULT;
+static long g_retain_s = 0;
+static pthread_t g_retire_thr; // age check of an idle log, only with -A
+static pthread_cond_t g_stop_cond; // signalled by segment_stop, waited on with g_lock
+static int g_retiring = 0; // the age check thread runs
+static int g_stopping = 0;
+
+static void segment_name(char* name, off_t base, const char* ext){
+	snprintf(name, SEGMENT_NAME_LEN + 1, "%020lld.%s", (long long)base, ext);
+}
+
+static void release(struct segment* seg){
+	if(atomic_fetch_sub(&seg->refs, 1) != 1){
+		return;
+	}
+	if(seg->map){
+		munmap(seg->map, seg->cap);
+	}
+	if(seg->fd != -1){
+		close(seg->fd);
+	}
+	if(seg->idx_fd != -1){
+		close(seg->idx_fd);
+	}
+	free(seg->index);
+	free(seg);
+}
+
+static int add_entry(struct segment* seg, uint64_t packet, off_t offset){
+	if(seg->idx_count == seg->idx_cap){
+		size_t cap = seg->idx_cap ? seg->idx_cap * 2 : 16;
+		struct segment_entry* index = realloc(seg->index, cap * sizeof(struct segment_entry));
+		if(!index){
+			return -1;
+		}
+		seg->index = index;
+		seg->idx_cap = cap;
+	}
+	seg->index[seg->idx_count].packet = packet;
+	seg->index[seg->idx_count].offset = offset;
+	seg->idx_count++;
+	return 0;
+}
+
+/*
+ * Appends the index entries from the given one to the index file
+ */
+static int write_entries(struct segment* seg, size_t from){
+	size_t len = (seg->idx_count - from) * sizeof(struct segment_entry);
+	if(len && write(seg->idx_fd, seg->index + from, len) != (ssize_t)len){
+		aesd_log(LOG_WARNING, "write index FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Opens the files of the segment starting at base and maps it. A new
+ * segment replaces whatever was left under its name
+ */
+static struct segment* open_segment(off_t base, size_t cap, int create){
+	char name[SEGMENT_NAME_LEN + 1];
+	struct segment* seg = calloc(1, sizeof(struct segment));
+	if(!seg){
+		aesd_log(LOG_ERR, "calloc FAILED");
+		return NULL;
+	}
+	seg->base = base;
+	seg->idx_fd = -1;
+	atomic_init(&seg->refs, 1);
+	int flags = O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0);
+	segment_name(name, base, "log");
+	seg->fd = openat(g_dirfd, name, flags, 0666);
+	if(seg->fd != -1){
+		segment_name(name, base, "idx");
+		seg->idx_fd = openat(g_dirfd, name, flags | O_CREAT, 0666);
+	}
+	struct stat st;
+	if(seg->idx_fd == -1 || fstat(seg->fd, &st)){
+		aesd_log(LOG_ERR, "open segment %s FAILED error:%s", name, strerror(errno));
+		release(seg);
+		return NULL;
+	}
+	seg->size = st.st_size;
+	seg->mtime = st.st_mtime;
+	seg->cap = seg->size > cap ? seg->size : cap;
+	/* Only the written part is ever read, the rest is backed as the file grows */
+	seg->map = mmap(NULL, seg->cap, PROT_READ, MAP_SHARED, seg->fd, 0);
+	if(seg->map == MAP_FAILED){
+		aesd_log(LOG_ERR, "mmap FAILED error:%s", strerror(errno));
+		seg->map = NULL;
+		release(seg);
+		return NULL;
+	}
+	return seg;
+}
+
+static void unlink_segment(off_t base){
+	char name[SEGMENT_NAME_LEN + 1];
+	segment_name(name, base, "log");
+	unlinkat(g_dirfd, name, 0);
+	segment_name(name, base, "idx");
+	unlinkat(g_dirfd, name, 0);
+}
+
+/*
+ * Rebuilds the index of a segment left by the previous run. The index file
+ * is trusted up to its first inconsistent entry, the packets after the last
+ * entry are counted by their newlines and indexed again. Only the last of
+ * them may lack a newline, the next packet would have had an entry
+ */
+static int recover_segment(struct segment* seg, uint64_t first){
+	struct segment_entry e;
+	off_t pos = 0;
+	while(pread(seg->idx_fd, &e, sizeof(e), pos) == sizeof(e)){
+		struct segment_entry* last = seg->idx_count ? &seg->index[seg->idx_count - 1] : NULL;
+		if(last ? e.packet <= last->packet || e.offset <= last->offset : e.offset != (uint64_t)seg->base){
+			break;
+		}
+		if(e.offset >= seg->base + seg->size || add_entry(seg, e.packet, e.offset)){
+			break;
+		}
+		pos += sizeof(e);
+	}
+	if(ftruncate(seg->idx_fd, pos)){
+		aesd_log(LOG_WARNING, "ftruncate index FAILED error:%s", strerror(errno));
+	}
+	if(!seg->idx_count && (add_entry(seg, first, seg->base) || write_entries(seg, 0))){
+		return -1;
+	}
+	size_t recovered = seg->idx_count;
+	struct segment_entry last = seg->index[recovered - 1];
+	const char* p = seg->map + (last.offset - seg->base);
+	const char* end = seg->map + seg->size;
+	uint64_t packet = last.packet;
+	while(p < end){
+		off_t start = seg->base + (p - seg->map);
+		if(start - (off_t)seg->index[seg->idx_count - 1].offset >= SEGMENT_INDEX_INTERVAL){
+			add_entry(seg, packet, start);
+		}
+		const char* nl = memchr(p, '\n', end - p);
+		p = nl ? nl + 1 : end;
+		packet++;
+	}
+	write_entries(seg, recovered);
+	seg->first = seg->index[0].packet;
+	seg->packets = packet - seg->first;
+	return 0;
+}
+
+static int push_segment(struct segment* seg){
+	if(g_count == g_cap){
+		size_t cap = g_cap ? g_cap * 2 : 16;
+		struct segment** segs = realloc(g_segs, cap * sizeof(struct segment*));
+		if(!segs){
+			aesd_log(LOG_ERR, "realloc FAILED");
+			return -1;
+		}
+		g_segs = segs;
+		g_cap = cap;
+	}
+	g_segs[g_count++] = seg;
+	return 0;
+}
+
+static int compare_base(const void* a, const void* b){
+	off_t x = *(const off_t*)a, y = *(const off_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Lists the segment files of the directory, oldest first
+ */
+static off_t* list_segments(size_t* count){
+	int fd = fcntl(g_dirfd, F_DUPFD_CLOEXEC, 0);
+	DIR* dir = fd == -1 ? NULL : fdopendir(fd);
+	if(!dir){
+		aesd_log(LOG_ERR, "opendir FAILED error:%s", strerror(errno));
+		if(fd != -1){
+			close(fd);
+		}
+		return NULL;
+	}
+	off_t* bases = NULL;
+	size_t cap = 0;
+	struct dirent* ent;
+	*count = 0;
+	while((ent = readdir(dir)) != NULL){
+		long long base;
+		int len = 0;
+		if(!isdigit((unsigned char)ent->d_name[0]) || sscanf(ent->d_name, "%20lld.log%n", &base, &len) != 1 ||
+				len != SEGMENT_NAME_LEN || ent->d_name[len]){
+			continue;
+		}
+		if(*count == cap){
+			cap = cap ? cap * 2 : 16;
+			off_t* grown = realloc(bases, cap * sizeof(off_t));
+			if(!grown){
+				aesd_log(LOG_ERR, "realloc FAILED");
+				free(bases);
+				closedir(dir);
+				return NULL;
+			}
+			bases = grown;
+		}
+		bases[(*count)++] = base;
+	}
+	closedir(dir);
+	qsort(bases, *count, sizeof(off_t), compare_base);
+	/* An empty directory is not an error */
+	return bases ? bases : calloc(1, sizeof(off_t));
+}
+
+/*
+ * Returns the active segment, NULL when there is none. Only the writer adds
+ * segments, the age check may remove old ones meanwhile
+ */
+static struct segment* active_segment(){
+	pthread_mutex_lock(&g_lock);
+	struct segment* seg = g_count ? g_segs[g_count - 1] : NULL;
+	pthread_mutex_unlock(&g_lock);
+	return seg;
+}
+
+/*
+ * Deletes the oldest sealed segments over the byte or the age limit.
+ * Called by the writer and the age check thread, the active segment is
+ * never deleted
+ */
+static void retire(){
+	time_t now = time(NULL);
+	size_t n = 0;
+	pthread_mutex_lock(&g_lock);
+	if(g_count){
+		struct segment* active = g_segs[g_count - 1];
+		off_t end = active->base + active->size;
+		for(; n + 1 < g_count; n++){
+			struct segment* seg = g_segs[n];
+			if(end - seg->base <= (off_t)g_retain_bytes && (!g_retain_s || now - seg->mtime <= g_retain_s)){
+				break;
+			}
+			unlink_segment(seg->base);
+			release(seg);
+		}
+		memmove(g_segs, g_segs + n, (g_count - n) * sizeof(struct segment*));
+		g_count -= n;
+	}
+	pthread_mutex_unlock(&g_lock);
+	if(n){
+		aesd_log(LOG_INFO, "Retired %zu segments", n);
+	}
+}
+
+static void* retire_thread(void* arg){
+	pthread_mutex_lock(&g_lock);
+	while(!g_stopping){
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += SEGMENT_RETIRE_SEC;
+		pthread_cond_timedwait(&g_stop_cond, &g_lock, &deadline);
+		if(g_stopping){
+			break;
+		}
+		pthread_mutex_unlock(&g_lock);
+		retire();
+		pthread_mutex_lock(&g_lock);
+	}
+	pthread_mutex_unlock(&g_lock);
+	return arg;
+}
+
+int segment_start(const char* dir, size_t segment_bytes, size_t retain_bytes, long retain_s){
+	g_segment_bytes = segment_bytes;
+	g_retain_bytes = retain_bytes;
+	g_retain_s = retain_s;
+	if(mkdir(dir, 0755) && errno != EEXIST){
+		aesd_log(LOG_ERR, "mkdir %s FAILED error:%s", dir, strerror(errno));
+		return -1;
+	}
+	g_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(g_dirfd == -1){
+		aesd_log(LOG_ERR, "open %s FAILED error:%s", dir, strerror(errno));
+		return -1;
+	}
+	size_t count;
+	off_t* bases = list_segments(&count);
+	if(!bases){
+		return -1;
+	}
+	uint64_t first = 0;
+	for(size_t i = 0; i < count; i++){
+		struct segment* seg = open_segment(bases[i], g_segment_bytes, 0);
+		if(!seg){
+			free(bases);
+			return -1;
+		}
+		if(!seg->size){
+			/* Left by a run stopped right after a roll */
+			unlink_segment(seg->base);
+			release(seg);
+			continue;
+		}
+		if(recover_segment(seg, first) || push_segment(seg)){
+			release(seg);
+			free(bases);
+			return -1;
+		}
+		first = seg->first + seg->packets;
+	}
+	free(bases);
+	retire();
+	if(g_retain_s){
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&g_stop_cond, &attr);
+		pthread_condattr_destroy(&attr);
+		g_stopping = 0;
+		if(pthread_create(&g_retire_thr, NULL, retire_thread, NULL)){
+			aesd_log(LOG_ERR, "pthread_create FAILED");
+			pthread_cond_destroy(&g_stop_cond);
+			return -1;
+		}
+		g_retiring = 1;
+	}
+	aesd_log(LOG_INFO, "Segments of %zu bytes in %s, %zu retained, log of %lld bytes",
+			g_segment_bytes, dir, g_count, (long long)segment_end());
+	return 0;
+}
+
+void segment_stop(){
+	if(g_retiring){
+		pthread_mutex_lock(&g_lock);
+		g_stopping = 1;
+		pthread_cond_signal(&g_stop_cond);
+		pthread_mutex_unlock(&g_lock);
+		pthread_join(g_retire_thr, NULL);
+		pthread_cond_destroy(&g_stop_cond);
+		g_retiring = 0;
+	}
+	pthread_mutex_lock(&g_lock);
+	for(size_t i = 0; i < g_count; i++){
+		/* The next run, possibly a successor taking over, recovers from the files */
+		if(fdatasync(g_segs[i]->fd) || fdatasync(g_segs[i]->idx_fd)){
+			aesd_log(LOG_WARNING, "fdatasync FAILED error:%s", strerror(errno));
+		}
+		release(g_segs[i]);
+	}
+	free(g_segs);
+	g_segs = NULL;
+	g_count = g_cap = 0;
+	pthread_mutex_unlock(&g_lock);
+	if(g_dirfd != -1){
+		close(g_dirfd);
+		g_dirfd = -1;
+	}
+}
+
+int segment_open(){
+	int fd = fcntl(g_dirfd, F_DUPFD_CLOEXEC, 0);
+	if(fd == -1){
+		aesd_log(LOG_ERR, "fcntl FAILED error:%s", strerror(errno));
+	}
+	return fd;
+}
+
+off_t segment_end(){
+	pthread_mutex_lock(&g_lock);
+	off_t end = g_count ? g_segs[g_count - 1]->base + (off_t)g_segs[g_count - 1]->size : 0;
+	pthread_mutex_unlock(&g_lock);
+	return end;
+}
+
+/*
+ * Seals the active segment and starts a new one after it
+ */
+static struct segment* roll(size_t len){
+	off_t base = 0;
+	uint64_t first = 0;
+	struct segment* last = active_segment();
+	if(last){
+		base = last->base + last->size;
+		first = last->first + last->packets;
+	}
+	struct segment* seg = open_segment(base, len > g_segment_bytes ? len : g_segment_bytes, 1);
+	if(!seg){
+		return NULL;
+	}
+	seg->first = first;
+	if(add_entry(seg, first, base) || write_entries(seg, 0)){
+		aesd_log(LOG_ERR, "Index of segment %lld FAILED", (long long)base);
+		release(seg);
+		return NULL;
+	}
+	pthread_mutex_lock(&g_lock);
+	int res = push_segment(seg);
+	pthread_mutex_unlock(&g_lock);
+	if(res){
+		release(seg);
+		return NULL;
+	}
+	aesd_log(LOG_DEBUG, "Segment %lld started", (long long)base);
+	return seg;
+}
+
+/*
+ * Writes the whole iovec array, resuming after partial writes
+ */
+static int write_all(int fd, const struct iovec* packets, int count){
+	struct iovec left[count];
+	struct iovec* iov = left;
+	memcpy(left, packets, count * sizeof(struct iovec));
+	while(count){
+		ssize_t res = writev(fd, iov, count);
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			aesd_log(LOG_ERR, "writev FAILED error:%s", strerror(errno));
+			return -1;
+		}
+		while(count && (size_t)res >= iov->iov_len){
+			res -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count){
+			iov->iov_base = (char*)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+	return 0;
+}
+
+int segment_append(const struct iovec* iov, int count, size_t* written){
+	int i = 0;
+	*written = 0;
+	while(i < count){
+		struct segment* seg = active_segment();
+		size_t size = iov[i].iov_len;
+		if(!seg || seg->size + size > seg->cap || (seg->size && seg->size + size > g_segment_bytes)){
+			seg = roll(size);
+			if(!seg){
+				return -1;
+			}
+		}
+		size += seg->size;
+		int n = 1;
+		while(i + n < count && size + iov[i + n].iov_len <= g_segment_bytes){
+			size += iov[i + n].iov_len;
+			n++;
+		}
+		if(write_all(seg->fd, iov + i, n)){
+			/* The segment keeps only whole packets */
+			if(ftruncate(seg->fd, seg->size)){
+				aesd_log(LOG_ERR, "ftruncate FAILED error:%s", strerror(errno));
+			}
+			return -1;
+		}
+		*written += size - seg->size;
+		size_t entries = seg->idx_count;
+		pthread_mutex_lock(&g_lock);
+		for(int k = 0; k < n; k++){
+			off_t start = seg->base + seg->size;
+			/* A missing entry only lengthens the scan of a seek, but newlines
+			 * would not count a packet after one without a newline */
+			if(start - (off_t)seg->index[seg->idx_count - 1].offset >= SEGMENT_INDEX_INTERVAL ||
+					(seg->size && seg->map[seg->size - 1] != '\n')){
+				add_entry(seg, seg->first + seg->packets, start);
+			}
+			seg->size += iov[i + k].iov_len;
+			seg->packets++;
+		}
+		seg->mtime = time(NULL);
+		pthread_mutex_unlock(&g_lock);
+		write_entries(seg, entries);
+		i += n;
+	}
+	retire();
+	return 0;
+}
+
+/*
+ * Finds the segment holding off and takes a reference to it. An offset
+ * before the oldest segment is moved to the oldest retained byte. Returns
+ * NULL when there is nothing before limit, otherwise count is cut to the
+ * bytes the segment holds and more tells whether later segments follow
+ */
+static struct segment* acquire(off_t* off, off_t limit, size_t* count, int* more){
+	struct segment* seg = NULL;
+	pthread_mutex_lock(&g_lock);
+	size_t lo = 0, hi = g_count;
+	while(lo < hi){
+		size_t mid = (lo + hi) / 2;
+		if(g_segs[mid]->base + (off_t)g_segs[mid]->size <= *off){
+			lo = mid + 1;
+		}
+		else{
+			hi = mid;
+		}
+	}
+	if(lo < g_count){
+		off_t end = g_segs[lo]->base + g_segs[lo]->size;
+		if(*off < g_segs[lo]->base){
+			*off = g_segs[lo]->base;
+		}
+		if(limit >= 0 && limit < end){
+			end = limit;
+		}
+		if(*off < end){
+			seg = g_segs[lo];
+			atomic_fetch_add(&seg->refs, 1);
+			*more = 0;
+			if((off_t)*count >= end - *off){
+				*count = end - *off;
+				*more = lo + 1 < g_count && end != limit;
+			}
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+	return seg;
+}
+
+size_t segment_read(off_t* off, off_t limit, char* buf, size_t count){
+	size_t copied = 0;
+	int more = 1;
+	/* Filled across segment boundaries, a short chunk would go out as a short send */
+	while(more && copied < count){
+		size_t n = count - copied;
+		struct segment* seg = acquire(off, limit, &n, &more);
+		if(!seg){
+			break;
+		}
+		memcpy(buf + copied, seg->map + (*off - seg->base), n);
+		release(seg);
+		*off += n;
+		copied += n;
+	}
+	return copied;
+}
+
+ssize_t segment_send(int sockfd, off_t* off, off_t limit){
+	size_t count = SEGMENT_SEND_MAX;
+	int more;
+	/* Cut at the segment end, the caller sends again from the next one */
+	struct segment* seg = acquire(off, limit, &count, &more);
+	if(!seg){
+		return 0;
+	}
+	ssize_t res = send(sockfd, seg->map + (*off - seg->base), count, MSG_NOSIGNAL);
+	release(seg);
+	if(res > 0){
+		*off += res;
+	}
+	return res;
+}
+
+off_t segment_find_record(uint32_t record, uint32_t offset){
+	off_t res = -1;
+	pthread_mutex_lock(&g_lock);
+	if(g_count){
+		uint64_t packet = g_segs[0]->first + record;
+		size_t lo = 0, hi = g_count;
+		while(hi - lo > 1){
+			size_t mid = (lo + hi) / 2;
+			if(g_segs[mid]->first <= packet){
+				lo = mid;
+			}
+			else{
+				hi = mid;
+			}
+		}
+		struct segment* seg = g_segs[lo];
+		if(packet < seg->first + seg->packets){
+			/* The last entry before the packet, the packets after it are scanned */
+			lo = 0;
+			hi = seg->idx_count;
+			while(hi - lo > 1){
+				size_t mid = (lo + hi) / 2;
+				if(seg->index[mid].packet <= packet){
+					lo = mid;
+				}
+				else{
+					hi = mid;
+				}
+			}
+			const char* p = seg->map + (seg->index[lo].offset - seg->base);
+			/* A packet without a newline ends where the next entry starts */
+			const char* end = seg->map + (lo + 1 < seg->idx_count ? seg->index[lo + 1].offset - seg->base : seg->size);
+			for(uint64_t n = packet - seg->index[lo].packet; n && p < end; n--){
+				const char* nl = memchr(p, '\n', end - p);
+				p = nl ? nl + 1 : end;
+			}
+			const char* nl = p < end ? memchr(p, '\n', end - p) : NULL;
+			if(offset < (size_t)((nl ? nl + 1 : end) - p)){
+				res = seg->base + (p - seg->map) + offset;
+			}
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+	return res;
+}
@@ -0,0 +1,96 @@
+/**
+ * @file aesd-segment.h
+ * @brief Segmented on-disk backend of the aesdsocket conversation log
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_SEGMENT_H
+#define AESD_SEGMENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SEGMENT_BYTES_DEFAULT (1024 * 1024) // size a segment is sealed at when -g is not given
+#define SEGMENT_RETAIN_DEFAULT (16 * 1024 * 1024) // bytes retained when -T is not given
+#define SEGMENT_INDEX_INTERVAL 4096 // bytes between two entries of the sparse packet index
+#define SEGMENT_RETIRE_SEC 1 // period of the age check of an idle log (-A)
+
+/**
+ * @brief This function opens the segment directory, creating it if needed, and
+ * recovers the segments left by the previous run. The log continues after them
+ *
+ * @param dir segment directory
+ * @param segment_bytes size a segment is sealed at, a larger packet gets a segment of its own
+ * @param retain_bytes bytes retained, the oldest sealed segments over it are deleted
+ * @param retain_s seconds a sealed segment is retained after its last append, 0 - no age limit
+ * @return success status 0 - success
+ */
+int segment_start(const char* dir, size_t segment_bytes, size_t retain_bytes, long retain_s);
+/**
+ * @brief This function flushes and releases the segments. The files are kept for the next run
+ *
+ * @return void
+ */
+void segment_stop();
+/**
+ * @brief This function returns a descriptor of the segment directory, so the
+ * segments are handled like the other backends by open_backend
+ *
+ * @return file descriptor or -1 on error
+ */
+int segment_open();
+/**
+ * @brief This function returns the log offset after the newest byte
+ *
+ * @return log length
+ */
+off_t segment_end();
+/**
+ * @brief This function appends packets to the active segment, sealing it and
+ * starting a new one when a packet does not fit. Called by the group commit
+ * writer only
+ *
+ * @param iov packets, one per entry
+ * @param count count of iov entries
+ * @param written set to the bytes appended, on a failure the packets already
+ * in sealed or active segments stay and a partial packet is cut off
+ * @return success status 0 - success
+ */
+int segment_append(const struct iovec* iov, int count, size_t* written);
+/**
+ * @brief This function copies retained bytes out of the segments. An offset
+ * which was deleted by the retention is moved to the oldest retained packet
+ *
+ * @param off log offset to read from, advanced past the copied bytes
+ * @param limit log offset to stop at, -1 - the end of the log
+ * @param buf destination
+ * @param count size of buf
+ * @return count of copied bytes, 0 - nothing more to read
+ */
+size_t segment_read(off_t* off, off_t limit, char* buf, size_t count);
+/**
+ * @brief This function sends retained bytes straight from the segment mapping,
+ * at most up to the end of the segment holding off
+ *
+ * @param sockfd destination socket descriptor
+ * @param off log offset to send from, advanced past the sent bytes
+ * @param limit log offset to stop at, -1 - the end of the log
+ * @return count of sent bytes, 0 - nothing more to send, -1 - send(2) error in errno
+ */
+ssize_t segment_send(int sockfd, off_t* off, off_t limit);
+/**
+ * @brief This function translates a record and an offset within it to a log offset,
+ * records are counted from the oldest retained packet like AESDCHAR_IOCSEEKTO does.
+ * The segment is found by binary search and the packet through its sparse index
+ *
+ * @param record packet index
+ * @param offset byte within the packet
+ * @return log offset or -1 when there is no such byte
+ */
+off_t segment_find_record(uint32_t record, uint32_t offset);
+
+#endif /* AESD_SEGMENT_H */
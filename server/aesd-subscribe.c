@@ -0,0 +1,455 @@
+/**
+ * @file aesd-subscribe.c
+ * @brief Push stream of newly committed packets to subscribed clients.
+ * The log writer copies every committed batch once into a shared circular
+ * buffer. A single thread sends it to all subscribers straight from that
+ * buffer, a subscriber is only a cursor into it, so its queue is the part of
+ * the buffer it has not received yet. A subscriber whose cursor falls out of
+ * the buffer is closed or skips to the newest packet, by the policy.
+ * A send runs without the lock, the region being sent is pinned and a
+ * publish which would overwrite it waits for that one non-blocking send.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "aesdsocket.h"
+#include "aesd-subscribe.h"
+#include "aesd-readback.h"
+#include "aesd-commit.h"
+#include "aesd-log.h"
+#include "aesd-metrics.h"
+
+#define SUBSCRIBE_MAX_EVENTS 64
+
+/*
+ * Subscribed connection, owned by the subscription thread
+ */
+struct subscriber {
+	int sd; /* Socket descriptor, non-blocking */
+	int fd; /* Backend descriptor while the history is sent, -1 after */
+	off_t start; /* Offset the history starts at, -1 - no history */
+	struct readback rb; /* History read-back, prepared when the thread registers the subscriber */
+	off_t cursor; /* Stream offset of the next byte to send */
+	int blocked; /* The socket is full, waiting for EPOLLOUT */
+	struct subscriber* prev;
+	struct subscriber* next;
+};
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER; // guards the stream and g_added
+static pthread_cond_t g_sent = PTHREAD_COND_INITIALIZER; // signalled when the pinned region is released
+static char* g_buf = NULL; // shared stream buffer
+static size_t g_cap = 0;
+static off_t g_base = 0; // oldest stream offset retained in g_buf
+static off_t g_end = 0; // stream offset after the last published byte, a log offset
+static off_t g_pin = -1; // stream offset of the region being sent without the lock, -1 - none
+static struct subscriber* g_added = NULL; // handed over, not registered by the thread yet
+static atomic_int g_count = 0; // subscribers, the stream is not copied while there are none
+static int g_policy = SUBSCRIBE_DISCONNECT;
+static int g_epfd = -1;
+static int g_wakefd = -1;
+static atomic_int g_running = 0;
+static pthread_t g_thread;
+static struct subscriber* g_subs = NULL; // owned by the thread
+static int wake_tag;
+
+static void wake(){
+	uint64_t one = 1;
+	if(write(g_wakefd, &one, sizeof(one)) == -1){
+		/* Counter is already non-zero, the thread is being woken */
+	}
+}
+
+static void sub_free(struct subscriber* sub){
+	if(sub->fd != -1){
+		readback_deinit(&sub->rb);
+		close(sub->fd);
+	}
+	close(sub->sd);
+	free(sub);
+	atomic_fetch_sub(&g_count, 1);
+}
+
+static void sub_close(struct subscriber* sub){
+	aesd_log(LOG_INFO, "Closed subscriber new_fd: %d", sub->sd);
+	if(sub->prev){
+		sub->prev->next = sub->next;
+	}
+	else{
+		g_subs = sub->next;
+	}
+	if(sub->next){
+		sub->next->prev = sub->prev;
+	}
+	sub_free(sub);
+}
+
+/*
+ * Applies the policy to a subscriber which fell out of the buffer. Called with the lock held.
+ * Returns 0 when the subscriber goes on, -1 when it must be closed
+ */
+static int sub_lagged(struct subscriber* sub){
+	off_t lost = g_end - sub->cursor;
+	metrics_add(METRIC_SUB_DROPPED, lost);
+	if(g_policy == SUBSCRIBE_DISCONNECT){
+		aesd_log(LOG_WARNING, "Subscriber new_fd: %d lags %lld bytes behind, disconnecting", sub->sd, (long long)lost);
+		return -1;
+	}
+	/* The end of a publish is always a packet boundary */
+	aesd_log(LOG_WARNING, "Subscriber new_fd: %d lags %lld bytes behind, dropped", sub->sd, (long long)lost);
+	sub->cursor = g_end;
+	return 0;
+}
+
+/*
+ * Sends the history and then the stream until the socket is full.
+ * Returns 0 when the subscriber goes on, -1 when it must be closed
+ */
+static int sub_push(struct subscriber* sub){
+	if(sub->fd != -1){
+		int res = readback_send(&sub->rb, sub->sd);
+		if(res == 1){
+			sub->blocked = 1;
+			return 0;
+		}
+		readback_deinit(&sub->rb);
+		close(sub->fd);
+		sub->fd = -1;
+		if(res){
+			/* Failed or cut short by the stop */
+			return -1;
+		}
+	}
+	while(1){
+		/* Sent straight from the shared buffer, committers overwriting the
+		 * pinned region wait for this one send at most */
+		pthread_mutex_lock(&g_lock);
+		if(sub->cursor < g_base && sub_lagged(sub)){
+			pthread_mutex_unlock(&g_lock);
+			return -1;
+		}
+		off_t cursor = sub->cursor;
+		size_t len = cursor < g_end ? g_end - cursor : 0;
+		size_t pos = cursor % g_cap;
+		if(len > g_cap - pos){
+			len = g_cap - pos;
+		}
+		if(!len){
+			pthread_mutex_unlock(&g_lock);
+			return 0;
+		}
+		g_pin = cursor;
+		pthread_mutex_unlock(&g_lock);
+		ssize_t res = send(sub->sd, g_buf + pos, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		pthread_mutex_lock(&g_lock);
+		g_pin = -1;
+		pthread_cond_broadcast(&g_sent);
+		/* A publish after a gap restarts the stream, the bytes sent belong to the old one */
+		if(res > 0 && cursor + res <= g_end){
+			sub->cursor = cursor + res;
+		}
+		pthread_mutex_unlock(&g_lock);
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK){
+				sub->blocked = 1;
+				return 0;
+			}
+			return -1;
+		}
+		metrics_add(METRIC_BYTES_OUT, res);
+	}
+}
+
+/*
+ * Subscribers only receive, anything they send is discarded.
+ * Returns 0 while the connection is open, -1 when it is closed
+ */
+static int sub_drain(struct subscriber* sub){
+	char buf[BUFSIZE];
+	while(1){
+		ssize_t res = recv(sub->sd, buf, sizeof(buf), MSG_DONTWAIT);
+		if(res > 0){
+			continue;
+		}
+		if(res == -1 && errno == EINTR){
+			continue;
+		}
+		return res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+}
+
+/*
+ * Starts the stream of the subscriber at the end of the published log and
+ * bounds its history by the same offset, so they neither overlap nor leave a gap
+ */
+static void sub_begin(struct subscriber* sub){
+	/* The char device has its own offsets, its end is taken while nothing is being written */
+	int device = g_config.backend == BACKEND_STORAGE && USE_AESD_CHAR_DEVICE && sub->start >= 0;
+	int logfd;
+	if(device){
+		commit_acquire(&logfd);
+	}
+	pthread_mutex_lock(&g_lock);
+	sub->cursor = g_end;
+	off_t end = g_end;
+	pthread_mutex_unlock(&g_lock);
+	if(sub->start >= 0){
+		sub->fd = open_backend(0);
+	}
+	if(sub->fd != -1 && device){
+		end = lseek(sub->fd, 0, SEEK_END);
+		if(end == -1){
+			aesd_log(LOG_WARNING, "lseek FAILED error:%s", strerror(errno));
+		}
+	}
+	if(device){
+		commit_release(0);
+	}
+	if(sub->fd != -1){
+		readback_init(&sub->rb, sub->fd, sub->start, end, NULL);
+	}
+}
+
+/*
+ * Registers the subscribers handed over since the last wakeup
+ */
+static void sub_register(){
+	pthread_mutex_lock(&g_lock);
+	struct subscriber* sub = g_added;
+	g_added = NULL;
+	pthread_mutex_unlock(&g_lock);
+	while(sub){
+		struct subscriber* next = sub->next;
+		sub_begin(sub);
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = sub;
+		if(epoll_ctl(g_epfd, EPOLL_CTL_ADD, sub->sd, &ev)){
+			aesd_log(LOG_ERR, "epoll_ctl FAILED error:%s", strerror(errno));
+			sub_free(sub);
+		}
+		else{
+			sub->prev = NULL;
+			sub->next = g_subs;
+			if(g_subs){
+				g_subs->prev = sub;
+			}
+			g_subs = sub;
+		}
+		sub = next;
+	}
+}
+
+static void* subscribe_loop(void* arg){
+	struct epoll_event events[SUBSCRIBE_MAX_EVENTS];
+	while(atomic_load(&g_running)){
+		int n = epoll_wait(g_epfd, events, SUBSCRIBE_MAX_EVENTS, -1);
+		if(n == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			aesd_log(LOG_ERR, "epoll_wait FAILED error:%s", strerror(errno));
+			break;
+		}
+		for(int i = 0; i < n; i++){
+			if(events[i].data.ptr == &wake_tag){
+				uint64_t val;
+				if(read(g_wakefd, &val, sizeof(val)) == -1){
+					/* Already drained */
+				}
+				continue;
+			}
+			struct subscriber* sub = events[i].data.ptr;
+			if(events[i].events & EPOLLOUT){
+				sub->blocked = 0;
+			}
+			if((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && sub_drain(sub)){
+				/* Closed after the loop, later events may refer to it */
+				sub->blocked = -1;
+			}
+		}
+		sub_register();
+		struct subscriber* sub = g_subs;
+		while(sub){
+			struct subscriber* next = sub->next;
+			int res = sub->blocked < 0 ? -1 : 0;
+			if(!res && !sub->blocked){
+				res = sub_push(sub);
+			}
+			else if(!res && sub->fd == -1){
+				/* A blocked subscriber is checked for the lag at once */
+				pthread_mutex_lock(&g_lock);
+				res = sub->cursor < g_base ? sub_lagged(sub) : 0;
+				pthread_mutex_unlock(&g_lock);
+			}
+			if(res){
+				sub_close(sub);
+			}
+			sub = next;
+		}
+	}
+	return arg;
+}
+
+int subscribe_start(size_t queue_bytes, int policy, off_t end){
+	g_base = g_end = end;
+	g_buf = malloc(queue_bytes);
+	if(!g_buf){
+		aesd_log(LOG_ERR, "malloc FAILED");
+		return -1;
+	}
+	g_cap = queue_bytes;
+	g_policy = policy;
+	g_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	g_epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wake_tag;
+	if(g_wakefd == -1 || g_epfd == -1 || epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_wakefd, &ev)){
+		aesd_log(LOG_ERR, "subscription setup FAILED error:%s", strerror(errno));
+		subscribe_stop();
+		return -1;
+	}
+	atomic_store(&g_running, 1);
+	if(pthread_create(&g_thread, NULL, subscribe_loop, NULL)){
+		aesd_log(LOG_ERR, "pthread_create FAILED");
+		atomic_store(&g_running, 0);
+		subscribe_stop();
+		return -1;
+	}
+	aesd_log(LOG_INFO, "Subscriptions queue up to %zu bytes, lagging subscribers are %s",
+			queue_bytes, policy == SUBSCRIBE_DROP ? "skipped ahead" : "disconnected");
+	return 0;
+}
+
+void subscribe_stop(){
+	if(atomic_exchange(&g_running, 0)){
+		wake();
+		pthread_join(g_thread, NULL);
+	}
+	while(g_subs){
+		sub_close(g_subs);
+	}
+	while(g_added){
+		struct subscriber* next = g_added->next;
+		sub_free(g_added);
+		g_added = next;
+	}
+	if(g_epfd != -1){
+		close(g_epfd);
+		g_epfd = -1;
+	}
+	if(g_wakefd != -1){
+		close(g_wakefd);
+		g_wakefd = -1;
+	}
+	free(g_buf);
+	g_buf = NULL;
+	g_cap = 0;
+}
+
+int subscribe_add(int sd, off_t start){
+	if(!atomic_load(&g_running)){
+		return -1;
+	}
+	struct subscriber* sub = calloc(1, sizeof(struct subscriber));
+	if(!sub){
+		aesd_log(LOG_ERR, "calloc FAILED");
+		return -1;
+	}
+	sub->sd = fcntl(sd, F_DUPFD_CLOEXEC, 0);
+	if(sub->sd == -1){
+		aesd_log(LOG_ERR, "fcntl FAILED error:%s", strerror(errno));
+		free(sub);
+		return -1;
+	}
+	/* Shared with the descriptor of the engine, which no longer uses it */
+	int flags = fcntl(sub->sd, F_GETFL);
+	if(flags == -1 || fcntl(sub->sd, F_SETFL, flags | O_NONBLOCK)){
+		aesd_log(LOG_ERR, "fcntl FAILED error:%s", strerror(errno));
+		close(sub->sd);
+		free(sub);
+		return -1;
+	}
+	sub->fd = -1;
+	sub->start = start;
+	/* Counted at once, the stream is kept from now on */
+	atomic_fetch_add(&g_count, 1);
+	pthread_mutex_lock(&g_lock);
+	sub->next = g_added;
+	g_added = sub;
+	pthread_mutex_unlock(&g_lock);
+	wake();
+	aesd_log(LOG_INFO, "Subscribed new_fd: %d from %lld", sub->sd, (long long)start);
+	return 0;
+}
+
+void subscribe_publish(off_t off, const struct iovec* iov, int count){
+	size_t total = 0;
+	for(int i = 0; i < count; i++){
+		total += iov[i].iov_len;
+	}
+	if(!total){
+		return;
+	}
+	pthread_mutex_lock(&g_lock);
+	if(!atomic_load_explicit(&g_count, memory_order_relaxed) || !g_cap){
+		/* Nobody listens, only the position is kept */
+		g_base = g_end = off + total;
+		pthread_mutex_unlock(&g_lock);
+		return;
+	}
+	/* The bytes a subscriber is sending are overwritten only after the send */
+	while(g_pin >= 0 && (off != g_end || off + (off_t)total > g_pin + (off_t)g_cap)){
+		pthread_cond_wait(&g_sent, &g_lock);
+	}
+	if(off != g_end){
+		g_base = g_end = off;
+	}
+	for(int i = 0; i < count; i++){
+		const char* src = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+		/* Only the newest g_cap bytes of an oversized batch are kept */
+		if(len > g_cap){
+			src += len - g_cap;
+			g_end += len - g_cap;
+			len = g_cap;
+		}
+		while(len){
+			size_t pos = g_end % g_cap;
+			size_t part = len < g_cap - pos ? len : g_cap - pos;
+			memcpy(g_buf + pos, src, part);
+			src += part;
+			len -= part;
+			g_end += part;
+		}
+	}
+	if(g_end - g_base > (off_t)g_cap){
+		g_base = g_end - g_cap;
+	}
+	pthread_mutex_unlock(&g_lock);
+	wake();
+}
+
+int subscribe_count(){
+	return atomic_load(&g_count);
+}
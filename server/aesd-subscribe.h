@@ -0,0 +1,66 @@
+/**
+ * @file aesd-subscribe.h
+ * @brief Push stream of newly committed packets to subscribed clients
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_SUBSCRIBE_H
+#define AESD_SUBSCRIBE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SUBSCRIBE_QUEUE_DEFAULT (1024 * 1024) // bytes a subscriber may lag behind when -S is not given
+
+enum subscribe_policy {
+	SUBSCRIBE_DISCONNECT = 0, /* A subscriber lagging more than the queue is closed */
+	SUBSCRIBE_DROP /* A lagging subscriber skips to the newest packet (-D) */
+};
+
+/**
+ * @brief This function allocates the shared stream buffer and starts the thread
+ * pushing it to the subscribers
+ *
+ * @param queue_bytes size of the shared buffer, the most a subscriber may lag behind
+ * @param policy one of subscribe_policy
+ * @param end log offset the stream starts at, the length of a log kept from a previous run
+ * @return success status 0 - success
+ */
+int subscribe_start(size_t queue_bytes, int policy, off_t end);
+/**
+ * @brief This function closes every subscriber and stops the thread
+ *
+ * @return void
+ */
+void subscribe_stop();
+/**
+ * @brief This function hands a connection over to the subscription thread.
+ * The socket is duplicated, the caller closes its own descriptor as usual
+ * and must not read from or write to the connection any more
+ *
+ * @param sd socket descriptor of the connection
+ * @param start log offset of the history to send before the stream, -1 - no history
+ * @return success status 0 - success
+ */
+int subscribe_add(int sd, off_t start);
+/**
+ * @brief This function appends committed packets to the stream. Called by the
+ * log writer in log order, with whole packets only
+ *
+ * @param off log offset of the first byte
+ * @param iov packets
+ * @param count count of iov entries
+ * @return void
+ */
+void subscribe_publish(off_t off, const struct iovec* iov, int count);
+/**
+ * @brief This function returns the count of connected subscribers
+ *
+ * @return subscribers
+ */
+int subscribe_count();
+
+#endif /* AESD_SUBSCRIBE_H */
@@ -0,0 +1,1102 @@
+/**
+ * @file aesd-uring.c
+ * @brief io_uring engine of the aesdsocket server.
+ * The listener is served by a multishot accept. An idle connection has one
+ * receive into a ring of provided buffers armed, a busy one none, so a
+ * client pipelining without reading back waits in its socket buffer like
+ * with the other engines. Complete packets of all connections are staged
+ * and appended to the log by one writev per batch, the read-back of the
+ * first connection of the batch is linked behind that write. The ring is
+ * driven with the raw syscalls, liburing is not required.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "aesdsocket.h"
+#include "aesd-uring.h"
+#include "aesd-framer.h"
+#include "aesd-arena.h"
+#include "aesd-readback.h"
+#include "aesd-commit.h"
+#include "aesd-ring.h"
+#include "aesd-segment.h"
+#include "aesd-subscribe.h"
+#include "aesd-log.h"
+#include "aesd-metrics.h"
+
+#define URING_ENTRIES 1024 // submission queue size, the completion queue is four times larger
+#define URING_BUF_COUNT 1024 // provided receive buffers, a power of two
+#define URING_BUF_SIZE 4096 // size of one provided receive buffer, larger with a larger -i
+#define URING_BUF_MIN 64 // fewest provided receive buffers when -i makes them larger
+#define URING_BGID 0 // provided buffer group of the receives
+
+/*
+ * user_data is a connection pointer with the operation in the low bits,
+ * connections are allocated aligned to OP_MASK + 1
+ */
+enum uring_op {
+	OP_ACCEPT = 0, /* Multishot accept on the TCP listener, no connection */
+	OP_WAKE, /* Read of the wakeup eventfd, no connection */
+	OP_WRITE, /* Batch append to the log, no connection */
+	OP_RECV, /* Receive into a provided buffer */
+	OP_READ, /* Read-back chunk from the backend */
+	OP_SEND, /* Read-back chunk to the socket */
+	OP_CANCEL, /* Cancellation of the accept, no connection */
+	OP_TIMER, /* Read of the timestamp timerfd, no connection */
+	OP_SWEEP, /* Timeout between the -I and -O sweeps, no connection */
+	OP_ACCEPT_UNIX /* Multishot accept on g_unixfd, no connection */
+};
+#define OP_MASK 15
+
+enum conn_state {
+	CONN_RECV = 0, /* Waiting for a complete packet */
+	CONN_COMMIT, /* Packet is staged or being appended to the log */
+	CONN_SEND /* Streaming the log back to the client */
+};
+/*
+ * Per-connection state machine
+ */
+struct uring_conn {
+	int sd; /* Socket descriptor */
+	int fd; /* Backend descriptor */
+	int state; /* One of conn_state */
+	int inflight; /* Submitted operations and batch references, the connection is freed at 0 */
+	int recv_armed; /* A receive is in flight, armed by conn_advance while the connection is idle */
+	int closing; /* Connection is released when nothing is in flight */
+	struct framer fr; /* Received bytes which are not committed yet */
+	struct session session; /* Protocol state of the connection */
+	off_t off; /* Next log offset to read back */
+	off_t end; /* Log offset to stop at, -1 - to the end of the backend */
+	char* buf; /* Read-back chunk, the scratch buffer of the arena or the frame of rb */
+	size_t buf_len; /* Bytes in buf */
+	size_t buf_off; /* Bytes of buf already sent */
+	int linked_send; /* A send is linked behind the read in flight */
+	uint64_t readback_start; /* metrics_now() of the read-back start */
+	time_t active; /* idle_clock() of the last progress, for the -I and -O timeouts */
+	int read_eof; /* The backend has nothing more to read */
+	int corked; /* TCP_CORK is set until the read-back is done (-K) */
+	struct readback rb; /* Compressed read-back, its frames are made synchronously */
+	struct uring_conn* batch_next; /* Next connection of the same batch */
+	struct uring_conn* prev;
+	struct uring_conn* next;
+	struct arena* arena; /* Holds this structure and the framing buffer */
+	char address[INET6_ADDRSTRLEN];
+};
+/*
+ * Packets appended to the log by one writev
+ */
+struct uring_batch {
+	char* buf;
+	size_t cap;
+	size_t len;
+	struct iovec* iov; /* One entry per packet, the char device stores every one as a record */
+	int count;
+	int iov_cap;
+	struct uring_conn* first; /* Connections in packet order */
+	struct uring_conn** last;
+};
+/*
+ * Engine context: the rings shared with the kernel and the connections
+ */
+struct uring {
+	int fd; /* io_uring instance */
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_local; /* Tail including the SQEs not published yet */
+	struct io_uring_sqe* sqes;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+	void* sq_ptr;
+	size_t sq_len;
+	void* cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+	struct io_uring_buf_ring* br; /* Provided receive buffers */
+	size_t br_len;
+	char* bufs;
+	size_t buf_size; /* Size of one provided receive buffer */
+	unsigned buf_count; /* Provided receive buffers, a power of two */
+	unsigned short br_tail;
+	int sockfd; /* Listening socket */
+	int accept_armed; /* Active multishot accepts, they hold the listeners open */
+	int draining; /* The accepts are cancelled and not rearmed */
+	uint64_t wake_val; /* Target of the wakeup eventfd read */
+	uint64_t timer_val; /* Target of the timerfd read */
+	struct __kernel_timespec sweep_ts; /* Interval of the timeout sweeps */
+	struct uring_conn* conns; /* Live connections */
+	struct uring_batch staged; /* Packets for the next append */
+	struct uring_batch writing; /* Packets of the append in flight */
+	int write_inflight;
+	off_t write_base; /* Log length before the append in flight */
+	int write_fd; /* Log descriptor of the append in flight */
+	uint64_t write_start; /* metrics_now() of the append in flight */
+};
+
+static int g_wakefd = -1;
+
+static int sys_setup(unsigned entries, struct io_uring_params* p){
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void* arg, unsigned nr_args){
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Publishes the filled SQEs and optionally waits for a completion
+ */
+static int uring_submit(struct uring* r, unsigned wait){
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	unsigned pending = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	if(!pending && !wait){
+		return 0;
+	}
+	return sys_enter(r->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/*
+ * Makes sure that n SQEs can be filled without a submission in between,
+ * so a linked chain is published as a whole
+ */
+static void sq_reserve(struct uring* r, unsigned n){
+	if(r->sq_entries - (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) < n){
+		uring_submit(r, 0);
+	}
+}
+
+static struct io_uring_sqe* get_sqe(struct uring* r, int opcode, int fd, struct uring_conn* c, int op){
+	sq_reserve(r, 1);
+	struct io_uring_sqe* sqe = &r->sqes[r->sq_local & r->sq_mask];
+	r->sq_local++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = (uintptr_t)c | op;
+	if(c){
+		c->inflight++;
+	}
+	return sqe;
+}
+
+static void buf_add(struct uring* r, unsigned short bid){
+	/* Only the listed fields, the ring tail overlays resv of the first entry */
+	struct io_uring_buf* buf = &r->br->bufs[r->br_tail & (r->buf_count - 1)];
+	buf->addr = (uintptr_t)(r->bufs + (size_t)bid * r->buf_size);
+	buf->len = r->buf_size;
+	buf->bid = bid;
+	r->br_tail++;
+}
+
+static void buf_publish(struct uring* r){
+	__atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(struct uring* r, int op){
+	struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_ACCEPT, op == OP_ACCEPT ? r->sockfd : g_unixfd, NULL, op);
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	r->accept_armed++;
+}
+
+static void arm_wake(struct uring* r){
+	struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_READ, g_wakefd, NULL, OP_WAKE);
+	sqe->addr = (uintptr_t)&r->wake_val;
+	sqe->len = sizeof(r->wake_val);
+}
+
+static void arm_timer(struct uring* r){
+	struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_READ, g_timerfd, NULL, OP_TIMER);
+	sqe->addr = (uintptr_t)&r->timer_val;
+	sqe->len = sizeof(r->timer_val);
+}
+
+static void arm_sweep(struct uring* r){
+	struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_TIMEOUT, -1, NULL, OP_SWEEP);
+	sqe->addr = (uintptr_t)&r->sweep_ts;
+	sqe->len = 1;
+}
+
+static void arm_recv(struct uring* r, struct uring_conn* c){
+	struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_RECV, c->sd, c, OP_RECV);
+	/* Not multishot, the next one is armed only once the packets received are answered */
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	c->recv_armed = 1;
+}
+
+static void submit_send(struct uring* r, struct uring_conn* c){
+	struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_SEND, c->sd, c, OP_SEND);
+	sqe->addr = (uintptr_t)(c->buf + c->buf_off);
+	sqe->len = c->buf_len - c->buf_off;
+	sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/*
+ * Frees the connection once it is closing and the kernel holds no reference to it
+ */
+static void conn_release(struct uring* r, struct uring_conn* c){
+	if(!c->closing || c->inflight){
+		return;
+	}
+	aesd_log(LOG_INFO, "Closed connection from %s", c->address);
+	if(c->prev){
+		c->prev->next = c->next;
+	}
+	else{
+		r->conns = c->next;
+	}
+	if(c->next){
+		c->next->prev = c->prev;
+	}
+	if(c->rb.zs){
+		readback_deinit(&c->rb);
+	}
+	close(c->fd);
+	close(c->sd);
+	framer_deinit(&c->fr);
+	arena_put(c->arena);
+	leave_connection();
+	metrics_add(METRIC_CLOSED, 1);
+}
+
+/*
+ * The connection may be freed on return
+ */
+static void conn_close(struct uring* r, struct uring_conn* c){
+	if(!c->closing){
+		c->closing = 1;
+		/* Terminates the receive and a send in flight */
+		shutdown(c->sd, SHUT_RDWR);
+	}
+	conn_release(r, c);
+}
+
+/*
+ * Submits the next step of the read-back.
+ * Returns 1 when the read-back is complete and nothing was submitted, 0 when
+ * a step is submitted, -1 when the next frame could not be made
+ */
+static int readback_next(struct uring* r, struct uring_conn* c){
+	if(c->rb.zs){
+		ssize_t res = readback_fill(&c->rb);
+		c->off = c->rb.off;
+		if(res <= 0){
+			return res < 0 ? -1 : 1;
+		}
+		c->buf_len = res;
+		c->buf_off = 0;
+		submit_send(r, c);
+		return 0;
+	}
+	size_t count = g_config.readback_chunk;
+	if(c->end >= 0){
+		if(c->off >= c->end){
+			return 1;
+		}
+		if(c->end - c->off < (off_t)count){
+			count = c->end - c->off;
+		}
+	}
+	c->buf_len = c->buf_off = 0;
+	if(g_config.backend != BACKEND_STORAGE){
+		/* Copied from memory, the segments are mapped */
+		c->buf_len = g_config.backend == BACKEND_RING ? ring_read(&c->off, c->end, c->buf, count) :
+				segment_read(&c->off, c->end, c->buf, count);
+		if(!c->buf_len){
+			return 1;
+		}
+		submit_send(r, c);
+		return 0;
+	}
+	if(c->read_eof){
+		return 1;
+	}
+	sq_reserve(r, 2);
+	/* The char device reads from its own file position */
+	struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_READ, c->fd, c, OP_READ);
+	sqe->addr = (uintptr_t)c->buf;
+	sqe->len = count;
+	sqe->off = USE_AESD_CHAR_DEVICE ? (__u64)-1 : (__u64)c->off;
+	if(!USE_AESD_CHAR_DEVICE){
+		/* A regular file is read in full up to the snapshot, so the send length is known */
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = get_sqe(r, IORING_OP_SEND, c->sd, c, OP_SEND);
+		sqe->addr = (uintptr_t)c->buf;
+		sqe->len = count;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		c->linked_send = 1;
+	}
+	return 0;
+}
+
+/*
+ * Starts streaming the log back.
+ * Returns 1 when there was nothing to send, 0 when operations are submitted, -1 on error
+ */
+static int readback_begin(struct uring* r, struct uring_conn* c, off_t start, off_t end){
+	if(c->session.compress){
+		readback_init(&c->rb, c->fd, start, end, NULL);
+		/* Recorded by readback_done like every read-back of the engine */
+		c->rb.started = 0;
+		if(readback_compress(&c->rb, c->session.channel)){
+			readback_deinit(&c->rb);
+			return -1;
+		}
+		c->buf = c->rb.buf;
+	}
+	else if(!c->buf){
+		c->buf = arena_scratch(c->arena);
+		if(!c->buf){
+			return -1;
+		}
+	}
+	c->off = start;
+	c->end = end;
+	c->read_eof = 0;
+	c->readback_start = metrics_now();
+	c->active = idle_clock();
+	c->state = CONN_SEND;
+	if(g_config.backend == BACKEND_STORAGE && USE_AESD_CHAR_DEVICE && lseek(c->fd, start, SEEK_SET) == -1){
+		aesd_log(LOG_WARNING, "lseek FAILED error:%s", strerror(errno));
+	}
+	int res = readback_next(r, c);
+	if(!res && !c->corked){
+		/* The send is only queued, it is submitted behind the cork */
+		c->corked = readback_cork(c->sd, 1);
+	}
+	return res;
+}
+
+static void conn_advance(struct uring* r, struct uring_conn* c);
+
+/*
+ * Hands the connection over to the subscription thread. The receive is
+ * cancelled instead of shutting the socket down, the connection may be freed on return
+ */
+static void conn_subscribe(struct uring* r, struct uring_conn* c, off_t start){
+	subscribe_add(c->sd, start);
+	c->closing = 1;
+	if(c->recv_armed){
+		struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_ASYNC_CANCEL, -1, NULL, OP_CANCEL);
+		sqe->addr = (uintptr_t)c | OP_RECV;
+	}
+	conn_release(r, c);
+}
+
+static void readback_done(struct uring* r, struct uring_conn* c){
+	metrics_since(METRIC_READBACK, c->readback_start);
+	if(c->rb.zs){
+		readback_deinit(&c->rb);
+		c->buf = NULL;
+	}
+	if(c->corked){
+		c->corked = readback_cork(c->sd, 0);
+	}
+	c->session.cursor = c->off;
+	c->state = CONN_RECV;
+	conn_advance(r, c);
+}
+
+/*
+ * Copies a packet into the next batch
+ */
+static int stage_bytes(struct uring* r, const char* data, size_t len){
+	struct uring_batch* b = &r->staged;
+	if(b->count == b->iov_cap){
+		int cap = b->iov_cap ? b->iov_cap * 2 : 16;
+		struct iovec* iov = realloc(b->iov, cap * sizeof(struct iovec));
+		if(!iov){
+			aesd_log(LOG_ERR, "realloc FAILED");
+			return -1;
+		}
+		b->iov = iov;
+		b->iov_cap = cap;
+	}
+	if(b->cap - b->len < len){
+		size_t cap = b->cap ? b->cap : BUFSIZE;
+		while(cap - b->len < len){
+			cap *= 2;
+		}
+		char* buf = realloc(b->buf, cap);
+		if(!buf){
+			aesd_log(LOG_ERR, "realloc FAILED");
+			return -1;
+		}
+		b->buf = buf;
+		b->cap = cap;
+	}
+	memcpy(b->buf + b->len, data, len);
+	/* Only the length, buf may still move */
+	b->iov[b->count++].iov_len = len;
+	b->len += len;
+	return 0;
+}
+
+/*
+ * Copies a data packet into the next batch
+ */
+static int stage_packet(struct uring* r, struct uring_conn* c, struct frame* f){
+	struct uring_batch* b = &r->staged;
+	if(stage_bytes(r, f->data, f->len)){
+		return -1;
+	}
+	/* Relative to the batch until the log length is known */
+	c->end = b->len;
+	c->batch_next = NULL;
+	*b->last = c;
+	b->last = &c->batch_next;
+	c->inflight++;
+	c->state = CONN_COMMIT;
+	return 0;
+}
+
+/*
+ * Takes packets while the connection is idle, until it has to wait
+ */
+static void conn_advance(struct uring* r, struct uring_conn* c){
+	while(!c->closing && c->state == CONN_RECV){
+		struct frame f;
+		if(framer_next(&c->fr, &f)){
+			if(f.kind == FRAME_DATA && g_config.backend == BACKEND_STORAGE && !c->session.channel){
+				if(stage_packet(r, c, &f)){
+					conn_close(r, c);
+				}
+				return;
+			}
+			/* Commands and ring appends cost no syscall and are served at once, other channels are written in place */
+			off_t start, end;
+			int res = process_packet(&c->session, c->fd, &f, &start, &end);
+			if(res == PACKET_CHANNEL){
+				/* Only read-backs use the descriptor, none is in flight while receiving */
+				close(c->fd);
+				c->fd = c->session.channel_fd;
+				res = 0;
+			}
+			if(res == PACKET_SUBSCRIBED){
+				conn_subscribe(r, c, start);
+				return;
+			}
+			if(!res){
+				res = readback_begin(r, c, start, end);
+			}
+			if(res < 0){
+				conn_close(r, c);
+				return;
+			}
+			if(res > 0){
+				c->session.cursor = c->off;
+				c->state = CONN_RECV;
+			}
+			continue;
+		}
+		/* A draining server lets the client go once every packet is answered */
+		if(framer_done(&c->fr) || drain_ready(&c->fr)){
+			conn_close(r, c);
+			return;
+		}
+		if(!c->recv_armed && !c->fr.eof){
+			arm_recv(r, c);
+		}
+		return;
+	}
+}
+
+/*
+ * Appends the staged packets with one writev. The char device has no
+ * write_iter, so the kernel writes every packet as a record of its own.
+ * The read-back of the first connection is linked behind it for the regular file
+ */
+static void batch_flush(struct uring* r){
+	if(r->write_inflight || !r->staged.len){
+		return;
+	}
+	struct uring_batch b = r->writing;
+	r->writing = r->staged;
+	r->staged = b;
+	r->staged.len = 0;
+	r->staged.count = 0;
+	r->staged.first = NULL;
+	r->staged.last = &r->staged.first;
+
+	int logfd;
+	off_t base = commit_acquire(&logfd);
+	r->write_base = base;
+	r->write_fd = logfd;
+	for(struct uring_conn* c = r->writing.first; c; c = c->batch_next){
+		c->end += base;
+	}
+	char* data = r->writing.buf;
+	for(int i = 0; i < r->writing.count; i++){
+		r->writing.iov[i].iov_base = data;
+		data += r->writing.iov[i].iov_len;
+	}
+	sq_reserve(r, 3);
+	struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_WRITEV, logfd, NULL, OP_WRITE);
+	sqe->addr = (uintptr_t)r->writing.iov;
+	sqe->len = r->writing.count;
+	/* Appended at the end of the O_APPEND descriptor */
+	sqe->off = (__u64)-1;
+	r->write_inflight = 1;
+	r->write_start = metrics_now();
+
+	struct uring_conn* c = r->writing.first;
+	/* Frames are made from the log synchronously, they wait for on_write */
+	if(c && !USE_AESD_CHAR_DEVICE && !c->closing && !c->session.compress){
+		sqe->flags |= IOSQE_IO_LINK;
+		if(readback_begin(r, c, c->session.incremental ? c->session.cursor : 0, c->end)){
+			/* Nothing was linked, the write must not wait for a successor */
+			sqe->flags &= ~IOSQE_IO_LINK;
+			c->state = CONN_COMMIT;
+		}
+	}
+}
+
+static void on_write(struct uring* r, int res){
+	int ok = res == (int)r->writing.len;
+	size_t written = res > 0 ? res : 0;
+	r->write_inflight = 0;
+	if(!ok){
+		aesd_log(LOG_ERR, "write FAILED res:%d", res);
+		/* A regular file is cut back to whole packets, the device keeps what it took */
+		if(written && !USE_AESD_CHAR_DEVICE && !ftruncate(r->write_fd, r->write_base)){
+			written = 0;
+		}
+	}
+	if(written){
+		/* Before the writer role is released, so batches reach the subscribers in log order */
+		int n = 0;
+		for(size_t left = written; left; n++){
+			if(r->writing.iov[n].iov_len > left){
+				r->writing.iov[n].iov_len = left;
+			}
+			left -= r->writing.iov[n].iov_len;
+		}
+		subscribe_publish(r->write_base, r->writing.iov, n);
+	}
+	commit_release(written);
+	struct uring_conn* c = r->writing.first;
+	r->writing.first = NULL;
+	r->writing.last = &r->writing.first;
+	r->writing.len = 0;
+	r->writing.count = 0;
+	while(c){
+		struct uring_conn* next = c->batch_next;
+		c->inflight--;
+		metrics_since(METRIC_COMMIT, r->write_start);
+		if(c->closing || !ok){
+			conn_close(r, c);
+		}
+		else if(c->state == CONN_COMMIT){
+			int started = readback_begin(r, c, c->session.incremental ? c->session.cursor : 0, c->end);
+			if(started < 0){
+				conn_close(r, c);
+			}
+			else if(started > 0){
+				readback_done(r, c);
+			}
+		}
+		c = next;
+	}
+}
+
+/*
+ * The engine holds the writer role while a batch is in flight, so the
+ * timestamp goes to the log through the batch like any other packet
+ */
+static void on_timer(struct uring* r, int res){
+	if(res != sizeof(r->timer_val)){
+		return;
+	}
+	size_t len;
+	const char* stamp = timestamp_packet(&len);
+	aesd_log(LOG_INFO, "watchdog %s", stamp);
+	if(g_config.backend == BACKEND_STORAGE){
+		stage_bytes(r, stamp, len);
+	}
+	else{
+		commit_packet(0, stamp, len, NULL);
+	}
+}
+
+/*
+ * Closes the connections which made no progress for the -I or -O timeout.
+ * Packets waiting for the batch append are not timed
+ */
+static void on_sweep(struct uring* r){
+	time_t now = idle_clock();
+	struct uring_conn* c = r->conns;
+	while(c){
+		struct uring_conn* next = c->next;
+		if(!c->closing && c->state != CONN_COMMIT && idle_expired(c->state == CONN_SEND, c->active, now)){
+			aesd_log(LOG_WARNING, "Connection from %s timed out", c->address);
+			conn_close(r, c);
+		}
+		c = next;
+	}
+}
+
+static void on_accept(struct uring* r, int res){
+	if(res < 0){
+		if(work_state && !r->draining && res != -ECONNABORTED){
+			aesd_log(LOG_ERR, "accept FAILED error:%s", strerror(-res));
+		}
+		return;
+	}
+	if(admit_connection(res)){
+		close(res);
+		return;
+	}
+	struct arena* arena = arena_get();
+	if(!arena){
+		shed_connection(res, BUSY_REPLY);
+		close(res);
+		leave_connection();
+		return;
+	}
+	/* The arena hands out 16-byte aligned memory, the low bits of user_data stay free */
+	struct uring_conn* c = arena_alloc(arena, sizeof(struct uring_conn));
+	memset(c, 0, sizeof(struct uring_conn));
+	c->arena = arena;
+	c->session.arena = arena;
+	c->sd = res;
+	c->active = idle_clock();
+	c->fd = open_backend(0);
+	if(c->fd == -1){
+		close(c->sd);
+		arena_put(arena);
+		leave_connection();
+		return;
+	}
+	/* The rest of the arena is the framing buffer, one byte is kept for the terminator */
+	size_t cap;
+	char* buf = arena_rest(arena, ARENA_BYTES, &cap);
+	framer_init_lent(&c->fr, buf, cap ? cap - 1 : 0);
+	struct sockaddr_storage their_addr;
+	socklen_t addr_size = sizeof their_addr;
+	if(!getpeername(c->sd, (struct sockaddr *)&their_addr, &addr_size)){
+		peer_address(&their_addr, c->address);
+	}
+	aesd_log(LOG_INFO, "Accepted connection from %s; new_fd: %d", c->address, c->sd);
+	c->next = r->conns;
+	if(r->conns){
+		r->conns->prev = c;
+	}
+	r->conns = c;
+	metrics_add(METRIC_ACCEPTED, 1);
+	arm_recv(r, c);
+}
+
+static void on_recv(struct uring* r, struct uring_conn* c, int res, unsigned flags){
+	if(!(flags & IORING_CQE_F_MORE)){
+		c->recv_armed = 0;
+		c->inflight--;
+	}
+
+	if(res > 0){
+		unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		c->active = idle_clock();
+		size_t avail;
+		char* space = framer_reserve(&c->fr, res, &avail);
+		if(space){
+			memcpy(space, r->bufs + (size_t)bid * r->buf_size, res);
+			framer_commit(&c->fr, res);
+		}
+		buf_add(r, bid);
+		if(!space){
+			/* A client pipelining faster than it reads back is cut off at -m */
+			if(errno == EMSGSIZE){
+				shed_connection(c->sd, OVERSIZE_REPLY);
+			}
+			else{
+				aesd_log(LOG_ERR, "framer_reserve FAILED");
+			}
+			conn_close(r, c);
+			return;
+		}
+	}
+	else if(res == 0){
+		framer_commit(&c->fr, 0);
+	}
+	else if(res != -ENOBUFS){
+		if(!c->closing){
+			aesd_log(LOG_ERR, "recv FAILED error:%s", strerror(-res));
+		}
+		conn_close(r, c);
+		return;
+	}
+	if(c->closing){
+		conn_release(r, c);
+	}
+	else if(c->state == CONN_RECV){
+		conn_advance(r, c);
+	}
+}
+
+static void on_read(struct uring* r, struct uring_conn* c, int res){
+	c->inflight--;
+	if(c->closing){
+		conn_release(r, c);
+		return;
+	}
+	if(res < 0){
+		aesd_log(LOG_ERR, "read FAILED error:%s", strerror(-res));
+		conn_close(r, c);
+		return;
+	}
+	if(!res){
+		c->read_eof = 1;
+	}
+	c->off += res;
+	c->buf_len = res;
+	c->buf_off = 0;
+	if(c->linked_send){
+		return;
+	}
+	if(res){
+		submit_send(r, c);
+	}
+	else{
+		readback_done(r, c);
+	}
+}
+
+static void on_send(struct uring* r, struct uring_conn* c, int res){
+	int linked = c->linked_send;
+	c->inflight--;
+	c->linked_send = 0;
+	if(c->closing){
+		conn_release(r, c);
+		return;
+	}
+	if(res == -ECANCELED && linked){
+		/* The read was short, send what it returned */
+		res = 0;
+	}
+	else if(res < 0){
+		aesd_log(LOG_ERR, "send FAILED error:%s", strerror(-res));
+		conn_close(r, c);
+		return;
+	}
+	c->buf_off += res;
+	if(res){
+		c->active = idle_clock();
+	}
+	metrics_add(METRIC_BYTES_OUT, res);
+	if(c->buf_off < c->buf_len){
+		submit_send(r, c);
+		return;
+	}
+	res = readback_next(r, c);
+	if(res < 0){
+		conn_close(r, c);
+	}
+	else if(res){
+		readback_done(r, c);
+	}
+}
+
+static void dispatch(struct uring* r, struct io_uring_cqe* cqe){
+	int op = cqe->user_data & OP_MASK;
+	struct uring_conn* c = (struct uring_conn*)(uintptr_t)(cqe->user_data & ~(__u64)OP_MASK);
+	switch(op){
+		case OP_ACCEPT:
+		case OP_ACCEPT_UNIX:
+			on_accept(r, cqe->res);
+			if(!(cqe->flags & IORING_CQE_F_MORE)){
+				r->accept_armed--;
+				if(work_state && !r->draining){
+					arm_accept(r, op);
+				}
+			}
+			break;
+		case OP_WAKE:
+			if(work_state){
+				arm_wake(r);
+			}
+			break;
+		case OP_TIMER:
+			on_timer(r, cqe->res);
+			if(work_state){
+				arm_timer(r);
+			}
+			break;
+		case OP_SWEEP:
+			on_sweep(r);
+			if(work_state){
+				arm_sweep(r);
+			}
+			break;
+		case OP_WRITE:
+			on_write(r, cqe->res);
+			break;
+		case OP_RECV:
+			on_recv(r, c, cqe->res, cqe->flags);
+			break;
+		case OP_READ:
+			on_read(r, c, cqe->res);
+			break;
+		case OP_SEND:
+			on_send(r, c, cqe->res);
+			break;
+	}
+}
+
+static void reap(struct uring* r){
+	unsigned head = *r->cq_head;
+	unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for(; head != tail; head++){
+		dispatch(r, &r->cqes[head & r->cq_mask]);
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	buf_publish(r);
+}
+
+static int uring_init(struct uring* r, int sockfd){
+	struct io_uring_params p;
+	memset(r, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	r->sockfd = sockfd;
+	r->staged.last = &r->staged.first;
+	r->writing.last = &r->writing.first;
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_ENTRIES * 4;
+	r->fd = sys_setup(URING_ENTRIES, &p);
+	if(r->fd == -1){
+		aesd_log(LOG_ERR, "io_uring_setup FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+	}
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_ptr == MAP_FAILED){
+		aesd_log(LOG_ERR, "mmap FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	r->cq_ptr = r->sq_ptr;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP)){
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cq_ptr == MAP_FAILED){
+			aesd_log(LOG_ERR, "mmap FAILED error:%s", strerror(errno));
+			return -1;
+		}
+	}
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED){
+		aesd_log(LOG_ERR, "mmap FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	char* sq = r->sq_ptr;
+	char* cq = r->cq_ptr;
+	r->sq_head = (unsigned*)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	unsigned* array = (unsigned*)(sq + p.sq_off.array);
+	for(unsigned i = 0; i < p.sq_entries; i++){
+		array[i] = i;
+	}
+	r->sq_local = *r->sq_tail;
+	r->cq_head = (unsigned*)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	/* A larger -i makes the buffers larger and fewer, the pool keeps its size */
+	r->buf_size = g_config.recv_chunk > URING_BUF_SIZE ? g_config.recv_chunk : URING_BUF_SIZE;
+	r->buf_count = URING_BUF_COUNT;
+	while(r->buf_count > URING_BUF_MIN && (size_t)r->buf_count * r->buf_size > (size_t)URING_BUF_COUNT * URING_BUF_SIZE){
+		r->buf_count /= 2;
+	}
+	/* The provided buffer ring must be page-aligned */
+	r->br_len = r->buf_count * sizeof(struct io_uring_buf);
+	r->br = mmap(NULL, r->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(r->br == MAP_FAILED){
+		r->br = NULL;
+		aesd_log(LOG_ERR, "mmap FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	r->bufs = malloc((size_t)r->buf_count * r->buf_size);
+	if(!r->bufs){
+		aesd_log(LOG_ERR, "malloc FAILED");
+		return -1;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)r->br;
+	reg.ring_entries = r->buf_count;
+	reg.bgid = URING_BGID;
+	if(sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1)){
+		aesd_log(LOG_ERR, "io_uring_register FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	for(unsigned i = 0; i < r->buf_count; i++){
+		buf_add(r, i);
+	}
+	buf_publish(r);
+	return 0;
+}
+
+static void uring_deinit(struct uring* r){
+	if(r->fd != -1){
+		/* Cancels everything still in flight */
+		close(r->fd);
+	}
+	while(r->conns){
+		struct uring_conn* c = r->conns;
+		r->conns = c->next;
+		aesd_log(LOG_INFO, "Closed connection from %s", c->address);
+		close(c->fd);
+		close(c->sd);
+		framer_deinit(&c->fr);
+		arena_put(c->arena);
+		leave_connection();
+		metrics_add(METRIC_CLOSED, 1);
+	}
+	if(r->sqes && r->sqes != MAP_FAILED){
+		munmap(r->sqes, r->sqes_len);
+	}
+	if(r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr){
+		munmap(r->cq_ptr, r->cq_len);
+	}
+	if(r->sq_ptr && r->sq_ptr != MAP_FAILED){
+		munmap(r->sq_ptr, r->sq_len);
+	}
+	if(r->br){
+		munmap(r->br, r->br_len);
+	}
+	free(r->bufs);
+	free(r->staged.buf);
+	free(r->writing.buf);
+	free(r->staged.iov);
+	free(r->writing.iov);
+}
+
+static void cancel_accepts(struct uring* r){
+	struct io_uring_sqe* sqe = get_sqe(r, IORING_OP_ASYNC_CANCEL, -1, NULL, OP_CANCEL);
+	sqe->addr = OP_ACCEPT;
+	if(g_unixfd != -1){
+		sqe = get_sqe(r, IORING_OP_ASYNC_CANCEL, -1, NULL, OP_CANCEL);
+		sqe->addr = OP_ACCEPT_UNIX;
+	}
+}
+
+/*
+ * Stops accepting and closes the connections waiting between packets on the
+ * first call. Returns 1 when every connection and append is finished
+ */
+static int uring_drain(struct uring* r){
+	if(!r->draining){
+		r->draining = 1;
+		cancel_accepts(r);
+		/* The deadline is checked by the sweep timeout */
+		if(!g_config.recv_timeout && !g_config.send_timeout){
+			r->sweep_ts.tv_sec = 1;
+			arm_sweep(r);
+		}
+		struct uring_conn* c = r->conns;
+		while(c){
+			struct uring_conn* next = c->next;
+			if(!c->closing && c->state == CONN_RECV && drain_ready(&c->fr)){
+				conn_close(r, c);
+			}
+			c = next;
+		}
+	}
+	if(drain_expired()){
+		return 0;
+	}
+	return !r->conns && !r->staged.len && !r->write_inflight;
+}
+
+int uring_run(int sockfd){
+	struct uring r;
+	g_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(g_wakefd == -1){
+		aesd_log(LOG_ERR, "eventfd FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	if(uring_init(&r, sockfd)){
+		uring_deinit(&r);
+		return -1;
+	}
+	aesd_log(LOG_INFO, "Started io_uring engine");
+	arm_wake(&r);
+	if(g_timerfd != -1){
+		arm_timer(&r);
+	}
+	if(g_config.recv_timeout || g_config.send_timeout){
+		r.sweep_ts.tv_sec = 1;
+		arm_sweep(&r);
+	}
+	arm_accept(&r, OP_ACCEPT);
+	if(g_unixfd != -1){
+		arm_accept(&r, OP_ACCEPT_UNIX);
+	}
+	/* A batch append in flight and the staged packets are written before leaving, the writer owns the log */
+	while(work_state || r.write_inflight || r.staged.len){
+		if(drain_state && uring_drain(&r)){
+			break;
+		}
+		batch_flush(&r);
+		if(uring_submit(&r, 1) == -1 && errno != EINTR && errno != EBUSY){
+			aesd_log(LOG_ERR, "io_uring_enter FAILED error:%s", strerror(errno));
+			break;
+		}
+		reap(&r);
+	}
+	/* The ring is torn down asynchronously. The accepts hold the listeners,
+	 * they are cancelled first so that the port can be bound again at once */
+	if(r.accept_armed && !r.draining){
+		cancel_accepts(&r);
+	}
+	while(r.accept_armed){
+		if(uring_submit(&r, 1) == -1 && errno != EINTR){
+			break;
+		}
+		reap(&r);
+	}
+	uring_deinit(&r);
+	return 0;
+}
+
+void uring_wakeup(){
+	uint64_t one = 1;
+	if(g_wakefd != -1){
+		if(write(g_wakefd, &one, sizeof(one)) == -1){
+			/* Counter is already non-zero, the engine is being woken */
+		}
+	}
+}
@@ -0,0 +1,30 @@
+/**
+ * @file aesd-uring.h
+ * @brief io_uring engine of the aesdsocket server
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+#ifndef AESD_URING_H
+#define AESD_URING_H
+
+/**
+ * @brief This function serves the listening socket from one io_uring instance.
+ * Accepts, receives, log appends and read-backs are submitted to the ring and
+ * the thread only sleeps in io_uring_enter. Returns when work_state is cleared
+ * or every connection is finished by the drain.
+ *
+ * @param sockfd listening socket descriptor
+ * @return success status 0 - success, -1 - io_uring is not available
+ */
+int uring_run(int sockfd);
+/**
+ * @brief This function wakes up the io_uring engine so that it notices work_state or drain_state change.
+ * It is async-signal-safe and does nothing if the engine is not running
+ *
+ * @return void
+ */
+void uring_wakeup();
+
+#endif /* AESD_URING_H */
@@ -0,0 +1,474 @@
+/**
+ * @file aesdbench.c
+ * @brief Benchmark client and load generator for the aesdsocket server.
+ * Clients open connections in a loop and send a number of packets on each,
+ * optionally with think time and a share of seek commands. Every packet is
+ * unique, so its reply is complete when the stream ends with the packet.
+ * Latency percentiles come from log-linear histograms merged at the end,
+ * the resident memory and thread count of the server are sampled.
+ *
+ * @author Iosif Futerman
+ * @date October 17, 2026
+ *
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define BUFSIZE 65536
+#define SEEK_PACKET "AESDCHAR_IOCSEEKTO:0,0\n" // seek command of the mix, valid on any log
+#define CHANNEL_PACKET "AESDSOCKET_CHANNEL:%ld\n" // sent first by every connection with -j
+#define HIST_SUB_BITS 4 // 16 latency buckets per power of two, within 6.25%
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/*
+ * Benchmark settings parsed from the command line
+ */
+struct bench_config {
+	const char* host; /* Server host (-H) */
+	const char* port; /* Server port (-p) */
+	int clients; /* Concurrent clients (-c) */
+	long connections; /* Total connections over all clients (-n) */
+	size_t packet_size; /* Bytes per packet including newline, 0 - nothing is sent (-s) */
+	int packets; /* Packets sent per connection (-k) */
+	int think_ms; /* Pause before every packet but the first of a connection (-T) */
+	int seek_percent; /* Share of packets preceded by SEEK_PACKET (-m) */
+	pid_t pid; /* Server process to sample (-P), 0 - no sampling */
+	int idle_ms; /* Reply is complete after this much silence (-t), 0 - wait for EOF */
+	const char* unix_path; /* Unix socket of the server (-U), NULL - TCP to host and port */
+	int channels; /* Connections are spread over this many server channels (-j), 0 - the default log */
+};
+/*
+ * Latencies in nanoseconds, one per client thread, merged at the end
+ */
+struct latency {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+/*
+ * Client thread state
+ */
+struct client {
+	pthread_t thr;
+	int id;
+	unsigned seed; /* rand_r state of the seek mix */
+	char* out; /* SEEK_PACKET followed by the packet */
+	char* packet; /* Packet being sent, made unique per connection and sequence */
+	char* tail; /* Last packet_size bytes received */
+	size_t tail_len;
+	char* buf;
+	long received; /* Bytes received */
+	struct latency plain; /* Packets */
+	struct latency seek; /* Seek command and the packet after it */
+};
+/*
+ * Server process sample taken from /proc
+ */
+struct proc_sample {
+	long rss_kb; /* VmRSS */
+	long threads; /* Threads */
+};
+
+static struct bench_config g_bench = {"127.0.0.1", "9000", 8, 10000, 0, 1, 0, 0, 0, 0, NULL, 0};
+static struct addrinfo* g_addr;
+static struct addrinfo g_unix_ai; // g_addr of -U
+static struct sockaddr_un g_unix_addr;
+static atomic_long g_started = 0;
+static atomic_long g_done = 0;
+static atomic_long g_failed = 0;
+static _Atomic double g_finished = 0; // time the last connection completed
+
+static double now_sec(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int sample_process(pid_t pid, struct proc_sample* sample){
+	char path[64], line[256];
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	FILE* f = fopen(path, "r");
+	if(!f){
+		return -1;
+	}
+	sample->rss_kb = -1;
+	sample->threads = -1;
+	while(fgets(line, sizeof(line), f)){
+		if(!strncmp(line, "VmRSS:", 6)){
+			sample->rss_kb = strtol(line + 6, NULL, 10);
+		}
+		else if(!strncmp(line, "Threads:", 8)){
+			sample->threads = strtol(line + 8, NULL, 10);
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static uint64_t now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void latency_add(struct latency* l, uint64_t v){
+	unsigned idx = v;
+	if(v >= (1 << HIST_SUB_BITS)){
+		unsigned k = 63 - __builtin_clzll(v);
+		idx = ((k - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | ((v >> (k - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+	}
+	l->buckets[idx]++;
+	l->count++;
+	if(v > l->max){
+		l->max = v;
+	}
+}
+
+static void latency_merge(struct latency* to, const struct latency* from){
+	for(int i = 0; i < HIST_BUCKETS; i++){
+		to->buckets[i] += from->buckets[i];
+	}
+	to->count += from->count;
+	if(from->max > to->max){
+		to->max = from->max;
+	}
+}
+
+/*
+ * Highest value of the bucket holding the quantile, capped by the maximum
+ */
+static uint64_t latency_quantile(const struct latency* l, double q){
+	uint64_t rank = q * l->count + 0.999999, seen = 0;
+	unsigned idx = 0;
+	if(!l->count){
+		return 0;
+	}
+	while(idx < HIST_BUCKETS - 1 && seen + l->buckets[idx] < rank){
+		seen += l->buckets[idx++];
+	}
+	uint64_t top = idx;
+	if(idx >= (1 << HIST_SUB_BITS)){
+		unsigned shift = (idx >> HIST_SUB_BITS) - 1;
+		top = ((uint64_t)((1 << HIST_SUB_BITS) | (idx & ((1 << HIST_SUB_BITS) - 1))) << shift) + ((uint64_t)1 << shift) - 1;
+	}
+	return top < l->max ? top : l->max;
+}
+
+static void latency_print(const char* name, const struct latency* l){
+	if(!l->count){
+		return;
+	}
+	printf("%s latency_us count: %lu p50: %.1f p99: %.1f p999: %.1f max: %.1f\n", name, (unsigned long)l->count,
+			latency_quantile(l, 0.5) / 1e3, latency_quantile(l, 0.99) / 1e3, latency_quantile(l, 0.999) / 1e3, l->max / 1e3);
+}
+
+static int send_all(int sd, const char* buf, size_t len){
+	size_t off = 0;
+	while(off < len){
+		ssize_t res = send(sd, buf + off, len - off, MSG_NOSIGNAL);
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		off += res;
+	}
+	return 0;
+}
+
+/*
+ * Receives until the stream ends with the packet just sent.
+ * The reply of a packet is the log up to and including the packet
+ */
+static int wait_reply(struct client* c, int sd){
+	size_t size = g_bench.packet_size;
+	while(c->tail_len < size || memcmp(c->tail, c->packet, size)){
+		ssize_t res = recv(sd, c->buf, BUFSIZE, 0);
+		if(res <= 0){
+			if(res == -1 && errno == EINTR){
+				continue;
+			}
+			/* Replies of the char device run to its end, other clients may have written after the packet */
+			if(res == -1 && g_bench.idle_ms && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				return 0;
+			}
+			return -1;
+		}
+		c->received += res;
+		if((size_t)res >= size){
+			memcpy(c->tail, c->buf + res - size, size);
+		}
+		else{
+			memmove(c->tail, c->tail + res, size - res);
+			memcpy(c->tail + size - res, c->buf, res);
+		}
+		c->tail_len = c->tail_len + res < size ? c->tail_len + res : size;
+	}
+	return 0;
+}
+
+/*
+ * The connection and sequence numbers make the packet unique in the log.
+ * A packet too short for them is not unique and its reply may be cut early
+ */
+static void make_packet(struct client* c, long conn, int seq){
+	size_t size = g_bench.packet_size;
+	int len = snprintf(c->packet, size, "%d:%ld:%d:", c->id, conn, seq);
+	if(len < 0 || (size_t)len >= size){
+		len = 0;
+	}
+	memset(c->packet + len, 'a', size - 1 - len);
+	c->packet[size - 1] = '\n';
+}
+
+/*
+ * One connection: send the packets waiting for every reply, half-close and drain
+ */
+static int run_connection(struct client* c, long conn){
+	int sd = socket(g_addr->ai_family, g_addr->ai_socktype, g_addr->ai_protocol);
+	if(sd == -1){
+		return -1;
+	}
+	if(connect(sd, g_addr->ai_addr, g_addr->ai_addrlen)){
+		close(sd);
+		return -1;
+	}
+	if(g_bench.idle_ms){
+		struct timeval tv = {g_bench.idle_ms / 1000, (g_bench.idle_ms % 1000) * 1000};
+		setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+	if(g_bench.channels){
+		/* Its reply, the history of the channel, is received with the reply of the first packet */
+		char cmd[64];
+		int len = snprintf(cmd, sizeof(cmd), CHANNEL_PACKET, conn % g_bench.channels);
+		if(send_all(sd, cmd, len)){
+			close(sd);
+			return -1;
+		}
+	}
+	for(int seq = 0; g_bench.packet_size && seq < g_bench.packets; seq++){
+		if(seq && g_bench.think_ms){
+			struct timespec think = {g_bench.think_ms / 1000, (g_bench.think_ms % 1000) * 1000000L};
+			nanosleep(&think, NULL);
+		}
+		make_packet(c, conn, seq);
+		int seek = g_bench.seek_percent && (int)(rand_r(&c->seed) % 100) < g_bench.seek_percent;
+		uint64_t start = now_ns();
+		/* Sent with one call, the seek reply is followed by the packet reply which ends the wait */
+		const char* out = seek ? c->out : c->packet;
+		if(send_all(sd, out, c->packet + g_bench.packet_size - out) || wait_reply(c, sd)){
+			close(sd);
+			return -1;
+		}
+		latency_add(seek ? &c->seek : &c->plain, now_ns() - start);
+	}
+	shutdown(sd, SHUT_WR);
+	while(1){
+		ssize_t res = recv(sd, c->buf, BUFSIZE, 0);
+		if(res == 0){
+			break;
+		}
+		if(res == -1){
+			if(errno == EINTR){
+				continue;
+			}
+			if(g_bench.idle_ms && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				break;
+			}
+			close(sd);
+			return -1;
+		}
+		c->received += res;
+	}
+	close(sd);
+	return 0;
+}
+
+static void* client_thread(void* arg){
+	struct client* c = (struct client*)arg;
+	long conn;
+	while((conn = atomic_fetch_add(&g_started, 1)) < g_bench.connections){
+		c->tail_len = 0;
+		if(run_connection(c, conn)){
+			atomic_fetch_add(&g_failed, 1);
+		}
+		if(atomic_fetch_add(&g_done, 1) + 1 == g_bench.connections){
+			g_finished = now_sec();
+		}
+	}
+	return c;
+}
+
+static void usage(const char* name){
+	fprintf(stderr, "Usage: %s [-H host] [-p port] [-U unix_socket] [-c clients] [-n connections] [-s packet_size] [-k packets_per_connection] [-T think_ms] [-m seek_percent] [-P server_pid] [-t idle_ms] [-j channels]\n", name);
+}
+
+int main(int argc, char** argv){
+	int opt;
+	while((opt = getopt(argc, argv, "H:p:U:c:n:s:k:T:m:P:t:j:")) != -1){
+		switch(opt){
+			case 'H':
+				g_bench.host = optarg;
+				break;
+			case 'p':
+				g_bench.port = optarg;
+				break;
+			case 'U':
+				g_bench.unix_path = optarg;
+				break;
+			case 'c':
+				g_bench.clients = atoi(optarg);
+				break;
+			case 'n':
+				g_bench.connections = atol(optarg);
+				break;
+			case 's':
+				g_bench.packet_size = strtoul(optarg, NULL, 10);
+				break;
+			case 'k':
+				g_bench.packets = atoi(optarg);
+				break;
+			case 'T':
+				g_bench.think_ms = atoi(optarg);
+				break;
+			case 'm':
+				g_bench.seek_percent = atoi(optarg);
+				break;
+			case 'P':
+				g_bench.pid = atoi(optarg);
+				break;
+			case 't':
+				g_bench.idle_ms = atoi(optarg);
+				break;
+			case 'j':
+				g_bench.channels = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+	if(g_bench.clients <= 0 || g_bench.connections <= 0 || g_bench.packets <= 0 || g_bench.think_ms < 0 ||
+			g_bench.seek_percent < 0 || g_bench.seek_percent > 100 || g_bench.channels < 0){
+		usage(argv[0]);
+		return -1;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(g_bench.unix_path){
+		if(strlen(g_bench.unix_path) >= sizeof(g_unix_addr.sun_path)){
+			fprintf(stderr, "Unix socket path is too long\n");
+			return -1;
+		}
+		g_unix_addr.sun_family = AF_UNIX;
+		strcpy(g_unix_addr.sun_path, g_bench.unix_path);
+		g_unix_ai.ai_family = AF_UNIX;
+		g_unix_ai.ai_socktype = SOCK_STREAM;
+		g_unix_ai.ai_addr = (struct sockaddr*)&g_unix_addr;
+		g_unix_ai.ai_addrlen = sizeof(g_unix_addr);
+		g_addr = &g_unix_ai;
+	}
+	else if(getaddrinfo(g_bench.host, g_bench.port, &hints, &g_addr)){
+		fprintf(stderr, "getaddrinfo FAILED\n");
+		return -1;
+	}
+
+	struct proc_sample first = {-1, -1}, peak = {-1, -1}, last = {-1, -1};
+	if(g_bench.pid && sample_process(g_bench.pid, &first)){
+		fprintf(stderr, "Can not sample process %d\n", (int)g_bench.pid);
+		return -1;
+	}
+	peak = first;
+
+	struct client* clients = calloc(g_bench.clients, sizeof(struct client));
+	size_t tail_size = g_bench.packet_size ? g_bench.packet_size : 1;
+	for(int i = 0; i < g_bench.clients; i++){
+		clients[i].id = i;
+		clients[i].seed = i + 1;
+		clients[i].out = malloc(sizeof(SEEK_PACKET) - 1 + tail_size);
+		clients[i].packet = clients[i].out + sizeof(SEEK_PACKET) - 1;
+		clients[i].tail = malloc(tail_size);
+		clients[i].buf = malloc(BUFSIZE);
+		if(!clients[i].out || !clients[i].tail || !clients[i].buf){
+			fprintf(stderr, "malloc FAILED\n");
+			return -1;
+		}
+		memcpy(clients[i].out, SEEK_PACKET, sizeof(SEEK_PACKET) - 1);
+	}
+	double start = now_sec(), report = start;
+	for(int i = 0; i < g_bench.clients; i++){
+		pthread_create(&clients[i].thr, NULL, client_thread, &clients[i]);
+	}
+	printf("%8s %10s %10s %10s %8s\n", "time_s", "conns", "conns/s", "rss_kb", "threads");
+	long reported = 0;
+	while(atomic_load(&g_done) < g_bench.connections){
+		usleep(100000);
+		if(g_bench.pid && !sample_process(g_bench.pid, &last)){
+			if(last.rss_kb > peak.rss_kb){
+				peak.rss_kb = last.rss_kb;
+			}
+			if(last.threads > peak.threads){
+				peak.threads = last.threads;
+			}
+		}
+		double t = now_sec();
+		if(t - report >= 1.0){
+			long done = atomic_load(&g_done);
+			printf("%8.1f %10ld %10.0f %10ld %8ld\n", t - start, done, (done - reported) / (t - report), last.rss_kb, last.threads);
+			fflush(stdout);
+			reported = done;
+			report = t;
+		}
+	}
+	struct latency plain, seek;
+	long received = 0;
+	memset(&plain, 0, sizeof(plain));
+	memset(&seek, 0, sizeof(seek));
+	for(int i = 0; i < g_bench.clients; i++){
+		pthread_join(clients[i].thr, NULL);
+		latency_merge(&plain, &clients[i].plain);
+		latency_merge(&seek, &clients[i].seek);
+		received += clients[i].received;
+		free(clients[i].out);
+		free(clients[i].tail);
+		free(clients[i].buf);
+	}
+	/* Not rounded up to the sampling period of the loop above */
+	double elapsed = g_finished - start;
+	if(g_bench.pid){
+		sample_process(g_bench.pid, &last);
+	}
+
+	latency_print("packet", &plain);
+	latency_print("seek", &seek);
+	printf("packets: %lu rate: %.0f packets/s received: %.1f MB/s\n",
+			(unsigned long)(plain.count + seek.count), (plain.count + seek.count) / elapsed, received / elapsed / 1e6);
+	printf("connections: %ld failed: %ld time: %.3f s rate: %.0f conn/s\n",
+			g_bench.connections, atomic_load(&g_failed), elapsed, g_bench.connections / elapsed);
+	if(g_bench.pid){
+		printf("server rss_kb start: %ld peak: %ld end: %ld; threads start: %ld peak: %ld end: %ld\n",
+				first.rss_kb, peak.rss_kb, last.rss_kb, first.threads, peak.threads, last.threads);
+	}
+	free(clients);
+	if(g_addr != &g_unix_ai){
+		freeaddrinfo(g_addr);
+	}
+	return atomic_load(&g_failed) ? 1 : 0;
+}
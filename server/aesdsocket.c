@@ -8,6 +8,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +16,13 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <netdb.h>
 #include <syslog.h>
 #include <signal.h>
@@ -23,39 +31,119 @@
 #include <errno.h>
 #include <pthread.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <limits.h>
 
 #include "aesdsocket.h"
+#include "aesd-reactor.h"
+#include "aesd-pool.h"
+#include "aesd-uring.h"
+#include "aesd-readback.h"
+#include "aesd-framer.h"
+#include "aesd-commit.h"
+#include "aesd-ring.h"
+#include "aesd-segment.h"
+#include "aesd-arena.h"
+#include "aesd-log.h"
+#include "aesd-metrics.h"
+#include "aesd-subscribe.h"
+#include "aesd-handoff.h"
+#include "aesd-compress.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 #define PORT "9000"  // the port users will be connecting to
 
-#define BACKLOG 10   // how many pending connections queue will hold
+#define BACKLOG 10   // how many pending connections queue will hold by default
 
-#ifndef USE_AESD_CHAR_DEVICE
-#define USE_AESD_CHAR_DEVICE 1
-#endif
+volatile int work_state = 1;
+volatile int drain_state = 0;
 
-#if !USE_AESD_CHAR_DEVICE
-#define FILEPATH "/var/tmp/aesdsocketdata"
-#else
-#define FILEPATH "/dev/aesdchar"
-#endif
+//int g_fd, g_sfd;//File descriptors for aesdsocketdata file, socket and connection
+int g_sfd = -1;//File descriptors for aesdsocketdata file, socket and connection
+struct server_config g_config = {
+	.mode = MODE_THREAD,
+	.batch = COMMIT_BATCH_DEFAULT,
+	.backend = BACKEND_STORAGE,
+	.backlog = BACKLOG,
+	.log_level = LOG_DEBUG,
+	.sub_queue = SUBSCRIBE_QUEUE_DEFAULT,
+	.sub_policy = SUBSCRIBE_DISCONNECT,
+	.segment_bytes = SEGMENT_BYTES_DEFAULT,
+	.retain_bytes = SEGMENT_RETAIN_DEFAULT,
+	.drain_s = DRAIN_DEFAULT_S,
+	.recv_chunk = BUFSIZE,
+	.readback_chunk = READBACK_CHUNK,
+	.channels = 1,
+	.compress_cache = COMPRESS_CACHE_DEFAULT,
+};
+static const char g_usage[] = "[-d] [-e | -p | -u] [-a] [-w workers] [-q backlog] [-L level] [-M metrics_endpoint]"
+	" [-C max_connections] [-m connection_bytes] [-I recv_timeout_s] [-O send_timeout_s] [-U unix_socket]"
+	" [-S subscriber_queue_bytes] [-D] [-b batch] [-l window_us] [-r packets] [-R bytes] [-k checkpoint]"
+	" [-G segment_dir] [-g segment_bytes] [-T retain_bytes] [-A retain_s] [-x drain_s] [-H handoff_socket]"
+	" [-i recv_chunk] [-c readback_chunk] [-V rcvbuf_bytes] [-W sndbuf_bytes] [-N] [-K] [-F defer_accept_s]"
+	" [-n channels] [-z compress_cache_bytes]";
+static thr_node* g_head = NULL; // live connection threads, owned by the accept loop
+static _Atomic(thr_node*) g_done = NULL; // finished connection threads waiting for reaping
+int g_timerfd = -1;
+int g_unixfd = -1;
+static atomic_int g_admitted = 0; // connections holding a -C slot
+static int g_wakefd = -1; // wakes up the accept loop of the thread and pool engines
+static int64_t g_drain_deadline = 0; // CLOCK_MONOTONIC milliseconds the drain ends at
 
-#define BUFSIZE 512
+static void kick_handler(int signo){
+	/* Only interrupts the blocking call of the thread */
+}
 
-volatile static int work_state = 1;
+/*
+ * Interrupts the connection threads so that the ones waiting between packets
+ * notice the drain. Returns 1 when every connection is finished or the
+ * deadline has passed
+ */
+static int drain_threads(){
+	reap_connections();
+	if(drain_expired() || (!g_head && !pool_busy())){
+		return 1;
+	}
+	/* Repeated, a thread may be kicked just before it blocks */
+	for(thr_node* node = g_head; node != NULL; node = node->next){
+		pthread_kill(node->thr, DRAIN_SIGNAL);
+	}
+	pool_kick();
+	return 0;
+}
 
-//int g_fd, g_sfd;//File descriptors for aesdsocketdata file, socket and connection
-int g_sfd;//File descriptors for aesdsocketdata file, socket and connection
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static thr_node* g_head = NULL;
-static timer_t g_timer;
+/*
+ * Applies -V, -W, -N and -F to a listener, its connections inherit them.
+ * The Unix listener takes the buffer sizes only
+ */
+static void tune_listener(int sockfd, int tcp){
+	int yes = 1;
+	if(g_config.rcvbuf && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &g_config.rcvbuf, sizeof(int))){
+		aesd_log(LOG_WARNING, "setsockopt SO_RCVBUF FAILED error:%s", strerror(errno));
+	}
+	if(g_config.sndbuf && setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &g_config.sndbuf, sizeof(int))){
+		aesd_log(LOG_WARNING, "setsockopt SO_SNDBUF FAILED error:%s", strerror(errno));
+	}
+	if(!tcp){
+		return;
+	}
+	if(g_config.nodelay && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int))){
+		aesd_log(LOG_WARNING, "setsockopt TCP_NODELAY FAILED error:%s", strerror(errno));
+	}
+	/* Connections are accepted once their first bytes arrive */
+	if(g_config.defer_accept && setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &g_config.defer_accept, sizeof(int))){
+		aesd_log(LOG_WARNING, "setsockopt TCP_DEFER_ACCEPT FAILED error:%s", strerror(errno));
+	}
+}
 
 int main(int argc, char** argv){    
 	openlog(NULL, LOG_CONS | LOG_PID, LOG_INFO);
-	syslog(LOG_INFO, "Initialise server");
+	aesd_log(LOG_INFO, "Initialise server");
 	
 	if(init_server(argc, argv)){
+		subscribe_stop();
+		metrics_stop();
+		log_stop();
 		closelog();
 		return -1;
 	}
@@ -67,25 +155,74 @@ int main(int argc, char** argv){
 	action.sa_flags = 0;
 	sigaction(SIGINT, &action, NULL);
 	sigaction(SIGTERM, &action, NULL);
+	/* Without SA_RESTART, so a kicked recv returns EINTR */
+	action.sa_handler = kick_handler;
+	sigaction(DRAIN_SIGNAL, &action, NULL);
+	/* sendfile and splice to a client which went away must fail with EPIPE, not kill the server */
+	action.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &action, NULL);
 	
 	
 	int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
   
-  g_sfd = init_socket();
+  /* Listeners taken over from the previous server keep their queued connections */
+  if(g_sfd == -1){
+  	g_sfd = init_listener();
+  }
+  else{
+  	/* Options of this run, connections already queued keep the previous ones */
+  	tune_listener(g_sfd, 1);
+  	if(g_unixfd != -1){
+  		tune_listener(g_unixfd, 0);
+  	}
+  	if(listen(g_sfd, g_config.backlog)){
+			aesd_log(LOG_WARNING, "listen FAILED error:%s", strerror(errno));
+  	}
+  }
   sockfd = g_sfd;
   
   if(sockfd == -1){
-		syslog(LOG_ERR, "init_socket FAILED");
+		subscribe_stop();
+		metrics_stop();
+		log_stop();
+		closelog();
+		return -1;
+  }
+  if(g_config.unix_path && g_unixfd == -1 && (g_unixfd = init_unix_listener()) == -1){
+		close(sockfd);
+		subscribe_stop();
+		metrics_stop();
+		log_stop();
+		closelog();
+		return -1;
+  }
+  if(g_config.handoff && handoff_start(g_config.handoff, sockfd, g_unixfd)){
+  	deinit();
 		closelog();
 		return -1;
   }
   
-	syslog(LOG_INFO, "Socked inited sockfd=%d", sockfd);
-	
-  if (listen(sockfd, BACKLOG)) {
-		syslog(LOG_ERR, "listen FAILED");
+  if(g_config.mode == MODE_EPOLL){
+  	if(reactor_run(sockfd, g_config.workers)){
+			aesd_log(LOG_ERR, "reactor_run FAILED");
+  	}
+  	deinit();
+  	exit (EXIT_SUCCESS);
+  }
+  
+  if(g_config.mode == MODE_URING){
+  	if(uring_run(sockfd)){
+			aesd_log(LOG_ERR, "uring_run FAILED");
+  	}
+  	deinit();
+  	exit (EXIT_SUCCESS);
+  }
+  
+  if(g_config.mode == MODE_POOL && pool_start(g_config.workers)){
+		aesd_log(LOG_ERR, "pool_start FAILED");
+		deinit();
 		closelog();
-    return -1;
+		return -1;
   }
   
   struct sockaddr_storage their_addr;
@@ -93,63 +230,198 @@ int main(int argc, char** argv){
 //  int fflags = O_RDWR | O_APPEND | O_CREAT | O_TRUNC;
   
 
-  thr_node* last = NULL;
+  g_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(g_wakefd == -1){
+		aesd_log(LOG_ERR, "eventfd FAILED error:%s", strerror(errno));
+  }
+  /* The accept loop also services the timestamp timer, poll skips the descriptors which are -1 */
+  struct pollfd pfds[4] = {{sockfd, POLLIN, 0}, {g_unixfd, POLLIN, 0}, {g_timerfd, POLLIN, 0}, {g_wakefd, POLLIN, 0}};
+  int listener = 0;
   while(work_state){
-  	syslog(LOG_INFO, "Wait for connection");
-    new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &addr_size);
+  	int timeout = -1;
+  	if(drain_state){
+  		/* The listeners stay open until exit, a successor may be accepting from them */
+  		pfds[0].fd = pfds[1].fd = -1;
+  		if(drain_threads()){
+  			break;
+  		}
+  		timeout = DRAIN_KICK_MS;
+  	}
+  	else{
+  		aesd_log(LOG_INFO, "Wait for connection");
+  	}
+  	if(poll(pfds, 4, timeout) == -1){
+  		if(errno == EINTR){
+  			continue;
+  		}
+			aesd_log(LOG_ERR, "poll FAILED error:%s", strerror(errno));
+			break;
+  	}
+  	if(pfds[3].revents & POLLIN){
+  		uint64_t val;
+  		if(read(g_wakefd, &val, sizeof(val)) == -1){
+  			/* Already consumed */
+  		}
+  		/* Finished threads wake the loop, an idle server frees them at once */
+  		reap_connections();
+  	}
+  	if(pfds[2].revents & POLLIN){
+  		timer_handler();
+  	}
+  	/* Listeners take turns when both are ready, so neither starves the other */
+  	if(!(pfds[listener].revents & POLLIN)){
+  		listener = !listener;
+  		if(!(pfds[listener].revents & POLLIN)){
+  			continue;
+  		}
+  	}
+    addr_size = sizeof their_addr;
+    new_fd = accept(pfds[listener].fd, (struct sockaddr *)&their_addr, &addr_size);
+    listener = !listener;
 		if(new_fd == -1){
-			syslog(LOG_INFO, "accept FAILED");
+			/* A listener taken over from the epoll engine is non-blocking */
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED){
+				continue;
+			}
+			aesd_log(LOG_INFO, "accept FAILED");
 			break;
 		}
-		syslog(LOG_INFO, "Socket accepted");
-		char* s = malloc(INET6_ADDRSTRLEN);
-    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr), s, INET6_ADDRSTRLEN);
-    syslog(LOG_INFO, "Accepted connection from %s; new_fd: %d", s, new_fd);
+		aesd_log(LOG_INFO, "Socket accepted");
+		/* Shed before anything is allocated for the connection */
+		if(admit_connection(new_fd)){
+			close(new_fd);
+			reap_connections();
+			continue;
+		}
+		/* Everything the connection keeps comes from one recycled arena */
+		struct arena* arena = arena_get();
+		if(!arena){
+			shed_connection(new_fd, BUSY_REPLY);
+			close(new_fd);
+			leave_connection();
+			continue;
+		}
+		struct proc_data * data = arena_alloc(arena, sizeof(struct proc_data));
+		char* s = arena_alloc(arena, INET6_ADDRSTRLEN);
+    peer_address(&their_addr, s);
+    aesd_log(LOG_INFO, "Accepted connection from %s; new_fd: %d", s, new_fd);
   	
-  	struct proc_data * data = malloc(sizeof(struct proc_data));
 //  	data->fd = fd;
   	data->sd = new_fd;
   	data->address = s;
-  	pthread_t thr;
-  	
-  	pthread_create(&thr, NULL, connection_processor, (void*)data);
+  	data->accepted = metrics_now();
+  	data->arena = arena;
+  	if(g_config.mode == MODE_POOL){
+  		if(pool_submit(data)){
+				aesd_log(LOG_WARNING, "Worker queue is full, rejected connection from %s", s);
+				shed_connection(new_fd, BUSY_REPLY);
+				close(new_fd);
+				leave_connection();
+				arena_put(arena);
+  		}
+  		continue;
+  	}
+  	thr_node* current = arena_alloc(arena, sizeof(thr_node));
+  	current->data = data;
+  	current->prev = NULL;
+  	current->next = g_head;
   	
-  	thr_node* current = malloc(sizeof(thr_node));
-  	current->thr = thr;
-  	current->next = NULL;
-  	if(g_head == NULL){
-  		g_head = current;
+  	if(pthread_create(&current->thr, NULL, connection_processor, (void*)current)){
+			aesd_log(LOG_ERR, "pthread_create FAILED");
+			shed_connection(new_fd, BUSY_REPLY);
+			close(new_fd);
+			leave_connection();
+			arena_put(arena);
+			continue;
   	}
-  	else{
-  		last->next = current;
+  	if(g_head != NULL){
+  		g_head->prev = current;
   	}
-		last = current;
+  	g_head = current;
+  	reap_connections();
   }
   deinit();
   exit (EXIT_SUCCESS);
 }
 
+void reap_connections(){
+	thr_node* current = atomic_exchange(&g_done, NULL);
+	while(current != NULL){
+		thr_node* next = current->done_next;
+		pthread_join(current->thr, NULL);
+		if(current->prev){
+			current->prev->next = current->next;
+		}
+		else{
+			g_head = current->next;
+		}
+		if(current->next){
+			current->next->prev = current->prev;
+		}
+		/* The node lives in the arena too */
+		arena_put(current->data->arena);
+		current = next;
+	}
+}
+
 void deinit(){
 	deinit_timer();
+	pool_stop();
+	reap_connections();
 	thr_node* current = g_head;
 	while(current != NULL){
-		struct proc_data* data;
-		pthread_join(current->thr, ((void**)&data));
-		
-		free(data->address);
-		close(data->sd);
-		free(data);
-		
+		kick_join(current->thr);
 		thr_node* next = current->next;
-		free(current);
+		arena_put(current->data->arena);
 		current = next;
 	}
+	g_head = NULL;
+	atomic_store(&g_done, NULL);
 	close(g_sfd);
+	subscribe_stop();
+	if(g_unixfd != -1){
+		close(g_unixfd);
+		g_unixfd = -1;
+		/* A successor serves the same socket */
+		if(!handoff_done()){
+			unlink(g_config.unix_path);
+		}
+	}
+	if(g_wakefd != -1){
+		close(g_wakefd);
+		g_wakefd = -1;
+	}
+	commit_stop();
+	ring_stop();
+	segment_stop();
+	compress_stop();
+	arena_drain();
 //	close(g_fd);
-	if(!USE_AESD_CHAR_DEVICE){
-		unlink(FILEPATH);
+	if(!USE_AESD_CHAR_DEVICE && g_config.backend == BACKEND_STORAGE && !handoff_done()){
+		char path[PATH_MAX];
+		for(int channel = 0; channel < g_config.channels; channel++){
+			channel_path(channel, path);
+			unlink(path);
+		}
+	}
+	metrics_stop();
+	/* Last, the successor waits for it to take the log and the metrics endpoint */
+	handoff_stop();
+	log_stop();
+}
+
+void kick_join(pthread_t thr){
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	while(1){
+		deadline.tv_nsec += DRAIN_KICK_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		if(pthread_timedjoin_np(thr, NULL, &deadline) != ETIMEDOUT){
+			break;
+		}
+		pthread_kill(thr, DRAIN_SIGNAL);
 	}
-	
 }
 
 int write_to_file(int fd, const char* buf, size_t n_byte){
@@ -157,7 +429,7 @@ int write_to_file(int fd, const char* buf, size_t n_byte){
 	while(work_state){
 		res = write(fd, buf + offset, length);
 		if(res == -1){
-  		syslog(LOG_ERR, "write FAILED error:%s", strerror(errno));
+  		aesd_log(LOG_ERR, "write FAILED error:%s", strerror(errno));
 			return -1;
 		}
 		offset += res;
@@ -169,12 +441,63 @@ int write_to_file(int fd, const char* buf, size_t n_byte){
 	return 0;
 }
 
+int admit_connection(int sd){
+	if(g_config.max_conns && atomic_fetch_add(&g_admitted, 1) >= g_config.max_conns){
+		atomic_fetch_sub(&g_admitted, 1);
+		shed_connection(sd, BUSY_REPLY);
+		return -1;
+	}
+	/* Blocking sockets only, the event engines check idle_expired instead */
+	if(g_config.recv_timeout){
+		struct timeval tv = {g_config.recv_timeout, 0};
+		if(setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))){
+			aesd_log(LOG_WARNING, "setsockopt SO_RCVTIMEO FAILED error:%s", strerror(errno));
+		}
+	}
+	if(g_config.send_timeout){
+		struct timeval tv = {g_config.send_timeout, 0};
+		if(setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))){
+			aesd_log(LOG_WARNING, "setsockopt SO_SNDTIMEO FAILED error:%s", strerror(errno));
+		}
+	}
+	return 0;
+}
+
+void leave_connection(){
+	if(g_config.max_conns){
+		atomic_fetch_sub(&g_admitted, 1);
+	}
+}
+
+void shed_connection(int sd, const char* reply){
+	metrics_add(METRIC_SHED, 1);
+	aesd_log(LOG_WARNING, "Shedding connection new_fd: %d, %s", sd, reply);
+	if(send(sd, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL) == -1){
+		/* The client is gone or not reading, it is closed anyway */
+	}
+}
+
+time_t idle_clock(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+int idle_expired(int sending, time_t active, time_t now){
+	int timeout = sending ? g_config.send_timeout : g_config.recv_timeout;
+	if(!timeout || now - active <= timeout){
+		return 0;
+	}
+	metrics_add(METRIC_TIMEOUTS, 1);
+	return 1;
+}
+
 int send_to_socket(int sockfd, char* buf, size_t n_byte){
 	int res, offset = 0, length = n_byte;
 	while(work_state){
 		res = send(sockfd, buf + offset, length, 0);
 		if(res == -1){
-  		syslog(LOG_ERR, "send FAILED");
+  		aesd_log(LOG_ERR, "send FAILED");
 			return -1;
 		}
 		offset += res;
@@ -186,37 +509,52 @@ int send_to_socket(int sockfd, char* buf, size_t n_byte){
 	return 0;
 }
 
-int send_from_file(int fd, int sockfd){
-	char buf[BUFSIZE];
-	int res, offset = 0; 
-		
-	while(work_state){
-		res = pread(fd, buf, BUFSIZE, offset);
-		if(res == -1){
-			syslog(LOG_ERR, "read FAILED");
-			return -1;
-		}
-		if(!res){
-			break;
-		}
-		if(send_to_socket(sockfd, buf, res)){
-			syslog(LOG_ERR, "send_to_socket FAILED");		
-			return -1;
-		}
-		offset += res;
+off_t send_from_file(int fd, int sockfd, off_t start, off_t limit, struct session* s){
+	struct readback rb;
+	int res;
+	readback_init(&rb, fd, start, limit, s->arena);
+	if(s->compress && readback_compress(&rb, s->channel)){
+		readback_deinit(&rb);
+		return -1;
 	}
-	return 0;
+	res = readback_send(&rb, sockfd);
+	readback_deinit(&rb);
+	if(res == READBACK_ABORTED){
+		/* The cursor stays, the client got only a part of the reply */
+		aesd_log(LOG_INFO, "Read-back cut short by the stop");
+		return -1;
+	}
+	if(res > 0){
+		/* A blocking socket would block only when SO_SNDTIMEO expired */
+		metrics_add(METRIC_TIMEOUTS, 1);
+		aesd_log(LOG_WARNING, "send timed out");
+		return -1;
+	}
+	if(res){
+		aesd_log(LOG_ERR, "readback_send FAILED");		
+		return -1;
+	}
+	return rb.off;
 }
 
 int parse_seek_to(char* buf, uint32_t* write_cmd, uint32_t* write_cmd_offset){
 	int32_t res;
-	buf = strtok(buf, ":");
-	res = strtol(strtok(NULL, ","), NULL, 10);
+	char *saveptr, *token;
+	buf = strtok_r(buf, ":", &saveptr);
+	token = strtok_r(NULL, ",", &saveptr);
+	if(!token){
+		return -1;
+	}
+	res = strtol(token, NULL, 10);
 	if(res < 0){
 		return -1;
 	}
 	*write_cmd = res;
-	res = strtol(strtok(NULL, "\n"), NULL, 10);
+	token = strtok_r(NULL, "\n", &saveptr);
+	if(!token){
+		return -1;
+	}
+	res = strtol(token, NULL, 10);
 	if(res < 0){
 		return -1;
 	}
@@ -224,57 +562,268 @@ int parse_seek_to(char* buf, uint32_t* write_cmd, uint32_t* write_cmd_offset){
 	return 0;
 }
 
-int recieve_to_file(int fd, int sockfd){
+/*
+ * Scratch buffer for scanning the regular-file log, NULL when the connection has no arena
+ */
+static char* scan_buffer(struct session* s){
+	return s->arena ? arena_scratch(s->arena) : NULL;
+}
+
+long apply_seek_to(struct session* s, int fd, char* buf){
+	struct aesd_seekto cmd;
+	aesd_log(LOG_INFO, "COMMAND founded! COMMAND:%s\n", buf);
+	if(parse_seek_to(buf, &cmd.write_cmd, &cmd.write_cmd_offset)){
+		aesd_log(LOG_INFO, "COMMAND parse FAILED\n");
+		return -1;
+	}
+	if(g_config.backend == BACKEND_RING){
+		return ring_find_record(cmd.write_cmd, cmd.write_cmd_offset);
+	}
+	if(g_config.backend == BACKEND_SEGMENT){
+		return segment_find_record(cmd.write_cmd, cmd.write_cmd_offset);
+	}
+	if(!USE_AESD_CHAR_DEVICE){
+		/* A regular file has no ioctl, the record is found by scanning the committed log */
+		off_t snapshot;
+		commit_packet(s->channel, NULL, 0, &snapshot);
+		return find_record_offset(fd, cmd.write_cmd, cmd.write_cmd_offset, snapshot, scan_buffer(s));
+	}
+	aesd_log(LOG_INFO, "COMMAND parsed! write_cmd:%d;write_cmd_offset:%d\n", cmd.write_cmd, cmd.write_cmd_offset);
+	long res = ioctl(fd, AESDCHAR_IOCSEEKTO, &cmd);
+	if(res < 0){
+		aesd_log(LOG_INFO, "IOCTL FAILED res:%ld\n", res);
+		return -1;
+	}
+	/* The driver returns the new file position */
+	return res;
+}
+
+off_t find_record_offset(int fd, uint32_t record, uint32_t offset, off_t limit, char* scratch){
+	char stack[BUFSIZE];
+	char* buf = scratch ? scratch : stack;
+	size_t size = scratch ? g_config.readback_chunk : BUFSIZE;
+	off_t pos = 0;
+	while(record && pos < limit){
+		size_t count = limit - pos < (off_t)size ? limit - pos : size;
+		ssize_t res = pread(fd, buf, count, pos);
+		if(res <= 0){
+			return -1;
+		}
+		char *cur = buf, *nl;
+		while(record && (nl = memchr(cur, '\n', buf + res - cur)) != NULL){
+			record--;
+			cur = nl + 1;
+		}
+		pos += record ? res : cur - buf;
+	}
+	if(record || pos + offset > limit){
+		return -1;
+	}
+	return pos + offset;
+}
+
+int apply_since(struct session* s, int fd, char* arg, off_t* start){
+	char *end;
+	if(*arg == '\n' || *arg == '\0'){
+		*start = s->cursor;
+		return 0;
+	}
+	unsigned long first = strtoul(arg, &end, 10);
+	if(end == arg){
+		return -1;
+	}
+	if(*end != ','){
+		/* Byte offset */
+		*start = first;
+		return 0;
+	}
+	/* Record and offset within it, like AESDCHAR_IOCSEEKTO */
+	unsigned long second = strtoul(end + 1, NULL, 10);
+	if(g_config.backend != BACKEND_STORAGE){
+		*start = g_config.backend == BACKEND_RING ? ring_find_record(first, second) : segment_find_record(first, second);
+		return *start < 0 ? -1 : 0;
+	}
+	if(USE_AESD_CHAR_DEVICE){
+		struct aesd_seekto cmd = {first, second};
+		long res = ioctl(fd, AESDCHAR_IOCSEEKTO, &cmd);
+		if(res < 0){
+			aesd_log(LOG_INFO, "IOCTL FAILED res:%ld\n", res);
+			return -1;
+		}
+		*start = res;
+		return 0;
+	}
+	off_t snapshot;
+	commit_packet(s->channel, NULL, 0, &snapshot);
+	*start = find_record_offset(fd, first, second, snapshot, scan_buffer(s));
+	return *start < 0 ? -1 : 0;
+}
+
+void channel_path(int channel, char* path){
+	if(!channel){
+		strcpy(path, FILEPATH);
+		return;
+	}
+	snprintf(path, PATH_MAX, "%s%d", FILEPATH, channel);
+}
+
+int apply_channel(struct session* s, char* arg){
+	char* end;
+	long channel = strtol(arg, &end, 10);
+	if(end == arg || channel < 0 || channel >= g_config.channels){
+		aesd_log(LOG_WARNING, "No channel %s", arg);
+		return -1;
+	}
+	int fd = open_backend(channel);
+	if(fd != -1){
+		s->channel = channel;
+	}
+	return fd;
+}
+
+int process_packet(struct session* s, int fd, struct frame* f, off_t* start, off_t* end){
+	int res = 0;
+	char saved = f->data[f->len];
+	f->data[f->len] = '\0';
+	if(f->kind == FRAME_SEEK){
+		long pos = apply_seek_to(s, fd, f->data);
+		*start = pos;
+		*end = -1;
+		res = pos < 0 ? -1 : 0;
+	}
+	else if(f->kind == FRAME_SINCE){
+		aesd_log(LOG_INFO, "COMMAND founded! COMMAND:%s\n", f->data);
+		res = apply_since(s, fd, f->data + sizeof(SINCE_COMMAND) - 1, start);
+		if(!res){
+			s->incremental = 1;
+			commit_packet(s->channel, NULL, 0, end);
+		}
+	}
+	else if(f->kind == FRAME_SUBSCRIBE){
+		aesd_log(LOG_INFO, "COMMAND founded! COMMAND:%s\n", f->data);
+		char* arg = f->data + sizeof(SUBSCRIBE_COMMAND) - 1;
+		/* Without an argument only the packets committed from now on are pushed */
+		*start = -1;
+		*end = -1;
+		if(s->channel){
+			/* The stream carries the default log only */
+			aesd_log(LOG_WARNING, "Subscription to channel %d refused", s->channel);
+			res = -1;
+		}
+		else if(*arg != '\n' && *arg != '\0'){
+			res = apply_since(s, fd, arg, start);
+		}
+		if(!res){
+			res = PACKET_SUBSCRIBED;
+		}
+	}
+	else if(f->kind == FRAME_CHANNEL){
+		aesd_log(LOG_INFO, "COMMAND founded! COMMAND:%s\n", f->data);
+		s->channel_fd = apply_channel(s, f->data + sizeof(CHANNEL_COMMAND) - 1);
+		if(s->channel_fd == -1){
+			res = -1;
+		}
+		else{
+			/* Offsets of the previous channel mean nothing in this one */
+			s->cursor = 0;
+			*start = 0;
+			commit_packet(s->channel, NULL, 0, end);
+			res = PACKET_CHANNEL;
+		}
+	}
+	else if(f->kind == FRAME_COMPRESS){
+		aesd_log(LOG_INFO, "COMMAND founded! COMMAND:%s\n", f->data);
+		s->compress = 1;
+		*start = s->incremental ? s->cursor : 0;
+		commit_packet(s->channel, NULL, 0, end);
+	}
+	else{
+		res = commit_packet(s->channel, f->data, f->len, end);
+		if(res){
+			aesd_log(LOG_ERR, "commit_packet FAILED");
+		}
+		*start = s->incremental ? s->cursor : 0;
+	}
+	f->data[f->len] = saved;
+	return res;
+}
+
+int open_backend(int channel){
+	if(g_config.backend == BACKEND_RING){
+		return ring_open();
+	}
+	if(g_config.backend == BACKEND_SEGMENT){
+		return segment_open();
+	}
+	char path[PATH_MAX];
+	channel_path(channel, path);
+	int fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0666);
+	if(fd == -1){
+		aesd_log(LOG_ERR, "open of %s FAILED error:%s", path, strerror(errno));
+	}
+	return fd;
+}
+
+int recieve_to_file(int* fd, int sockfd, struct framer* fr, struct session* s, off_t* start, off_t* end){
 
   int res; 
-  char buf[BUFSIZE];
-  char *start_cursor;
-	int flags = 0;
-//	char lastChar;
+  struct frame f;
+  char* space;
+  size_t avail;
   
+  /* The packet is collected privately, the log is locked only to append it */
   while(work_state){
-    res = recv(sockfd, buf, BUFSIZE, flags);
-    flags = MSG_DONTWAIT;
+  	if(framer_next(fr, &f)){
+			res = process_packet(s, *fd, &f, start, end);
+			if(res == PACKET_CHANNEL){
+				close(*fd);
+				*fd = s->channel_fd;
+				res = 0;
+			}
+			return res;
+  	}
+  	if(framer_done(fr)){
+  		return 1;
+  	}
+  	/* A draining server lets the client go once every packet is answered */
+  	if(drain_ready(fr)){
+  		return 1;
+  	}
+  	space = framer_reserve(fr, g_config.recv_chunk, &avail);
+  	if(!space){
+  		if(errno == EMSGSIZE){
+  			shed_connection(sockfd, OVERSIZE_REPLY);
+  			return -1;
+  		}
+			aesd_log(LOG_ERR, "framer_reserve FAILED");
+			return -1;
+  	}
+    res = recv(sockfd, space, avail, 0);
     if(res == -1){
+    	if(errno == EINTR){
+    		continue;
+    	}
     	if(errno == EAGAIN || errno == EWOULDBLOCK){
-    		break;
+    		/* SO_RCVTIMEO expired */
+    		metrics_add(METRIC_TIMEOUTS, 1);
+    		aesd_log(LOG_WARNING, "recv timed out");
+    		return -1;
     	}
-  		syslog(LOG_ERR, "recv FAILED");
-  		syslog(LOG_ERR, "recv FAILED error:%s", strerror(errno));
+  		aesd_log(LOG_ERR, "recv FAILED error:%s", strerror(errno));
 		  return -1;
     }
-    if(res == 0){
-    	break;
-    }
-//    lastChar = buf[res - 1];
-		start_cursor = strstr(buf, "AESDCHAR_IOCSEEKTO:");
-		if(start_cursor){
-			syslog(LOG_INFO, "COMMAND founded! COMMAND:%s\n", buf);
-			struct aesd_seekto cmd;
-			if(!parse_seek_to(buf, &cmd.write_cmd, &cmd.write_cmd_offset)){
-				syslog(LOG_INFO, "COMMAND parsed! write_cmd:%d;write_cmd_offset:%d\n", cmd.write_cmd, cmd.write_cmd_offset);
-				res = ioctl(fd, AESDCHAR_IOCSEEKTO, &cmd);
-				if(res < 0){
-					syslog(LOG_INFO, "IOCTL FAILED res:%d\n", res);
-					return -1;
-				}
-				return 0;
-			}
-		}
-  	res = write_to_file(fd, buf, res);
-  	if(res){
-			syslog(LOG_ERR, "write_to_file FAILED");
-    	return -1;
-  	}
+    framer_commit(fr, res);
   }
-  /*if(lastChar != '\n'){
-  	res = write_to_file(fd, "\n", res);
-  	if(res){
-			syslog(LOG_ERR, "write_to_file FAILED");
-    	return -1;
-  	}
-  }*/
-  return 0;
+  return -1;
+}
+
+void peer_address(struct sockaddr_storage* sa, char* s){
+	if(sa->ss_family == AF_UNIX){
+		/* Clients of the Unix listener are unnamed */
+		strcpy(s, "unix");
+		return;
+	}
+	inet_ntop(sa->ss_family, get_in_addr((struct sockaddr *)sa), s, INET6_ADDRSTRLEN);
 }
 
 // get sockaddr, IPv4 or IPv6:
@@ -288,27 +837,259 @@ void *get_in_addr(struct sockaddr *sa)
 }
 
 int init_server(int argc, char** argv){
-	if(argc >= 2){
-		syslog(LOG_INFO, "Daemon mode");
-		if(!strcmp(argv[1], "-d")){
-			pid_t pid;
-			pid = fork();
-			if(pid == -1){
-				syslog(LOG_ERR, "fork FAILED");
+	int opt;
+	while((opt = getopt(argc, argv, "depuaDNKw:b:l:r:R:k:q:L:M:C:m:I:O:U:S:G:g:T:A:x:H:i:c:V:W:F:n:z:")) != -1){
+		switch(opt){
+			case 'd':
+				g_config.daemon = 1;
+				break;
+			case 'e':
+				g_config.mode = MODE_EPOLL;
+				break;
+			case 'p':
+				g_config.mode = MODE_POOL;
+				break;
+			case 'u':
+				g_config.mode = MODE_URING;
+				break;
+			case 'a':
+				g_config.reuseport = 1;
+				break;
+			case 'w':
+				g_config.workers = atoi(optarg);
+				if(g_config.workers <= 0){
+					aesd_log(LOG_ERR, "Invalid worker count %s", optarg);
+					return -1;
+				}
+				break;
+			case 'b':
+				g_config.batch = atoi(optarg);
+				if(g_config.batch <= 0){
+					aesd_log(LOG_ERR, "Invalid batch size %s", optarg);
+					return -1;
+				}
+				break;
+			case 'l':
+				g_config.latency_us = atol(optarg);
+				if(g_config.latency_us < 0){
+					aesd_log(LOG_ERR, "Invalid batch window %s", optarg);
+					return -1;
+				}
+				break;
+			case 'r':
+				g_config.backend = BACKEND_RING;
+				g_config.ring_packets = atol(optarg);
+				if(g_config.ring_packets < 0){
+					aesd_log(LOG_ERR, "Invalid ring packet count %s", optarg);
+					return -1;
+				}
+				break;
+			case 'R':
+				g_config.backend = BACKEND_RING;
+				g_config.ring_bytes = strtoul(optarg, NULL, 10);
+				if(!g_config.ring_bytes){
+					aesd_log(LOG_ERR, "Invalid ring size %s", optarg);
+					return -1;
+				}
+				break;
+			case 'k':
+				g_config.checkpoint = optarg;
+				break;
+			case 'G':
+				g_config.backend = BACKEND_SEGMENT;
+				g_config.segment_dir = optarg;
+				break;
+			case 'g':
+				g_config.segment_bytes = strtoul(optarg, NULL, 10);
+				if(g_config.segment_bytes < BUFSIZE){
+					aesd_log(LOG_ERR, "Invalid segment size %s, at least %d bytes", optarg, BUFSIZE);
+					return -1;
+				}
+				break;
+			case 'T':
+				g_config.retain_bytes = strtoul(optarg, NULL, 10);
+				if(!g_config.retain_bytes){
+					aesd_log(LOG_ERR, "Invalid retained size %s", optarg);
+					return -1;
+				}
+				break;
+			case 'A':
+				g_config.retain_s = atol(optarg);
+				if(g_config.retain_s <= 0){
+					aesd_log(LOG_ERR, "Invalid retention age %s", optarg);
+					return -1;
+				}
+				break;
+			case 'L':
+				g_config.log_level = atoi(optarg);
+				if(g_config.log_level < LOG_EMERG || g_config.log_level > LOG_DEBUG){
+					aesd_log(LOG_ERR, "Invalid log level %s", optarg);
+					return -1;
+				}
+				break;
+			case 'M':
+				g_config.metrics = optarg;
+				break;
+			case 'C':
+				g_config.max_conns = atoi(optarg);
+				if(g_config.max_conns <= 0){
+					aesd_log(LOG_ERR, "Invalid connection limit %s", optarg);
+					return -1;
+				}
+				break;
+			case 'm':
+				g_config.conn_memory = strtoul(optarg, NULL, 10);
+				if(g_config.conn_memory < CONN_MEMORY_MIN){
+					aesd_log(LOG_ERR, "Invalid connection memory limit %s, at least %d bytes", optarg, CONN_MEMORY_MIN);
+					return -1;
+				}
+				break;
+			case 'I':
+				g_config.recv_timeout = atoi(optarg);
+				if(g_config.recv_timeout <= 0){
+					aesd_log(LOG_ERR, "Invalid receive timeout %s", optarg);
+					return -1;
+				}
+				break;
+			case 'O':
+				g_config.send_timeout = atoi(optarg);
+				if(g_config.send_timeout <= 0){
+					aesd_log(LOG_ERR, "Invalid send timeout %s", optarg);
+					return -1;
+				}
+				break;
+			case 'U':
+				g_config.unix_path = optarg;
+				break;
+			case 'S':
+				g_config.sub_queue = strtoul(optarg, NULL, 10);
+				if(g_config.sub_queue < BUFSIZE){
+					aesd_log(LOG_ERR, "Invalid subscriber queue size %s, at least %d bytes", optarg, BUFSIZE);
+					return -1;
+				}
+				break;
+			case 'D':
+				g_config.sub_policy = SUBSCRIBE_DROP;
+				break;
+			case 'x':
+				g_config.drain_s = atoi(optarg);
+				if(g_config.drain_s < 0){
+					aesd_log(LOG_ERR, "Invalid drain deadline %s", optarg);
+					return -1;
+				}
+				break;
+			case 'H':
+				g_config.handoff = optarg;
+				break;
+			case 'i':
+				g_config.recv_chunk = strtoul(optarg, NULL, 10);
+				if(g_config.recv_chunk < BUFSIZE || g_config.recv_chunk > CHUNK_MAX){
+					aesd_log(LOG_ERR, "Invalid receive chunk %s, %d to %d bytes", optarg, BUFSIZE, CHUNK_MAX);
+					return -1;
+				}
+				break;
+			case 'c':
+				g_config.readback_chunk = strtoul(optarg, NULL, 10);
+				if(g_config.readback_chunk < BUFSIZE || g_config.readback_chunk > CHUNK_MAX){
+					aesd_log(LOG_ERR, "Invalid read-back chunk %s, %d to %d bytes", optarg, BUFSIZE, CHUNK_MAX);
+					return -1;
+				}
+				break;
+			case 'V':
+				g_config.rcvbuf = atoi(optarg);
+				if(g_config.rcvbuf <= 0){
+					aesd_log(LOG_ERR, "Invalid receive buffer size %s", optarg);
+					return -1;
+				}
+				break;
+			case 'W':
+				g_config.sndbuf = atoi(optarg);
+				if(g_config.sndbuf <= 0){
+					aesd_log(LOG_ERR, "Invalid send buffer size %s", optarg);
+					return -1;
+				}
+				break;
+			case 'N':
+				g_config.nodelay = 1;
+				break;
+			case 'K':
+				g_config.cork = 1;
+				break;
+			case 'F':
+				g_config.defer_accept = atoi(optarg);
+				if(g_config.defer_accept <= 0){
+					aesd_log(LOG_ERR, "Invalid deferred accept timeout %s", optarg);
+					return -1;
+				}
+				break;
+			case 'n':
+				g_config.channels = atoi(optarg);
+				if(g_config.channels <= 0 || g_config.channels > CHANNEL_MAX){
+					aesd_log(LOG_ERR, "Invalid channel count %s, 1 to %d", optarg, CHANNEL_MAX);
+					return -1;
+				}
+				break;
+			case 'z':
+				/* 0 turns the cache off, every compressed read-back compresses */
+				g_config.compress_cache = strtoul(optarg, NULL, 10);
+				break;
+			case 'q':
+				g_config.backlog = atoi(optarg);
+				if(g_config.backlog <= 0){
+					aesd_log(LOG_ERR, "Invalid backlog %s", optarg);
+					return -1;
+				}
+				break;
+			default:
+				aesd_log(LOG_ERR, "Usage: %s %s", argv[0], g_usage);
+				fprintf(stderr, "Usage: %s %s\n", argv[0], g_usage);
 				return -1;
-			}		
-			if(pid){
-				syslog(LOG_INFO, "Daemon started with PID = %d", pid);
-				closelog();
-				exit(EXIT_SUCCESS);
-			}
+		}
+	}
+	/* Per-core listeners are served by reactors, each accepting from its own listener */
+	if(g_config.reuseport){
+		if(g_config.mode != MODE_THREAD && g_config.mode != MODE_EPOLL){
+			aesd_log(LOG_ERR, "-a is supported by the epoll engine only");
+			fprintf(stderr, "-a is supported by the epoll engine only\n");
+			return -1;
+		}
+		g_config.mode = MODE_EPOLL;
+	}
+	/* The ring and the segments are one log each */
+	if(g_config.channels > 1 && g_config.backend != BACKEND_STORAGE){
+		aesd_log(LOG_ERR, "-n is supported by the storage backend only");
+		fprintf(stderr, "-n is supported by the storage backend only\n");
+		return -1;
+	}
+	/* A receive chunk larger than the limit would be refused before the first byte */
+	if(g_config.conn_memory && g_config.recv_chunk > g_config.conn_memory){
+		aesd_log(LOG_ERR, "Receive chunk %zu exceeds the connection memory limit %zu", g_config.recv_chunk, g_config.conn_memory);
+		fprintf(stderr, "-i must not exceed -m\n");
+		return -1;
+	}
+	if(!g_config.workers){
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		g_config.workers = cpus > 0 ? cpus : 1;
+	}
+	if(g_config.daemon){
+		aesd_log(LOG_INFO, "Daemon mode");
+		pid_t pid;
+		pid = fork();
+		if(pid == -1){
+			aesd_log(LOG_ERR, "fork FAILED");
+			return -1;
+		}		
+		if(pid){
+			aesd_log(LOG_INFO, "Daemon started with PID = %d", pid);
+			closelog();
+			exit(EXIT_SUCCESS);
 		}
 		if(setsid() == -1){
-			syslog(LOG_ERR, "setsid FAILED");
+			aesd_log(LOG_ERR, "setsid FAILED");
 			return -1;
 		}
 		if(chdir("/") == -1){
-			syslog(LOG_ERR, "chdir FAILED");
+			aesd_log(LOG_ERR, "chdir FAILED");
 			return -1;
 		}
 		for (int i = 0; i < 3; i++){
@@ -319,97 +1100,304 @@ int init_server(int argc, char** argv){
 		dup (0); /* stderror */
 	}
 	else{
-		syslog(LOG_INFO, "Proces mode");
+		aesd_log(LOG_INFO, "Proces mode");
+	}
+	/* After the fork, the writer thread would not survive it */
+	if(log_start(g_config.log_level)){
+		return -1;
+	}
+	/* A running server hands its listeners over and is waited for, its log is continued */
+	int taken = 0;
+	if(g_config.handoff){
+		int res = handoff_receive(g_config.handoff, &g_sfd, &g_unixfd);
+		if(res < 0){
+			return -1;
+		}
+		taken = !res;
+		if(taken && g_unixfd != -1 && !g_config.unix_path){
+			close(g_unixfd);
+			g_unixfd = -1;
+		}
+	}
+	if(g_config.metrics && metrics_start(g_config.metrics)){
+		return -1;
+	}
+	if(g_config.backend == BACKEND_RING){
+		if(!g_config.ring_bytes){
+			g_config.ring_bytes = RING_DEFAULT_BYTES;
+		}
+		if(ring_start(g_config.ring_packets, g_config.ring_bytes, g_config.checkpoint)){
+			return -1;
+		}
+	}
+	/* Segments persist across runs, the log continues after the retained ones */
+	else if(g_config.backend == BACKEND_SEGMENT && segment_start(g_config.segment_dir, g_config.segment_bytes,
+			g_config.retain_bytes, g_config.retain_s)){
+		return -1;
+	}
+	/* The log is shared by every connection, so it is cleared once per server run */
+	else if(commit_start(g_config.batch, g_config.latency_us, !USE_AESD_CHAR_DEVICE && !taken)){
+		return -1;
+	}
+	/* Subscribers are streamed from the end of a continued log */
+	off_t end = 0;
+	if(g_config.backend == BACKEND_SEGMENT){
+		end = segment_end();
+	}
+	else if(commit_packet(0, NULL, 0, &end) || end < 0){
+		end = 0;
+	}
+	if(subscribe_start(g_config.sub_queue, g_config.sub_policy, end)){
+		return -1;
+	}
+	if(compress_start(g_config.compress_cache)){
+		return -1;
 	}
 	init_timer();
 	return 0;
 }
 
-int init_socket(){
-	struct addrinfo hints, *servinfo, *p;
-  
-  int yes=1, sockfd;
-  
-//	hints.ai_family = AF_UNSPEC;
-	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-
-
-  if (getaddrinfo(NULL, PORT, &hints, &servinfo)) {
-  	syslog(LOG_ERR, "getaddrinfo FAILED");
-		return -1;
-  }
+/*
+ * Opens and binds a socket of the given family from the getaddrinfo results.
+ * Returns the socket descriptor, -1 if none could be bound, -2 on error
+ */
+static int bind_family(struct addrinfo* servinfo, int family){
+	struct addrinfo* p;
+  int yes=1, no=0, sockfd;
   
   for(p = servinfo; p != NULL; p = p->ai_next) {
-  	if(p->ai_family != AF_INET){
+  	if(p->ai_family != family){
   		continue;
   	}
-    syslog(LOG_INFO, "Try to get socket p->ai_family %d; p->ai_socktype %d; p->ai_protocol %d", p->ai_family, p->ai_socktype,	p->ai_protocol);
+    aesd_log(LOG_INFO, "Try to get socket p->ai_family %d; p->ai_socktype %d; p->ai_protocol %d", p->ai_family, p->ai_socktype,	p->ai_protocol);
 	  sockfd = socket(p->ai_family, p->ai_socktype,	p->ai_protocol);
     if (sockfd == -1) {
-	  	syslog(LOG_WARNING, "socket FAILED");
+	  	aesd_log(LOG_WARNING, "socket FAILED");
 	    continue;
 	  }
 		
 	  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int))) {
-			syslog(LOG_ERR, "setsockopt FAILED");
-			return -1;
+			aesd_log(LOG_ERR, "setsockopt FAILED");
+			close(sockfd);
+			return -2;
+	  }
+	  /* Dual-stack regardless of net.ipv6.bindv6only */
+	  if (family == AF_INET6 && setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(int))) {
+			aesd_log(LOG_WARNING, "setsockopt IPV6_V6ONLY FAILED error:%s", strerror(errno));
+	  }
+	  /* Every listener of the group must set it before bind */
+	  if (g_config.reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int))) {
+			aesd_log(LOG_ERR, "setsockopt SO_REUSEPORT FAILED error:%s", strerror(errno));
+			close(sockfd);
+			return -2;
 	  }
+	  /* Before listen, the window scale of the connections follows SO_RCVBUF */
+	  tune_listener(sockfd, 1);
 
     if (bind(sockfd, p->ai_addr, p->ai_addrlen)) {
 			close(sockfd);
-			syslog(LOG_WARNING, "bind FAILED");
+			aesd_log(LOG_WARNING, "bind FAILED");
       continue;
     }
 
-    break;
+    return sockfd;
 	}
+	return -1;
+}
+
+int init_socket(){
+	struct addrinfo hints, *servinfo;
+  int sockfd;
+  
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+
+  if (getaddrinfo(NULL, PORT, &hints, &servinfo)) {
+  	aesd_log(LOG_ERR, "getaddrinfo FAILED");
+		return -1;
+  }
+  
+  /* The IPv6 wildcard also takes IPv4 clients, IPv4 alone is the fallback */
+  sockfd = bind_family(servinfo, AF_INET6);
+  if (sockfd == -1) {
+  	sockfd = bind_family(servinfo, AF_INET);
+  }
 	
 	freeaddrinfo(servinfo);
 	
-	if (p == NULL)  {
-		syslog(LOG_ERR, "No one socket are opened");
+	if (sockfd < 0)  {
+		aesd_log(LOG_ERR, "No one socket are opened");
 		return -1;
   }
-  syslog(LOG_INFO, "Socket recieved");
+  aesd_log(LOG_INFO, "Socket recieved");
   return sockfd;
 }
 
+int init_unix_listener(){
+	struct sockaddr_un addr;
+	if(strlen(g_config.unix_path) >= sizeof(addr.sun_path)){
+		aesd_log(LOG_ERR, "Unix socket path %s is too long", g_config.unix_path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, g_config.unix_path);
+	int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sockfd == -1){
+		aesd_log(LOG_ERR, "socket FAILED error:%s", strerror(errno));
+		return -1;
+	}
+	/* A stale socket of a previous run would fail the bind, other files are left alone */
+	struct stat st;
+	if(!lstat(g_config.unix_path, &st) && S_ISSOCK(st.st_mode)){
+		unlink(g_config.unix_path);
+	}
+	tune_listener(sockfd, 0);
+	if(bind(sockfd, (struct sockaddr*)&addr, sizeof(addr))){
+		aesd_log(LOG_ERR, "bind of %s FAILED error:%s", g_config.unix_path, strerror(errno));
+		close(sockfd);
+		return -1;
+	}
+	/* Local producers of any user may connect, like to the TCP port */
+	if(chmod(g_config.unix_path, 0666)){
+		aesd_log(LOG_WARNING, "chmod FAILED error:%s", strerror(errno));
+	}
+	if(listen(sockfd, g_config.backlog)){
+		aesd_log(LOG_ERR, "listen FAILED error:%s", strerror(errno));
+		close(sockfd);
+		unlink(g_config.unix_path);
+		return -1;
+	}
+	aesd_log(LOG_INFO, "Listening on %s", g_config.unix_path);
+	return sockfd;
+}
+
+int init_listener(){
+	int sockfd = init_socket();
+	if(sockfd == -1){
+		aesd_log(LOG_ERR, "init_socket FAILED");
+		return -1;
+	}
+	aesd_log(LOG_INFO, "Socked inited sockfd=%d", sockfd);
+	/* The kernel silently caps the backlog at net.core.somaxconn */
+	if(listen(sockfd, g_config.backlog)){
+		aesd_log(LOG_ERR, "listen FAILED error:%s", strerror(errno));
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+/*
+ * Async-signal-safe, called from the signal handler
+ */
+static void wake_engines(){
+	uint64_t one = 1;
+	if(g_wakefd != -1 && write(g_wakefd, &one, sizeof(one)) == -1){
+		/* Counter is already non-zero, the accept loop is being woken */
+	}
+	reactor_wakeup();
+	uring_wakeup();
+}
+
 void signal_handler(int signo){
-	syslog(LOG_INFO, "Caught signal, exiting");
-	work_state = 0;
-	close(g_sfd);
+	static volatile sig_atomic_t caught = 0;
+	/* Not through the log ring, the handler may interrupt its owner */
+	if(caught++ || !g_config.drain_s){
+		/* A second signal does not wait for the deadline */
+		syslog(LOG_INFO, "Caught signal, exiting");
+		work_state = 0;
+		wake_engines();
+		return;
+	}
+	syslog(LOG_INFO, "Caught signal, draining");
+	start_drain();
 }
 
-void* connection_processor(void* arg){
-	struct proc_data* data = (struct proc_data*)arg;
+void start_drain(){
+	if(!drain_state){
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		g_drain_deadline = (now.tv_sec + (int64_t)g_config.drain_s) * 1000 + now.tv_nsec / 1000000;
+		drain_state = 1;
+	}
+	wake_engines();
+}
+
+int drain_expired(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(now.tv_sec * (int64_t)1000 + now.tv_nsec / 1000000 < g_drain_deadline){
+		return 0;
+	}
+	if(work_state){
+		aesd_log(LOG_WARNING, "Drain deadline passed, closing the remaining connections");
+		work_state = 0;
+		wake_engines();
+	}
+	return 1;
+}
+
+int drain_ready(const struct framer* fr){
+	return drain_state && fr->started && !framer_pending(fr);
+}
+
+int process_connection(struct proc_data* data){
 	int fd;
-	int fflags = O_RDWR | O_APPEND | O_CREAT | O_TRUNC;
-  fd = open(FILEPATH, fflags, 0666);
+  fd = open_backend(0);
   if(fd == -1){
-		syslog(LOG_ERR, "open FAILED error:%s", strerror(errno));
-	  return arg;
+	  return -1;
 	}
-	pthread_mutex_lock(&mutex);
-	int res = recieve_to_file(fd, data->sd);
-	pthread_mutex_unlock(&mutex);
-	
-  if(res || !work_state){
-		close(data->sd);
-		close(fd);
-		pthread_exit(arg);
-	}	
-	
-	pthread_mutex_lock(&mutex);
-	send_from_file(fd, data->sd);
-	pthread_mutex_unlock(&mutex);
+	struct session session = {0, 0, data->arena};
+	struct framer fr;
+	off_t start, end;
+	int res;
+	size_t cap;
+	/* The rest of the arena is the framing buffer, one byte is kept for the terminator */
+	char* buf = arena_rest(data->arena, ARENA_BYTES, &cap);
+	framer_init_lent(&fr, buf, cap ? cap - 1 : 0);
+	/* Time spent queued for a worker is part of the wait for the first byte */
+	fr.mark = data->accepted;
+	metrics_add(METRIC_ACCEPTED, 1);
+	/* Packets of a persistent connection are committed and answered in order */
+	while((res = recieve_to_file(&fd, data->sd, &fr, &session, &start, &end)) == 0 && work_state){
+		/* Appends never touch committed bytes, so the snapshot is read without the lock */
+		off_t sent = send_from_file(fd, data->sd, start, end, &session);
+		if(sent < 0){
+			res = -1;
+			break;
+		}
+		session.cursor = sent;
+	}
+	if(res == PACKET_SUBSCRIBED){
+		/* The caller closes its descriptor, the subscription keeps a duplicate */
+		res = subscribe_add(data->sd, start);
+	}
+	framer_deinit(&fr);
 	close(fd);
-//	close(data->sd);
-  syslog(LOG_INFO, "Closed connection from %s", data->address);
-  return arg;
-//	pthread_exit(arg);
+	metrics_add(METRIC_CLOSED, 1);
+  aesd_log(LOG_INFO, "Closed connection from %s", data->address);
+  return res < 0 ? -1 : 0;
+}
+
+void* connection_processor(void* arg){
+	thr_node* node = (thr_node*)arg;
+	process_connection(node->data);
+	close(node->data->sd);
+	leave_connection();
+	/* Hand the node over to the accept loop for joining and freeing */
+	thr_node* head = atomic_load(&g_done);
+	do{
+		node->done_next = head;
+	} while(!atomic_compare_exchange_weak(&g_done, &head, node));
+	uint64_t one = 1;
+	if(write(g_wakefd, &one, sizeof(one)) == -1){
+		/* Counter is already non-zero, the accept loop is being woken */
+	}
+  return node->data;
 }
 
 void init_timer(){
@@ -417,13 +1405,11 @@ void init_timer(){
 	{
 		return;
 	}
-	struct sigevent event;
-	memset(&event, 0, sizeof(struct sigevent));
-	event.sigev_notify = SIGEV_THREAD;
-	event.sigev_notify_function = &timer_handler;
-	event.sigev_value.sival_ptr = &g_timer;
-	int res = timer_create(CLOCK_REALTIME, &event, &g_timer);
-	syslog(LOG_INFO, "Timer reated with res %d", res);
+	g_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(g_timerfd == -1){
+		aesd_log(LOG_ERR, "timerfd_create FAILED error:%s", strerror(errno));
+		return;
+	}
 	struct timespec spec;
 	memset(&spec, 0, sizeof(struct timespec));
 	spec.tv_sec = 10;
@@ -431,41 +1417,39 @@ void init_timer(){
 	struct itimerspec set;
 	set.it_interval = spec;
 	set.it_value = spec;
-	res = timer_settime(g_timer, 0, &set, NULL);
-	syslog(LOG_INFO, "Timer setted with res %d", res);
+	int res = timerfd_settime(g_timerfd, 0, &set, NULL);
+	aesd_log(LOG_INFO, "Timer setted with res %d", res);
 }
 void deinit_timer(){
-	if(USE_AESD_CHAR_DEVICE)
-	{
-		return;
+	if(g_timerfd != -1){
+		close(g_timerfd);
+		g_timerfd = -1;
 	}
-	struct itimerspec set;
-	memset(&set, 0, sizeof(	struct itimerspec));
-	timer_settime(g_timer, 0, &set, NULL);
 }
 
-void timer_handler(sigval_t val){
-	if(USE_AESD_CHAR_DEVICE)
-	{
-		return;
+const char* timestamp_packet(size_t* len){
+	static char str_time[50];
+	static size_t str_size;
+	static time_t rendered = -1;
+	time_t now = time(NULL);
+	if(now != rendered){
+		struct tm tm;
+		localtime_r(&now, &tm);
+		str_size = strftime(str_time, sizeof(str_time), "timestamp:%a, %d %b %Y %T %z\n", &tm);
+		rendered = now;
 	}
-	int fflags = O_RDWR | O_APPEND | O_CREAT | O_TRUNC;
-	int fd;
-  fd = open(FILEPATH, fflags, 0666);
-  if(fd == -1){
-		syslog(LOG_ERR, "open FAILED error:%s", strerror(errno));
+	*len = str_size;
+	return str_time;
+}
+
+void timer_handler(){
+	uint64_t expirations;
+	if(read(g_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations)){
+		/* Spurious wakeup, nothing has expired */
 		return;
 	}
-	time_t now;
-	now = time(NULL);
-	struct tm* time = localtime(&now);
-	char* format = "timestamp:%a, %d %b %Y %T %z\n";
-	char str_time[50];
-	size_t str_size = strftime(str_time, 50, format, time);
-	syslog(LOG_INFO, "watchdog %s", str_time);
-	printf("WATCHDOG %s", str_time);
-	pthread_mutex_lock(&mutex);
-	write_to_file(fd, str_time, str_size);
-	pthread_mutex_unlock(&mutex);
-	close(fd);
+	size_t str_size;
+	const char* str_time = timestamp_packet(&str_size);
+	aesd_log(LOG_INFO, "watchdog %s", str_time);
+	commit_packet(0, str_time, str_size, NULL);
 }
@@ -7,6 +7,134 @@
  * @date April 10, 2023
  *
  */
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+
+#if !USE_AESD_CHAR_DEVICE
+#define FILEPATH "/var/tmp/aesdsocketdata"
+#else
+#define FILEPATH "/dev/aesdchar"
+#endif
+
+#define BUFSIZE 512
+#define CONN_MEMORY_MIN 4096 // smallest -m, one receive chunk of any engine must fit
+#define CHUNK_MAX (16 * 1024 * 1024) // largest -i and -c
+
+#define SEEK_COMMAND "AESDCHAR_IOCSEEKTO:" // AESDCHAR_IOCSEEKTO:X,Y - read back from record X, byte Y
+#define SINCE_COMMAND "AESDSOCKET_SINCE:" // AESDSOCKET_SINCE:[B | X,Y] - switch to incremental read-back
+#define SUBSCRIBE_COMMAND "AESDSOCKET_SUBSCRIBE:" // AESDSOCKET_SUBSCRIBE:[B | X,Y] - push every new packet, after the history from B or X,Y
+#define CHANNEL_COMMAND "AESDSOCKET_CHANNEL:" // AESDSOCKET_CHANNEL:K - append to and read back log K of the -n channels
+#define COMPRESS_COMMAND "AESDSOCKET_COMPRESS:" // AESDSOCKET_COMPRESS: - answer with zlib frames of aesd-compress.h from now on
+#define CHANNEL_MAX 64 // largest -n
+#define PACKET_SUBSCRIBED 2 // process_packet result: the connection goes to subscribe_add
+#define PACKET_CHANNEL 3 // process_packet result: the engine replaces its backend descriptor with session.channel_fd
+
+#define DRAIN_DEFAULT_S 5 // seconds the connections get to finish after SIGTERM when -x is not given
+#define DRAIN_KICK_MS 100 // interval of the DRAIN_SIGNAL kicks and the drain checks
+#define DRAIN_SIGNAL SIGUSR1 // interrupts a connection thread blocked in recv or send
+
+#define BUSY_REPLY "ERROR: server busy\n" // sent to a connection over the -C limit before closing it
+#define OVERSIZE_REPLY "ERROR: buffer limit exceeded\n" // sent when a connection outgrows -m
+
+/*
+ * Connection handling engines selectable from the command line
+ */
+enum server_mode {
+	MODE_THREAD = 0, /* One thread per accepted connection */
+	MODE_EPOLL, /* Fixed number of edge-triggered epoll reactors (-e) */
+	MODE_POOL, /* Fixed number of workers fed through a lock-free queue (-p) */
+	MODE_URING /* One io_uring instance driving every connection (-u) */
+};
+/*
+ * Conversation log backends selectable from the command line
+ */
+enum log_backend {
+	BACKEND_STORAGE = 0, /* FILEPATH, a regular file or the char device by USE_AESD_CHAR_DEVICE */
+	BACKEND_RING, /* In-process ring of the last packets (-r, -R) */
+	BACKEND_SEGMENT /* Directory of fixed-size segment files with retention (-G) */
+};
+/*
+ * Server settings parsed from the command line by init_server
+ */
+struct server_config {
+	int daemon; /* Fork to background (-d) */
+	int mode; /* One of server_mode */
+	int workers; /* Number of reactor or pool threads (-w), defaults to the CPU count */
+	int batch; /* Maximum packets written to the log by one writev (-b) */
+	long latency_us; /* Time a batch waits for more packets (-l), 0 - write at once */
+	int backend; /* One of log_backend */
+	long ring_packets; /* Packets kept by the ring (-r), 0 - no packet limit */
+	size_t ring_bytes; /* Bytes kept by the ring (-R) */
+	const char* checkpoint; /* File the ring is checkpointed to (-k), NULL - none */
+	int reuseport; /* One SO_REUSEPORT listener per reactor, reactors pinned to CPUs (-a) */
+	int backlog; /* Pending connections queue length of a listener (-q) */
+	int log_level; /* Least severe syslog priority logged (-L), LOG_DEBUG by default */
+	const char* metrics; /* Metrics endpoint (-M), a local port or a Unix socket path, NULL - none */
+	int max_conns; /* Connections served or queued at once (-C), 0 - no limit */
+	size_t conn_memory; /* Receive buffer limit of a connection in bytes (-m), 0 - no limit */
+	int recv_timeout; /* Seconds a connection may wait for the rest of a packet (-I), 0 - forever */
+	int send_timeout; /* Seconds a read-back may make no progress (-O), 0 - forever */
+	const char* unix_path; /* Unix domain stream socket served next to TCP (-U), NULL - none */
+	size_t sub_queue; /* Bytes a subscriber may lag behind (-S) */
+	int sub_policy; /* One of subscribe_policy, lagging subscribers are dropped with -D */
+	const char* segment_dir; /* Directory of the segmented log (-G) */
+	size_t segment_bytes; /* Size a segment is sealed at (-g) */
+	size_t retain_bytes; /* Bytes of segments retained (-T) */
+	long retain_s; /* Seconds a sealed segment is retained (-A), 0 - no age limit */
+	int drain_s; /* Seconds the connections get to finish after SIGTERM or a hand-over (-x), 0 - exit at once */
+	const char* handoff; /* Unix socket the listeners are handed over through on a restart (-H), NULL - none */
+	size_t recv_chunk; /* Least free space a connection receives into (-i), BUFSIZE by default */
+	size_t readback_chunk; /* Bytes moved per read-back syscall by splice, the copies and io_uring (-c) */
+	int rcvbuf; /* SO_RCVBUF of the listeners, inherited by their connections (-V), 0 - autotuned */
+	int sndbuf; /* SO_SNDBUF of the listeners, inherited by their connections (-W), 0 - autotuned */
+	int nodelay; /* TCP_NODELAY on the TCP connections, Nagle's algorithm is off (-N) */
+	int cork; /* TCP_CORK around every read-back, only full segments leave until it ends (-K) */
+	int defer_accept; /* Seconds TCP_DEFER_ACCEPT holds a connection until its first bytes (-F), 0 - off */
+	int channels; /* Independent logs selected by CHANNEL_COMMAND (-n), 1 - only the default one */
+	size_t compress_cache; /* Bytes of compressed frames of whole log blocks kept (-z), 0 - none */
+};
+
+extern struct server_config g_config;
+/*
+ * Cleared by the signal handler. Every loop of the server checks it.
+ */
+extern volatile int work_state;
+/*
+ * Set by the first SIGTERM or SIGINT and by a hand-over. The engines stop
+ * accepting, finish the packets in flight and close the connections between
+ * packets. work_state is cleared when the drain deadline passes
+ */
+extern volatile int drain_state;
+/*
+ * Timestamp timerfd, -1 if timestamps are disabled. The loop of the running
+ * engine waits for it to become readable and calls timer_handler
+ */
+extern int g_timerfd;
+/*
+ * Unix domain listener, -1 if there is none. Every engine accepts from it
+ * next to the TCP listener and serves its connections the same way
+ */
+extern int g_unixfd;
+
+struct proc_data;
+/*
+ * Per-connection protocol state
+ */
+struct session {
+	int incremental; /* SINCE_COMMAND was received: answer only bytes the client has not seen */
+	off_t cursor; /* Log offset up to which the last read-back reached */
+	struct arena* arena; /* Arena of the connection, its scratch buffer serves record scans */
+	int channel; /* Log the packets are appended to and read back from, CHANNEL_COMMAND switches it */
+	int channel_fd; /* Backend descriptor of the new channel, valid when process_packet returns PACKET_CHANNEL */
+	int compress; /* COMPRESS_COMMAND was received: read-backs are sent as compressed frames */
+};
+struct framer;
+struct frame;
+struct arena;
 
 /**
  * @brief This function converts a sockaddr structure
@@ -17,6 +145,46 @@
  * @return 
  */
 void *get_in_addr(struct sockaddr *sa);
+/**
+ * @brief This function takes an accepted connection into service if the -C limit
+ * allows it and applies the send and receive timeouts to the socket. Otherwise
+ * the connection is shed with BUSY_REPLY and must be closed by the caller
+ *
+ * @param sd accepted socket descriptor
+ * @return success status 0 - admitted, -1 - shed
+ */
+int admit_connection(int sd);
+/**
+ * @brief This function returns the slot of an admitted connection once it is closed
+ *
+ * @return void
+ */
+void leave_connection();
+/**
+ * @brief This function tells a client why its connection is dropped. The reply is
+ * sent without blocking and may be lost, the caller closes the socket
+ *
+ * @param sd socket descriptor
+ * @param reply BUSY_REPLY or OVERSIZE_REPLY
+ * @return void
+ */
+void shed_connection(int sd, const char* reply);
+/**
+ * @brief This function returns the clock the connection timeouts are measured with
+ *
+ * @return CLOCK_MONOTONIC_COARSE seconds
+ */
+time_t idle_clock();
+/**
+ * @brief This function checks a connection of the epoll or io_uring engine against
+ * the -I or -O timeout. The blocking engines use SO_RCVTIMEO and SO_SNDTIMEO instead
+ *
+ * @param sending the connection is streaming the read-back
+ * @param active idle_clock() of the last progress of the connection
+ * @param now current idle_clock()
+ * @return 1 - timed out, 0 - not
+ */
+int idle_expired(int sending, time_t active, time_t now);
 /**
  * @brief This function is competely writing char buffer to a file
  *
@@ -35,27 +203,62 @@ int write_to_file(int fd, const char* buf, size_t n_byte);
  */
 int init_server(int argc, char** argv);
 /**
- * @brief This function initialise socket listener in the server side
+ * @brief This function initialise socket listener in the server side.
+ * A dual-stack IPv6 socket is preferred, IPv4 is used when IPv6 is not available
  *
  * @return success status 0 - success
  */
 int init_socket();
 /**
- * @brief This function recieves data from a given socket and writes data to a given file
+ * @brief This function opens a socket listener with init_socket and starts
+ * listening with the configured backlog
  *
- * @param fd destination file descriptor
+ * @return listening socket descriptor, -1 on error
+ */
+int init_listener();
+/**
+ * @brief This function opens the g_config.unix_path listener. A stale socket
+ * file of a previous run is replaced
+ *
+ * @return listening socket descriptor, -1 on error
+ */
+int init_unix_listener();
+/**
+ * @brief This function formats the peer address of an accepted connection for the log
+ *
+ * @param sa address returned by accept
+ * @param s destination buffer of INET6_ADDRSTRLEN bytes
+ * @return void
+ */
+void peer_address(struct sockaddr_storage* sa, char* s);
+/**
+ * @brief This function recieves bytes from a given socket into a private buffer until
+ * it holds a newline terminated packet and processes the packet with process_packet.
+ * Bytes after the packet stay in the buffer for the next call
+ *
+ * @param fd backend file descriptor, replaced by the one of the new channel after CHANNEL_COMMAND
  * @param sockfd source socket descriptor
- * @return success status 0 - success
+ * @param fr receive buffer of the connection
+ * @param s session of the connection
+ * @param start receives the log offset to read back from
+ * @param end receives the log offset to read back up to, -1 - read to the end of file
+ * @return 0 - packet processed, 1 - peer closed the connection, PACKET_SUBSCRIBED - the
+ * client subscribed with *start as the history offset, -1 - error
  */
-int recieve_to_file(int fd, int sockfd);
+int recieve_to_file(int* fd, int sockfd, struct framer* fr, struct session* s, off_t* start, off_t* end);
 /**
  * @brief This function reads data from a given file and sends data to a given socket
  *
  * @param sockfd destination socket descriptor
  * @param fd destination file descriptor
- * @return success status 0 - success
+ * @param start log offset to send from
+ * @param limit log offset to send up to, -1 - send to the end of file
+ * @param s session of the connection, its arena lends the scratch buffer to copies
+ * and its compress flag selects the compressed frames
+ * @return log offset after the last byte sent, -1 on error or when the server
+ * stopped before the end was sent
  */
-int send_from_file(int fd, int sockfd);
+off_t send_from_file(int fd, int sockfd, off_t start, off_t limit, struct session* s);
 /**
  * @brief This function competely sends a char buffer to a given socket
  *
@@ -73,12 +276,59 @@ int send_to_socket(int sockfd, char* buf, size_t n_byte);
  */
 void signal_handler(int signo);
 /**
- * @brief This is the thread function for realizing recive\send logic
+ * @brief This function starts draining the server and wakes up the engines.
+ * The deadline is counted from the first call. It is async-signal-safe
+ *
+ * @return void
+ */
+void start_drain();
+/**
+ * @brief This function checks the drain deadline. Once it has passed work_state
+ * is cleared and the engines are woken up to close the remaining connections
  *
- * @param arg must be a pointer to the proc_data structure
- * @return returns a pointer to the intial proc_data structure
+ * @return 1 - the deadline has passed, 0 - not
+ */
+int drain_expired();
+/**
+ * @brief This function tells whether a draining server may close a connection:
+ * it is waiting between two packets. A connection which has not sent a byte yet
+ * is kept until the deadline, its first packet may be on the way
+ *
+ * @param fr receive buffer of the connection
+ * @return 1 - close the connection, 0 - keep serving it
+ */
+int drain_ready(const struct framer* fr);
+/**
+ * @brief This function joins a thread which may be blocked in recv or send of a
+ * connection. The thread is interrupted with DRAIN_SIGNAL until it notices work_state
+ *
+ * @param thr thread to join
+ * @return void
+ */
+void kick_join(pthread_t thr);
+/**
+ * @brief This function realizes recive\send logic for an accepted connection.
+ * The socket is left open for the caller
+ *
+ * @param data accepted connection
+ * @return success status 0 - success
+ */
+int process_connection(struct proc_data* data);
+/**
+ * @brief This is the thread function for realizing recive\send logic.
+ * When the connection is served the thread closes the socket and queues its node for reap_connections
+ *
+ * @param arg must be a pointer to the thr_node structure of the thread
+ * @return returns a pointer to the proc_data structure of the node
  */
 void* connection_processor(void* arg);
+/**
+ * @brief This function joins finished connection threads and releases their
+ * memory. Called by the accept loop
+ *
+ * @return void
+ */
+void reap_connections();
 /**
  * @brief This function deinitialise socket server
  *
@@ -86,26 +336,118 @@ void* connection_processor(void* arg);
  */
 void deinit();
 /**
- * @brief This function initialise and arms the timer for the 10 sec interval
+ * @brief This function creates g_timerfd and arms it for the 10 sec interval
  *
  * @return void
  */
 void init_timer();
 /**
- * @brief This function disarms the timer
+ * @brief This function closes g_timerfd
  *
  * @return void
  */
 void deinit_timer();
 
+/**
+ * @brief This function parses "AESDCHAR_IOCSEEKTO:X,Y" command
+ *
+ * @param buf NUL terminated command. The buffer is modified
+ * @param write_cmd receives X
+ * @param write_cmd_offset receives Y
+ * @return success status 0 - success
+ */
 int parse_seek_to(char* buf, uint32_t *write_cmd, uint32_t *write_cmd_offset);
-
 /**
- * @brief This function calls by kerner each 10 seconds, if init_timer was called
- * This function appends tiimestamps to the file with conversation log
+ * @brief This function parses seek command and applies it to the backend with AESDCHAR_IOCSEEKTO ioctl.
+ * The regular-file log and the ring are searched for the record instead
+ *
+ * @param s session of the connection
+ * @param fd backend file descriptor
+ * @param buf NUL terminated command. The buffer is modified
+ * @return new file position or -1 on error
+ */
+long apply_seek_to(struct session* s, int fd, char* buf);
+/**
+ * @brief This function finds the log offset of a byte in a given record of the regular-file log
+ *
+ * @param fd backend file descriptor
+ * @param record zero referenced newline terminated record
+ * @param offset zero referenced byte within the record
+ * @param limit committed log length
+ * @param scratch -c readback_chunk buffer to read the log into, NULL - a BUFSIZE stack buffer
+ * @return log offset or -1 if the position is not in the log
+ */
+off_t find_record_offset(int fd, uint32_t record, uint32_t offset, off_t limit, char* scratch);
+/**
+ * @brief This function parses the argument of "AESDSOCKET_SINCE:" and "AESDSOCKET_SUBSCRIBE:".
+ * Without an argument the read-back starts at the session cursor, "B" is a byte offset,
+ * "X,Y" is a record and an offset within it
+ *
+ * @param s session of the connection
+ * @param fd backend file descriptor
+ * @param arg NUL terminated argument following the command name
+ * @param start receives the log offset to read back from
+ * @return success status 0 - success
+ */
+int apply_since(struct session* s, int fd, char* arg, off_t* start);
+/**
+ * @brief This function parses the argument of "AESDSOCKET_CHANNEL:", opens the
+ * backend of that log and moves the session to it. The caller closes its old
+ * descriptor and uses the returned one from then on
+ *
+ * @param s session of the connection
+ * @param arg NUL terminated channel number following the command name
+ * @return backend descriptor of the channel, -1 - no such channel or open error
+ */
+int apply_channel(struct session* s, char* arg);
+/**
+ * @brief This function builds the backend path of a channel: FILEPATH for 0,
+ * FILEPATH followed by the number for the others, e.g. /dev/aesdchar1
+ *
+ * @param channel channel number
+ * @param path receives the path, PATH_MAX bytes
  * @return void
  */
-void timer_handler(sigval_t val);
+void channel_path(int channel, char* path);
+/**
+ * @brief This function commits a complete packet or applies a command and
+ * returns the part of the log the client must receive back. After SUBSCRIBE_COMMAND
+ * nothing is read back, the caller hands the connection to subscribe_add instead.
+ * CHANNEL_COMMAND is answered with the history of the new channel, read from
+ * s->channel_fd once the caller installed it. COMPRESS_COMMAND is answered with
+ * the history the next packet would get, already compressed
+ *
+ * @param s session of the connection
+ * @param fd backend file descriptor
+ * @param f packet taken by framer_next. f->data[f->len] is used for a NUL terminator and restored
+ * @param start receives the log offset to read back from
+ * @param end receives the log offset to read back up to, -1 - read to the end of file
+ * @return success status 0 - success, PACKET_SUBSCRIBED - subscribe from the history offset *start,
+ * PACKET_CHANNEL - close fd and read back from s->channel_fd from now on
+ */
+int process_packet(struct session* s, int fd, struct frame* f, off_t* start, off_t* end);
+/**
+ * @brief This function opens the conversation log for appending and reading back
+ *
+ * @param channel log of the -n channels, 0 - the default one
+ * @return file descriptor or -1 on error
+ */
+int open_backend(int channel);
+/**
+ * @brief This function returns the timestamp packet for the current second.
+ * The packet is rendered only when the second changes. Must be called by the
+ * thread serving g_timerfd only
+ *
+ * @param len receives the packet length
+ * @return newline terminated timestamp packet
+ */
+const char* timestamp_packet(size_t* len);
+/**
+ * @brief This function calls by the engine loop when g_timerfd is readable.
+ * It consumes the expirations and appends a timestamp to the conversation log
+ * @return void
+ */
+void timer_handler();
 /*
  * Structure for sending data to the thread with socket handling
  */
@@ -113,12 +455,19 @@ struct proc_data{
 //	int fd; /*File descriptor for a log file*/
 	int sd; /*Socket descriptor*/
 	char* address;
+	uint64_t accepted; /*metrics_now() of the accept*/
+	struct arena* arena; /* Holds this structure, the address, the thread node and the framing buffer */
 };
 /*
  * Structure for Connected list implementation
  */
 struct thr_node_s {
 	pthread_t thr; /* Thread descriptor*/
+	struct proc_data* data; /* Connection served by the thread */
+	struct thr_node_s* prev; /* Pointer to the previous node. NULL for the head*/
 	struct thr_node_s* next; /* Pointer to the next node. NULL if node is not exists*/
-} thr_node_s_default = {0, NULL};
+	struct thr_node_s* done_next; /* Link in the list of finished threads */
+};
 typedef struct thr_node_s thr_node;
+
+#endif /* AESDSOCKET_H */